@@ -0,0 +1,93 @@
+#include <stdbool.h>
+
+#include "histogram.h"
+
+#define SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+
+static unsigned int HistogramBucket(uint64_t value) {
+    unsigned int exponent;
+
+    if(value < SUB_BUCKETS) {
+        return value;
+    }
+
+    if( value >= (1ull << HISTOGRAM_MAX_BITS) ) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Position of the highest set bit picks the power of two, the next bits down pick the bucket within it
+    exponent = 63 - __builtin_clzll(value);
+    return ( (exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS ) + ( (value >> (exponent - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1) );
+}
+
+// Largest value that falls in the bucket
+static uint64_t HistogramBucketLimit(unsigned int bucket) {
+    unsigned int exponent;
+
+    if(bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    return ( ((uint64_t)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) + 1) << (exponent - HISTOGRAM_SUB_BITS) ) - 1;
+}
+
+void HistogramRecord(struct Histogram *histogram, uint64_t value) {
+    uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[HistogramBucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total, value, __ATOMIC_RELAXED);
+
+    while( (value > max) &&
+           !__atomic_compare_exchange_n(&histogram->max, &max, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+        // max reloaded by the failed exchange
+    }
+}
+
+uint64_t HistogramCount(const struct Histogram *histogram) {
+    return __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+}
+
+uint64_t HistogramMax(const struct Histogram *histogram) {
+    return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+double HistogramMean(const struct Histogram *histogram) {
+    uint64_t count = HistogramCount(histogram);
+
+    return count ? ( (double)__atomic_load_n(&histogram->total, __ATOMIC_RELAXED) / count ) : 0.0;
+}
+
+uint64_t HistogramPercentile(const struct Histogram *histogram, double percentile) {
+    uint64_t count = 0;
+    uint64_t max = HistogramMax(histogram);
+    uint64_t target;
+    uint64_t limit;
+
+    // Sum the buckets rather than trust count, which may have moved on since they were read
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+    }
+
+    if(count == 0) {
+        return 0;
+    }
+
+    target = (uint64_t)( (percentile / 100.0) * count + 0.5 );
+    if(target < 1) {
+        target = 1;
+    }
+
+    count = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+        if(count >= target) {
+            limit = HistogramBucketLimit(i);
+            return (limit < max) ? limit : max;
+        }
+    }
+
+    return max;
+}
@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear buckets in the manner of HdrHistogram: each power of two is split into 2^HISTOGRAM_SUB_BITS
+// equal buckets, so any recorded value is known to within 12.5%.  Values from 0 to 2^24 (about 16 seconds
+// in microseconds) are covered and anything larger lands in the top bucket.
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 24
+#define HISTOGRAM_BUCKETS ( (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS )
+
+// Counters are updated with relaxed atomics, so one thread can record while another reads without locking.
+// A reader may see a count from slightly before or after a concurrent record, never a torn value.
+struct Histogram {
+    uint32_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+};
+
+void HistogramRecord(struct Histogram *histogram, uint64_t value);
+
+uint64_t HistogramCount(const struct Histogram *histogram);
+uint64_t HistogramMax(const struct Histogram *histogram);
+double HistogramMean(const struct Histogram *histogram);
+
+// Upper edge of the bucket holding the given percentile (0 to 100), capped at the largest value recorded
+uint64_t HistogramPercentile(const struct Histogram *histogram, double percentile);
+
+#endif
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "logger.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_VERSION 1
+
+#define RECORD_MAGIC 0x5243 // "CR"
+#define PAD_MAGIC 0x4150 // "PA", fills the end of the ring when a record doesn't fit there
+#define RECORD_ALIGN 16
+
+// Records start on RECORD_ALIGN boundaries and never wrap, so the space left at the end of the ring is
+// always either nothing or room for at least a pad record
+struct JournalRecord {
+    uint16_t magic;
+    uint16_t topic_length; // Including the terminator
+    uint32_t size; // Whole record, header and padding included
+    uint32_t length; // Of the payload, which follows the topic
+    uint32_t checksum; // FNV-1a over topic and payload
+};
+
+static uint32_t Checksum(const uint8_t *data, uint32_t length, uint32_t hash) {
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static struct JournalRecord *RecordAt(const struct Journal *journal, uint64_t offset) {
+    return (struct JournalRecord *)( journal->records + (offset % journal->capacity) );
+}
+
+static uint32_t RecordChecksum(const struct JournalRecord *record) {
+    const uint8_t *data = (const uint8_t *)(record + 1);
+
+    return Checksum(data, record->topic_length + record->length, 2166136261u);
+}
+
+// Whether a record found in the file is whole and fits where it says it does
+static bool RecordValid(const struct Journal *journal, uint64_t offset, uint64_t head) {
+    const struct JournalRecord *record = RecordAt(journal, offset);
+    uint64_t space = journal->capacity - (offset % journal->capacity);
+
+    if( (record->size < sizeof(struct JournalRecord)) || (record->size % RECORD_ALIGN) ||
+        (record->size > space) || (record->size > (head - offset)) ) {
+        return false;
+    }
+
+    if(record->magic == PAD_MAGIC) {
+        return (record->size == space);
+    }
+
+    return (record->magic == RECORD_MAGIC) && (record->topic_length > 0) &&
+           ( (sizeof(struct JournalRecord) + record->topic_length + record->length) <= record->size ) &&
+           ( ((const char *)(record + 1))[record->topic_length - 1] == '\0' ) &&
+           ( RecordChecksum(record) == record->checksum );
+}
+
+// Keeps the records from the tail up to the first that isn't intact, from a crash part way through a write
+static void Recover(struct Journal *journal) {
+    struct JournalHeader *header = journal->header;
+    uint64_t offset = header->tail;
+    unsigned long count = 0;
+
+    while( (offset < header->head) && RecordValid(journal, offset, header->head) ) {
+        if(RecordAt(journal, offset)->magic == RECORD_MAGIC) {
+            count++;
+        }
+        offset += RecordAt(journal, offset)->size;
+    }
+
+    if(offset != header->head) {
+        LOG(LOG_WARNING, "Journal: Discarded %llu bytes of damaged records", (unsigned long long)(header->head - offset));
+        header->head = offset;
+    }
+
+    if(count > 0) {
+        LOG(LOG_INFO, "Journal: %lu messages waiting from an earlier run", count);
+    }
+}
+
+bool JournalOpen(struct Journal *journal, const char *path, uint64_t size) {
+    struct JournalHeader *header;
+    struct stat status;
+    uint64_t capacity = size - (size % RECORD_ALIGN);
+    bool fresh;
+    void *map;
+
+    journal->fd = -1;
+
+    if(capacity < (4 * RECORD_ALIGN)) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if( ((journal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) || (fstat(journal->fd, &status) < 0) ) {
+        goto failed;
+    }
+
+    // Claim every block up front so a full disk shows up now rather than as SIGBUS later
+    fresh = ( (uint64_t)status.st_size != (JOURNAL_HEADER_SIZE + capacity) );
+    if( fresh && (((errno = posix_fallocate(journal->fd, 0, JOURNAL_HEADER_SIZE + capacity)) != 0) ||
+                  (ftruncate(journal->fd, JOURNAL_HEADER_SIZE + capacity) < 0)) ) {
+        goto failed;
+    }
+
+    if( (map = mmap(NULL, JOURNAL_HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0)) == MAP_FAILED ) {
+        goto failed;
+    }
+
+    journal->header = header = map;
+    journal->records = (uint8_t *)map + JOURNAL_HEADER_SIZE;
+    journal->capacity = capacity;
+
+    if( fresh || (header->magic != JOURNAL_MAGIC) || (header->version != JOURNAL_VERSION) ||
+        (header->capacity != capacity) || (header->tail > header->head) || ((header->head - header->tail) > capacity) ) {
+        if(!fresh) {
+            LOG(LOG_WARNING, "Journal: %s is not a journal of this size, starting it afresh", path);
+        }
+
+        memset(header, 0, sizeof(*header));
+        header->magic = JOURNAL_MAGIC;
+        header->version = JOURNAL_VERSION;
+        header->capacity = capacity;
+    }
+    else {
+        Recover(journal);
+    }
+
+    return true;
+
+failed:
+    if(journal->fd >= 0) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    return false;
+}
+
+void JournalClose(struct Journal *journal) {
+    if(journal->fd < 0) {
+        return;
+    }
+
+    JournalSync(journal);
+    munmap(journal->header, JOURNAL_HEADER_SIZE + journal->capacity);
+    close(journal->fd);
+    journal->fd = -1;
+}
+
+static void DropOldest(struct Journal *journal) {
+    struct JournalHeader *header = journal->header;
+    const struct JournalRecord *record = RecordAt(journal, header->tail);
+
+    if(record->magic == RECORD_MAGIC) {
+        header->dropped++;
+    }
+
+    header->tail += record->size;
+}
+
+bool JournalAppend(struct Journal *journal, const char *topic, const void *payload, uint32_t length) {
+    struct JournalHeader *header = journal->header;
+    struct JournalRecord *record;
+    uint32_t topic_length = strlen(topic) + 1;
+    uint64_t size = sizeof(struct JournalRecord) + topic_length + length;
+    uint64_t space;
+    uint64_t needed;
+
+    size += (RECORD_ALIGN - (size % RECORD_ALIGN)) % RECORD_ALIGN;
+
+    // Half the ring at most, so it can always be made to fit after a pad
+    if( size > (journal->capacity / 2) ) {
+        return false;
+    }
+
+    space = journal->capacity - (header->head % journal->capacity);
+    needed = (size > space) ? (space + size) : size;
+
+    while( (journal->capacity - (header->head - header->tail)) < needed ) {
+        DropOldest(journal);
+    }
+
+    if(size > space) {
+        record = RecordAt(journal, header->head);
+        record->magic = PAD_MAGIC;
+        record->topic_length = 0;
+        record->size = space;
+        record->length = 0;
+        record->checksum = 0;
+        header->head += space;
+    }
+
+    record = RecordAt(journal, header->head);
+    record->magic = RECORD_MAGIC;
+    record->topic_length = topic_length;
+    record->size = size;
+    record->length = length;
+    memcpy(record + 1, topic, topic_length);
+    memcpy((uint8_t *)(record + 1) + topic_length, payload, length);
+    record->checksum = RecordChecksum(record);
+
+    // Only counted once it is complete, so a crash part way through leaves nothing half written in view
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->head += size;
+
+    return true;
+}
+
+bool JournalRead(const struct Journal *journal, uint64_t *cursor, struct JournalEntry *entry) {
+    const struct JournalHeader *header = journal->header;
+    const struct JournalRecord *record;
+
+    if(*cursor < header->tail) {
+        *cursor = header->tail;
+    }
+
+    while(*cursor < header->head) {
+        record = RecordAt(journal, *cursor);
+
+        if(record->magic == RECORD_MAGIC) {
+            entry->topic = (const char *)(record + 1);
+            entry->payload = (const uint8_t *)(record + 1) + record->topic_length;
+            entry->length = record->length;
+            entry->end = *cursor + record->size;
+            return true;
+        }
+
+        *cursor += record->size;
+    }
+
+    return false;
+}
+
+void JournalRelease(struct Journal *journal, uint64_t end) {
+    struct JournalHeader *header = journal->header;
+
+    // Drops may already have taken it
+    if( (end > header->tail) && (end <= header->head) ) {
+        header->tail = end;
+    }
+}
+
+uint64_t JournalUsed(const struct Journal *journal) {
+    return journal->header->head - journal->header->tail;
+}
+
+void JournalSync(struct Journal *journal) {
+    if( msync(journal->header, JOURNAL_HEADER_SIZE + journal->capacity, MS_SYNC) < 0 ) {
+        LOG(LOG_WARNING, "Journal: Unable to write back: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Append-only ring of MQTT messages in a memory mapped file of fixed size, kept while the broker can't be
+// reached.  The file holds a header page followed by the records.  Offsets count every byte ever written and
+// are reduced modulo the capacity to find a record, so tail <= head and head - tail is the space in use.
+// When there isn't room for a new message the oldest are dropped.  The file is allocated in full when
+// created, so it never grows, and is picked up again after a restart.
+
+#define JOURNAL_HEADER_SIZE 4096
+
+struct JournalHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity; // Bytes of records following the header
+    uint64_t head; // Where the next record goes
+    uint64_t tail; // Oldest record not yet delivered
+    uint64_t dropped; // Records lost to make room, over the life of the file
+};
+
+struct Journal {
+    int fd;
+    struct JournalHeader *header; // Start of the mapping
+    uint8_t *records;
+    uint64_t capacity;
+};
+
+// A record as handed out by JournalRead().  Pointers are into the mapping and stay valid until the
+// record is released or dropped
+struct JournalEntry {
+    const char *topic;
+    const void *payload;
+    uint32_t length;
+    uint64_t end; // Offset just past the record
+};
+
+// Opens or creates a journal of the given size.  A file from an earlier run with the same capacity is
+// checked record by record and anything after the first damaged one discarded
+bool JournalOpen(struct Journal *journal, const char *path, uint64_t size);
+void JournalClose(struct Journal *journal);
+
+// Returns false if the message can never fit
+bool JournalAppend(struct Journal *journal, const char *topic, const void *payload, uint32_t length);
+
+// Reads the record at *cursor.  The cursor is first moved on to the oldest record if drops have overtaken it,
+// and past any padding, but never past the record returned, so the caller can decide whether to move it to
+// entry->end.  Returns false once there are no more
+bool JournalRead(const struct Journal *journal, uint64_t *cursor, struct JournalEntry *entry);
+
+// Everything before end has been delivered and the space can be reused
+void JournalRelease(struct Journal *journal, uint64_t end);
+
+uint64_t JournalUsed(const struct Journal *journal);
+
+// Writes the mapping back to the file and waits for it
+void JournalSync(struct Journal *journal);
+
+#endif
@@ -0,0 +1,132 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "logger.h"
+
+#define LOG_RING_SIZE 256 // Must be a power of two
+#define LOG_LINE_MAX 160
+
+struct LogRing {
+    char lines[LOG_RING_SIZE][LOG_LINE_MAX];
+    enum LogLevel levels[LOG_RING_SIZE];
+    unsigned int head; // Free running write index
+    unsigned int tail; // Free running read index
+    unsigned long dropped;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+volatile enum LogLevel log_level = LOG_INFO;
+
+static struct LogRing log_ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_t log_thread;
+
+static const char *log_level_names[] = {
+    [LOG_ERROR] = "ERROR",
+    [LOG_WARNING] = "WARNING",
+    [LOG_INFO] = "INFO",
+    [LOG_DEBUG] = "DEBUG",
+};
+
+void LogMessage(enum LogLevel level, const char *format, ...) {
+    va_list args;
+    unsigned int slot;
+
+    pthread_mutex_lock(&log_ring.lock);
+
+    if( (log_ring.head - log_ring.tail) < LOG_RING_SIZE ) {
+        slot = log_ring.head & (LOG_RING_SIZE - 1);
+
+        va_start(args, format);
+        vsnprintf(log_ring.lines[slot], LOG_LINE_MAX, format, args);
+        va_end(args);
+
+        log_ring.levels[slot] = level;
+        log_ring.head++;
+        pthread_cond_signal(&log_ring.not_empty);
+    }
+    else {
+        log_ring.dropped++;
+    }
+
+    pthread_mutex_unlock(&log_ring.lock);
+}
+
+static void *LogThread(void *param) {
+    char line[LOG_LINE_MAX];
+    enum LogLevel level;
+    unsigned int slot;
+
+    pthread_mutex_lock(&log_ring.lock);
+
+    while( log_ring.running || (log_ring.head != log_ring.tail) ) {
+        if(log_ring.head == log_ring.tail) {
+            pthread_cond_wait(&log_ring.not_empty, &log_ring.lock);
+            continue;
+        }
+
+        // Copy out and write without holding the lock, so a slow stdout never stalls LogMessage()
+        slot = log_ring.tail & (LOG_RING_SIZE - 1);
+        memcpy(line, log_ring.lines[slot], LOG_LINE_MAX);
+        level = log_ring.levels[slot];
+        log_ring.tail++;
+
+        pthread_mutex_unlock(&log_ring.lock);
+
+        if(level <= LOG_WARNING) {
+            fprintf(stderr, "%s: %s\n", log_level_names[level], line);
+        }
+        else {
+            printf("%s\r\n", line);
+        }
+
+        // Only flush once the ring has been drained
+        pthread_mutex_lock(&log_ring.lock);
+        if(log_ring.head == log_ring.tail) {
+            pthread_mutex_unlock(&log_ring.lock);
+            fflush(NULL);
+            pthread_mutex_lock(&log_ring.lock);
+        }
+    }
+
+    pthread_mutex_unlock(&log_ring.lock);
+
+    return NULL;
+}
+
+bool LogStart(void) {
+    log_ring.running = true;
+
+    if(pthread_create(&log_thread, NULL, LogThread, NULL) != 0) {
+        log_ring.running = false;
+        return false;
+    }
+
+    return true;
+}
+
+void LogStop(void) {
+    pthread_mutex_lock(&log_ring.lock);
+    log_ring.running = false;
+    pthread_cond_signal(&log_ring.not_empty);
+    pthread_mutex_unlock(&log_ring.lock);
+
+    pthread_join(log_thread, NULL);
+}
+
+unsigned long LogDropped(void) {
+    unsigned long dropped;
+
+    pthread_mutex_lock(&log_ring.lock);
+    dropped = log_ring.dropped;
+    pthread_mutex_unlock(&log_ring.lock);
+
+    return dropped;
+}
@@ -0,0 +1,26 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+
+enum LogLevel {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG,
+};
+
+extern volatile enum LogLevel log_level;
+
+// Check the level before doing any formatting, so disabled messages cost a single compare
+#define LOG(level, ...) do { if( (level) <= log_level ) { LogMessage((level), __VA_ARGS__); } } while(0)
+
+// Formats into a ring buffer and returns without touching stdout.  A background thread does the writing.
+// When the ring is full the message is dropped and counted rather than blocking the caller.
+void LogMessage(enum LogLevel level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+bool LogStart(void);
+void LogStop(void); // Writes out anything still queued
+unsigned long LogDropped(void);
+
+#endif
@@ -0,0 +1,370 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "metrics_server.h"
+
+#define HEADER_MAX 256 // Room kept ahead of the body for the status line and headers
+#define DEFAULT_HOST "127.0.0.1"
+
+#define ERROR_RESPONSE(status, length) \
+    "HTTP/1.1 " status "\r\nContent-Type: text/plain\r\nContent-Length: " #length "\r\nConnection: close\r\n\r\n"
+
+static const char bad_request[] = ERROR_RESPONSE("400 Bad Request", 12) "Bad request\n";
+static const char not_found[] = ERROR_RESPONSE("404 Not Found", 10) "Not found\n";
+static const char not_allowed[] = ERROR_RESPONSE("405 Method Not Allowed", 19) "Method not allowed\n";
+static const char too_large[] = ERROR_RESPONSE("500 Internal Server Error", 29) "Metrics too large for buffer\n";
+
+static double Now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + (now.tv_nsec / 1.0e9);
+}
+
+bool MetricsServerOpen(struct MetricsServer *server, const char *address, unsigned int body_max, MetricsRender render, void *context) {
+    struct addrinfo hints = {0};
+    struct addrinfo *results;
+    char host[256] = DEFAULT_HOST;
+    const char *port = strrchr(address, ':');
+    const int on = 1;
+    size_t length;
+    int status;
+
+    memset(server, 0, sizeof(*server));
+    server->listen_fd = -1;
+    server->render = render;
+    server->context = context;
+    server->size = HEADER_MAX + body_max;
+
+    for (int i = 0; i < METRICS_CONNECTIONS_MAX; i++) {
+        server->connections[i].fd = -1;
+    }
+
+    if(port == NULL) {
+        port = address;
+    }
+    else {
+        length = port - address;
+
+        // [::]:9100 for an IPv6 address
+        if( (length >= 2) && (address[0] == '[') && (address[length - 1] == ']') ) {
+            address++;
+            length -= 2;
+        }
+
+        if(length >= sizeof(host)) {
+            errno = EINVAL;
+            return false;
+        }
+
+        memcpy(host, address, length);
+        host[length] = '\0';
+        port++;
+    }
+
+    if(port[0] == '\0') {
+        errno = EINVAL;
+        return false;
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    if( (status = getaddrinfo(host, port, &hints, &results)) != 0 ) {
+        if(status != EAI_SYSTEM) {
+            errno = EADDRNOTAVAIL;
+        }
+        return false;
+    }
+
+    for (struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+        if( (server->listen_fd = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol)) < 0 ) {
+            continue;
+        }
+
+        setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if( (bind(server->listen_fd, result->ai_addr, result->ai_addrlen) == 0) && (listen(server->listen_fd, METRICS_CONNECTIONS_MAX) == 0) ) {
+            break;
+        }
+
+        status = errno;
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        errno = status;
+    }
+
+    freeaddrinfo(results);
+
+    if(server->listen_fd < 0) {
+        return false;
+    }
+
+    if( (server->buffer = malloc(server->size)) == NULL ) {
+        close(server->listen_fd);
+        server->listen_fd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void CloseConnection(struct MetricsServer *server, struct MetricsConnection *connection) {
+    if(connection->shared) {
+        server->senders--;
+    }
+
+    close(connection->fd);
+    connection->fd = -1;
+}
+
+void MetricsServerClose(struct MetricsServer *server) {
+    for (int i = 0; i < METRICS_CONNECTIONS_MAX; i++) {
+        if(server->connections[i].fd >= 0) {
+            CloseConnection(server, &server->connections[i]);
+        }
+    }
+
+    if(server->listen_fd >= 0) {
+        close(server->listen_fd);
+        server->listen_fd = -1;
+    }
+
+    free(server->buffer);
+    server->buffer = NULL;
+}
+
+static void Accept(struct MetricsServer *server, double now) {
+    struct MetricsConnection *connection = NULL;
+    int fd;
+
+    for (int i = 0; i < METRICS_CONNECTIONS_MAX; i++) {
+        if(server->connections[i].fd < 0) {
+            connection = &server->connections[i];
+            break;
+        }
+    }
+
+    // Only polled for while a slot is free, but play safe and leave the connection in the backlog
+    if(connection == NULL) {
+        return;
+    }
+
+    if( (fd = accept(server->listen_fd, NULL, NULL)) < 0 ) {
+        return;
+    }
+
+    // Accepted sockets don't take these from the listening one
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    connection->fd = fd;
+    connection->request_length = 0;
+    connection->response = NULL;
+    connection->sent = 0;
+    connection->shared = false;
+    connection->opened_s = now;
+}
+
+static void Respond(struct MetricsConnection *connection, const char *response, unsigned int length) {
+    connection->response = response;
+    connection->response_length = length;
+    connection->sent = 0;
+}
+
+// Headers go in just ahead of the body, so the whole response is sent from the buffer in one piece
+static void Render(struct MetricsServer *server) {
+    char *body = server->buffer + HEADER_MAX;
+    char header[HEADER_MAX];
+    unsigned int body_length;
+    int header_length;
+
+    server->response = NULL;
+
+    body_length = server->render(body, server->size - HEADER_MAX, server->context);
+
+    if(body_length >= server->size - HEADER_MAX) {
+        server->stats.too_large++;
+        return;
+    }
+
+    header_length = snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+                             "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+                             "Content-Length: %u\r\nConnection: close\r\n\r\n", body_length);
+
+    memcpy(body - header_length, header, header_length);
+    server->response = body - header_length;
+    server->response_length = header_length + body_length;
+    server->stats.scrapes++;
+}
+
+static void Scrape(struct MetricsServer *server, struct MetricsConnection *connection) {
+    if(server->senders == 0) {
+        Render(server);
+    }
+    else {
+        server->stats.shared++;
+    }
+
+    if(server->response == NULL) {
+        Respond(connection, too_large, sizeof(too_large) - 1);
+        return;
+    }
+
+    Respond(connection, server->response, server->response_length);
+    connection->shared = true;
+    server->senders++;
+}
+
+// Only the request line matters, the headers after it are read to their end and ignored
+static void ParseRequest(struct MetricsServer *server, struct MetricsConnection *connection) {
+    const char *path;
+    size_t path_length;
+
+    if( strncmp(connection->request, "GET ", 4) ) {
+        server->stats.refused++;
+        Respond(connection, not_allowed, sizeof(not_allowed) - 1);
+        return;
+    }
+
+    path = connection->request + 4;
+    path_length = strcspn(path, " ?\r\n");
+
+    if( (path_length != strlen("/metrics")) || strncmp(path, "/metrics", path_length) ) {
+        server->stats.refused++;
+        Respond(connection, not_found, sizeof(not_found) - 1);
+        return;
+    }
+
+    Scrape(server, connection);
+}
+
+// Returns false once the connection has been closed
+static bool ReadRequest(struct MetricsServer *server, struct MetricsConnection *connection) {
+    ssize_t count;
+
+    count = read(connection->fd, connection->request + connection->request_length,
+                 sizeof(connection->request) - 1 - connection->request_length);
+
+    if(count < 0) {
+        if( (errno == EAGAIN) || (errno == EINTR) ) {
+            return true;
+        }
+        CloseConnection(server, connection);
+        return false;
+    }
+
+    if(count == 0) {
+        CloseConnection(server, connection);
+        return false;
+    }
+
+    connection->request_length += count;
+    connection->request[connection->request_length] = '\0';
+
+    if( (strstr(connection->request, "\r\n\r\n") != NULL) || (strstr(connection->request, "\n\n") != NULL) ) {
+        ParseRequest(server, connection);
+    }
+    else if(connection->request_length >= sizeof(connection->request) - 1) {
+        server->stats.refused++;
+        Respond(connection, bad_request, sizeof(bad_request) - 1);
+    }
+
+    return true;
+}
+
+// Sends what the socket will take.  The connection is closed once it is all gone
+static void SendResponse(struct MetricsServer *server, struct MetricsConnection *connection) {
+    ssize_t count;
+
+    while(connection->sent < connection->response_length) {
+        count = send(connection->fd, connection->response + connection->sent, connection->response_length - connection->sent,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if(count < 0) {
+            if( (errno == EAGAIN) || (errno == EINTR) ) {
+                return;
+            }
+            break;
+        }
+
+        connection->sent += count;
+    }
+
+    CloseConnection(server, connection);
+}
+
+void MetricsServerPoll(struct MetricsServer *server, int timeout_ms) {
+    struct pollfd fds[METRICS_CONNECTIONS_MAX + 1];
+    struct MetricsConnection *polled[METRICS_CONNECTIONS_MAX + 1];
+    struct MetricsConnection *connection;
+    unsigned int count = 0;
+    bool slot_free = false;
+    double now;
+
+    for (int i = 0; i < METRICS_CONNECTIONS_MAX; i++) {
+        connection = &server->connections[i];
+
+        if(connection->fd < 0) {
+            slot_free = true;
+            continue;
+        }
+
+        fds[count].fd = connection->fd;
+        fds[count].events = (connection->response == NULL) ? POLLIN : POLLOUT;
+        polled[count++] = connection;
+    }
+
+    if(slot_free) {
+        fds[count].fd = server->listen_fd;
+        fds[count].events = POLLIN;
+        polled[count++] = NULL;
+    }
+
+    if(poll(fds, count, timeout_ms) < 0) {
+        return;
+    }
+
+    now = Now();
+
+    for (unsigned int i = 0; i < count; i++) {
+        if( (connection = polled[i]) == NULL ) {
+            if(fds[i].revents & POLLIN) {
+                Accept(server, now);
+            }
+            continue;
+        }
+
+        if(fds[i].revents == 0) {
+            continue;
+        }
+
+        // Errors and hang ups show up as a failed read or send
+        if( (connection->response == NULL) && !ReadRequest(server, connection) ) {
+            continue;
+        }
+
+        // Usually all fits the socket buffer straight away
+        if(connection->response != NULL) {
+            SendResponse(server, connection);
+        }
+    }
+
+    for (int i = 0; i < METRICS_CONNECTIONS_MAX; i++) {
+        connection = &server->connections[i];
+
+        if( (connection->fd >= 0) && ((now - connection->opened_s) > METRICS_TIMEOUT_S) ) {
+            server->stats.timeouts++;
+            CloseConnection(server, connection);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <stdbool.h>
+
+// A small HTTP server for Prometheus or anything else that scrapes OpenMetrics text.  It answers GET /metrics
+// and nothing else, one request per connection.  Every socket is non-blocking and one thread serves them all
+// from poll(), so a slow or stalled scraper only holds up itself.  The response is rendered into a buffer made
+// when the server is opened.  A scrape that arrives while an earlier response is still going out is given the
+// same response, so a request never allocates and never renders over a response being sent.  A body that
+// doesn't fit the buffer is answered with an error, so the caller sizes it for the most a render can come to.
+
+#define METRICS_CONNECTIONS_MAX 4
+#define METRICS_REQUEST_MAX 1024
+#define METRICS_TIMEOUT_S 10 // To send a request and take the response
+
+// Writes the body into buffer and returns its length.  A length of size or more means it didn't fit
+typedef unsigned int (*MetricsRender)(char *buffer, unsigned int size, void *context);
+
+struct MetricsConnection {
+    int fd; // -1 while the slot is free
+    char request[METRICS_REQUEST_MAX];
+    unsigned int request_length;
+    const char *response; // NULL until the request is in
+    unsigned int response_length;
+    unsigned int sent;
+    bool shared; // Sending the server's rendered response, rather than a fixed error
+    double opened_s;
+};
+
+struct MetricsStatistics {
+    unsigned long scrapes; // Rendered
+    unsigned long shared; // Given a response already being sent
+    unsigned long refused; // Bad request, wrong method or path
+    unsigned long timeouts;
+    unsigned long too_large; // Didn't fit the buffer
+};
+
+struct MetricsServer {
+    int listen_fd;
+    MetricsRender render;
+    void *context;
+
+    char *buffer;
+    unsigned int size; // Headers and body
+    const char *response; // Headers and body of the latest render, within buffer
+    unsigned int response_length;
+    unsigned int senders; // Connections still sending it
+
+    struct MetricsConnection connections[METRICS_CONNECTIONS_MAX];
+    struct MetricsStatistics stats;
+};
+
+// Listens on [host:]port, on the loopback address unless a host is given.  Use [::]:port or 0.0.0.0:port to
+// take scrapes from other machines.  Renders are given body_max bytes.  Returns false with errno set on failure
+bool MetricsServerOpen(struct MetricsServer *server, const char *address, unsigned int body_max, MetricsRender render, void *context);
+void MetricsServerClose(struct MetricsServer *server);
+
+// Waits up to timeout_ms for a connection, request or room to send, and deals with whatever is ready
+void MetricsServerPoll(struct MetricsServer *server, int timeout_ms);
+
+#endif
@@ -0,0 +1,87 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include <mosquitto.h>
+
+// Linked in place of libmosquitto by the benchmarks and the fuzzer, so they measure or exercise the
+// receive, parse and publish path and not the broker.  Publishes are only counted.
+
+unsigned long publish_count = 0;
+
+struct mosquitto {
+    int unused;
+};
+
+static struct mosquitto stub_client;
+static void (*connect_callback)(struct mosquitto *, void *, int);
+
+int mosquitto_lib_init(void) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_lib_cleanup(void) {
+    printf("Stub broker: %lu publishes\r\n", publish_count);
+    return MOSQ_ERR_SUCCESS;
+}
+
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj) {
+    return &stub_client;
+}
+
+void mosquitto_destroy(struct mosquitto *mosq) {
+}
+
+// Connects at once, so the daemon publishes rather than waiting for a connection
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int keepalive) {
+    if(connect_callback != NULL) {
+        connect_callback(mosq, NULL, 0);
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_start(struct mosquitto *mosq) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_loop_stop(struct mosquitto *mosq, bool force) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain) {
+    __atomic_add_fetch(&publish_count, 1, __ATOMIC_RELAXED);
+    return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_connect_callback_set(struct mosquitto *mosq, void (*on_connect)(struct mosquitto *, void *, int)) {
+    connect_callback = on_connect;
+}
+
+void mosquitto_disconnect_callback_set(struct mosquitto *mosq, void (*on_disconnect)(struct mosquitto *, void *, int)) {
+}
+
+void mosquitto_publish_callback_set(struct mosquitto *mosq, void (*on_publish)(struct mosquitto *, void *, int)) {
+}
+
+void mosquitto_message_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *)) {
+}
+
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_reconnect_delay_set(struct mosquitto *mosq, unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff) {
+    return MOSQ_ERR_SUCCESS;
+}
+
+const char *mosquitto_strerror(int mosq_errno) {
+    return "stub broker error";
+}
+
+const char *mosquitto_connack_string(int connack_code) {
+    return "stub broker refused";
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "publish_queue.h"
+
+#define SLOT_ALIGN 64 // A cache line, so neighbouring slots don't share one
+#define WAIT_NS 100000
+
+// Run by the consumer between reading the tail and reading the slot there, where it is most easily overtaken.
+// The tests define it to push from the same thread, to make the interleavings a second CPU would
+#ifndef PUBLISH_QUEUE_POP_PAUSE
+#define PUBLISH_QUEUE_POP_PAUSE(queue)
+#endif
+
+static struct PublishSlot *SlotAt(const struct PublishQueue *queue, unsigned int index) {
+    return (struct PublishSlot *)( queue->slots + ((size_t)(index & (queue->size - 1)) * queue->stride) );
+}
+
+bool PublishQueueInit(struct PublishQueue *queue, unsigned int bytes, unsigned int payload_max, enum PublishOverflow overflow) {
+    memset(queue, 0, sizeof(*queue));
+
+    queue->payload_max = payload_max;
+    queue->overflow = overflow;
+    queue->stride = sizeof(struct PublishSlot) + payload_max;
+    queue->stride += (SLOT_ALIGN - (queue->stride % SLOT_ALIGN)) % SLOT_ALIGN;
+
+    for (queue->size = 2; (queue->size * 2 * queue->stride) <= bytes; queue->size *= 2);
+
+    if( (queue->slots = aligned_alloc(SLOT_ALIGN, (size_t)queue->size * queue->stride)) == NULL ) {
+        return false;
+    }
+
+    if( (queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        free(queue->slots);
+        queue->slots = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void PublishQueueFree(struct PublishQueue *queue) {
+    if(queue->slots == NULL) {
+        return;
+    }
+
+    close(queue->event_fd);
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+// Seqlock write, readers that overlap it see the sequence change and copy again.  The sequence is odd while
+// the slot is being written, and from the moment the consumer claims it until it is next written at the head
+static void FillSlot(struct PublishSlot *slot, uint32_t sequence, const char *topic, const void *payload, uint32_t length,
+                     void *context, double time_s) {
+    slot->length = length;
+    slot->topic = topic;
+    slot->context = context;
+    slot->time_s = time_s;
+    memcpy(slot->payload, payload, length);
+
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+// A fresh slot at the head, which the consumer has finished with, whether or not it left it claimed
+static void WriteSlot(struct PublishSlot *slot, const char *topic, const void *payload, uint32_t length, void *context, double time_s) {
+    uint32_t sequence = (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) + 1) & ~1u;
+
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    FillSlot(slot, sequence, topic, payload, length, context, time_s);
+}
+
+// A slot still waiting.  Returns false, leaving it alone, if the consumer has claimed it.  Otherwise the
+// consumer's claim fails on the new sequence and it copies the slot again
+static bool RewriteSlot(struct PublishSlot *slot, const char *topic, const void *payload, uint32_t length, void *context, double time_s) {
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+
+    if( (sequence & 1) ||
+        !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ) {
+        return false;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    FillSlot(slot, sequence, topic, payload, length, context, time_s);
+    return true;
+}
+
+static void Signal(struct PublishQueue *queue) {
+    uint64_t one = 1;
+
+    // Can only fail if the counter is about to overflow, in which case the consumer is awake anyway
+    if( write(queue->event_fd, &one, sizeof(one)) < 0 ) {
+        return;
+    }
+}
+
+// Puts the message in place of the newest one waiting for the same topic.  Returns false if there is none, or
+// if the consumer has claimed that slot, in which case the message still has to be queued
+static bool Coalesce(struct PublishQueue *queue, unsigned int tail, const char *topic, const void *payload,
+                     uint32_t length, void *context, double time_s) {
+    for (unsigned int index = queue->head; index != tail; index--) {
+        struct PublishSlot *slot = SlotAt(queue, index - 1);
+
+        if(slot->topic != topic) {
+            continue;
+        }
+
+        return RewriteSlot(slot, topic, payload, length, context, time_s);
+    }
+
+    return false;
+}
+
+bool PublishQueuePush(struct PublishQueue *queue, const char *topic, const void *payload, uint32_t length,
+                      void *context, double time_s) {
+    struct timespec wait = { 0, WAIT_NS };
+    unsigned int head = queue->head;
+    unsigned int tail;
+    bool coalesce_tried = false;
+
+    if(length > queue->payload_max) {
+        queue->too_large++;
+        return false;
+    }
+
+    while( (head - (tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST))) >= queue->size ) {
+        if( (queue->overflow == PUBLISH_COALESCE) && !coalesce_tried ) {
+            coalesce_tried = true;
+
+            if( Coalesce(queue, tail, topic, payload, length, context, time_s) ) {
+                queue->coalesced++;
+                return true;
+            }
+        }
+        else if(queue->overflow == PUBLISH_WAIT) {
+            queue->waited++;
+            Signal(queue);
+            nanosleep(&wait, NULL);
+        }
+        else if( __atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ) {
+            queue->dropped++;
+        }
+    }
+
+    WriteSlot(SlotAt(queue, head), topic, payload, length, context, time_s);
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+    queue->pushed++;
+
+    if( (head + 1 - tail) > queue->max_depth ) {
+        queue->max_depth = head + 1 - tail;
+    }
+
+    // Either this sees the consumer waiting, or the consumer sees the new head before it waits
+    if( __atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&queue->waiting, 0, __ATOMIC_SEQ_CST) ) {
+        Signal(queue);
+    }
+
+    return true;
+}
+
+bool PublishQueuePop(struct PublishQueue *queue, struct PublishSlot *message) {
+    struct PublishSlot *slot;
+    unsigned int tail;
+    uint32_t sequence;
+    uint32_t claimed;
+
+    for (;;) {
+        tail = __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+
+        if( tail == __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) ) {
+            return false;
+        }
+
+        slot = SlotAt(queue, tail);
+        PUBLISH_QUEUE_POP_PAUSE(queue);
+
+        if( (sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE)) & 1 ) {
+            continue;
+        }
+
+        message->length = slot->length;
+        message->topic = slot->topic;
+        message->context = slot->context;
+        message->time_s = slot->time_s;
+
+        // Bounded in case the length is from a rewrite under way, the sequence check throws the copy out then
+        memcpy(message->payload, slot->payload, (message->length <= queue->payload_max) ? message->length : queue->payload_max);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        // Claim the slot before taking it off the queue.  A producer coalescing into it either got there first,
+        // and the claim fails and the copy is made again, or finds it claimed and queues its message afresh.
+        // Checking the sequence after moving the tail would be too late, the producer may be reusing the slot
+        if( !__atomic_compare_exchange_n(&slot->sequence, &sequence, sequence + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ) {
+            continue;
+        }
+
+        if( __atomic_compare_exchange_n(&queue->tail, &tail, tail + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ) {
+            return true;
+        }
+
+        // The tail moved on, the producer dropped the message and may have written a new one into the slot since.
+        // Give the claim back, or the slot stays odd and the consumer waits on it for good once the tail comes
+        // round.  If the producer is writing the slot again by now the sequence has moved on and this does nothing
+        claimed = sequence + 1;
+        __atomic_compare_exchange_n(&slot->sequence, &claimed, sequence, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+}
+
+bool PublishQueuePrepareWait(struct PublishQueue *queue) {
+    __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+    if( __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) ) {
+        __atomic_store_n(&queue->waiting, 0, __ATOMIC_SEQ_CST);
+        return false;
+    }
+
+    return true;
+}
+
+void PublishQueueClearEvent(struct PublishQueue *queue) {
+    uint64_t count;
+
+    __atomic_store_n(&queue->waiting, 0, __ATOMIC_SEQ_CST);
+
+    // Nonblocking, nothing to clear unless the producer signalled
+    if( read(queue->event_fd, &count, sizeof(count)) < 0 ) {
+        return;
+    }
+}
+
+unsigned int PublishQueueDepth(const struct PublishQueue *queue) {
+    return __atomic_load_n(&queue->head, __ATOMIC_RELAXED) - __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,78 @@
+#ifndef PUBLISH_QUEUE_H
+#define PUBLISH_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bounded queue of messages from the thread that parses device data to the thread that hands them to the
+// MQTT client, so a stall in the client or the broker never holds up reading the devices.  One producer and
+// one consumer, neither ever takes a lock, and the producer only makes a system call to wake the consumer
+// when it is waiting.  Slots are a fixed size, set when the queue is made, and the payload is copied in.
+// The topic is not, it must stay put for the life of the queue.
+//
+// The consumer copies the slot at the tail, then claims it by moving the tail on with compare and swap.  A
+// producer that finds the queue full can take the oldest slot the same way, and a consumer that loses that
+// race simply copies the new tail.  Each slot also carries a sequence number, odd while it is being written,
+// so a copy made while the producer rewrote the slot is noticed and made again.  The consumer makes the
+// sequence odd itself before moving the tail, so a producer coalescing into a waiting slot either rewrites it
+// before the consumer's copy is accepted or finds it claimed and queues the message afresh.
+
+enum PublishOverflow {
+    PUBLISH_DROP_OLDEST, // Make room by dropping the oldest message waiting
+    PUBLISH_COALESCE, // Replace the newest message waiting for the same topic, drop the oldest if there is none
+    PUBLISH_WAIT, // Wait for room.  Only for replays, where holding up the producer costs nothing
+};
+
+struct PublishSlot {
+    uint32_t sequence;
+    uint32_t length;
+    const char *topic;
+    void *context; // Handed back with the message, the daemon uses it for the device
+    double time_s; // When the data behind the message was read
+    uint8_t payload[];
+};
+
+struct PublishQueue {
+    uint8_t *slots;
+    unsigned int size; // Slots, a power of two
+    unsigned int stride; // Bytes per slot
+    unsigned int payload_max;
+    enum PublishOverflow overflow;
+    int event_fd; // Signalled when a message is queued while the consumer is waiting
+    int waiting; // Set by the consumer before it waits on event_fd
+
+    unsigned int head; // Free running write index, only the producer moves it
+    unsigned int tail; // Free running read index, moved by the consumer and by drops
+
+    // Producer side counters
+    unsigned int max_depth;
+    unsigned long pushed;
+    unsigned long dropped;
+    unsigned long coalesced;
+    unsigned long waited; // Pushes that found the queue full and waited for room
+    unsigned long too_large;
+};
+
+// Makes as many slots as fit in about the given number of bytes, rounded down to a power of two.  Returns false
+// with errno set if there is no memory or no event descriptor for it
+bool PublishQueueInit(struct PublishQueue *queue, unsigned int bytes, unsigned int payload_max, enum PublishOverflow overflow);
+void PublishQueueFree(struct PublishQueue *queue);
+
+// Producer.  Returns false only if the payload is too large for a slot, a full queue is dealt with according to
+// the overflow policy
+bool PublishQueuePush(struct PublishQueue *queue, const char *topic, const void *payload, uint32_t length,
+                      void *context, double time_s);
+
+// Consumer.  Copies the oldest message into message, which must have room for payload_max bytes of payload.
+// Returns false if the queue is empty
+bool PublishQueuePop(struct PublishQueue *queue, struct PublishSlot *message);
+
+// Consumer.  Call before waiting on event_fd.  Returns false if a message arrived meanwhile and it shouldn't wait
+bool PublishQueuePrepareWait(struct PublishQueue *queue);
+
+// Consumer.  Call once done waiting, whether or not event_fd was reported readable
+void PublishQueueClearEvent(struct PublishQueue *queue);
+
+unsigned int PublishQueueDepth(const struct PublishQueue *queue);
+
+#endif
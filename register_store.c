@@ -0,0 +1,107 @@
+#include <math.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "register_store.h"
+
+#define READ_SPINS 100 // Before yielding to let a preempted writer finish
+
+bool RegisterStoreInit(struct RegisterStore *store, unsigned int count) {
+    memset(store, 0, sizeof(*store));
+
+    store->count = count;
+    store->sequence = calloc(count, sizeof(*store->sequence));
+    store->value = calloc(count, sizeof(*store->value));
+    store->time_s = calloc(count, sizeof(*store->time_s));
+    store->quality = calloc(count, sizeof(*store->quality));
+    store->text = calloc(count, sizeof(*store->text));
+
+    if( (store->sequence == NULL) || (store->value == NULL) || (store->time_s == NULL) || (store->quality == NULL) ||
+        (store->text == NULL) ) {
+        RegisterStoreFree(store);
+        return false;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        store->value[i] = NAN;
+    }
+
+    return true;
+}
+
+void RegisterStoreFree(struct RegisterStore *store) {
+    free(store->sequence);
+    free(store->value);
+    free(store->time_s);
+    free(store->quality);
+    free(store->text);
+    memset(store, 0, sizeof(*store));
+}
+
+void RegisterStoreWrite(struct RegisterStore *store, unsigned int index, double value, const char *text,
+                        enum RegisterQuality quality, double time_s) {
+    uint32_t sequence = store->sequence[index];
+    size_t length = 0;
+
+    __atomic_store_n(&store->sequence[index], sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    store->value[index] = value;
+    store->time_s[index] = time_s;
+    store->quality[index] = quality;
+
+    if(text != NULL) {
+        length = strnlen(text, REGISTER_TEXT_MAX - 1);
+        memcpy(store->text[index], text, length);
+    }
+    store->text[index][length] = '\0';
+
+    __atomic_store_n(&store->sequence[index], sequence + 2, __ATOMIC_RELEASE);
+}
+
+bool RegisterStoreRead(const struct RegisterStore *store, unsigned int index, struct RegisterReading *reading) {
+    unsigned int spins = 0;
+    uint32_t sequence;
+
+    for (;;) {
+        if( (sequence = __atomic_load_n(&store->sequence[index], __ATOMIC_ACQUIRE)) & 1 ) {
+            if(++spins % READ_SPINS == 0) {
+                sched_yield();
+            }
+            continue;
+        }
+
+        reading->value = store->value[index];
+        reading->time_s = store->time_s[index];
+        reading->quality = store->quality[index];
+        memcpy(reading->text, store->text[index], REGISTER_TEXT_MAX);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if( __atomic_load_n(&store->sequence[index], __ATOMIC_RELAXED) == sequence ) {
+            break;
+        }
+    }
+
+    reading->updates = sequence / 2;
+
+    return (sequence > 0);
+}
+
+uint32_t RegisterStoreUpdates(const struct RegisterStore *store, unsigned int index) {
+    return __atomic_load_n(&store->sequence[index], __ATOMIC_ACQUIRE) / 2;
+}
+
+const char *RegisterQualityName(enum RegisterQuality quality) {
+    switch(quality) {
+        case REGISTER_EMPTY:
+            return "empty";
+        case REGISTER_GOOD:
+            return "good";
+        case REGISTER_INVALID:
+            return "invalid";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,53 @@
+#ifndef REGISTER_STORE_H
+#define REGISTER_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The latest value of every register of one device, indexed the same as the lookup table it was made for.
+// The thread parsing device data is the only writer.  Any other thread can read at any time without holding
+// it up: each register has a sequence number, odd while it is being written, and a read that overlaps a
+// write sees the number change and reads again.  Each field is kept in an array of its own, so walking one
+// field of every register, as an exporter or aggregator would, runs through memory in order.
+
+#define REGISTER_TEXT_MAX 40 // Longest HEX string register is 32 characters
+
+enum RegisterQuality {
+    REGISTER_EMPTY, // Nothing received yet
+    REGISTER_GOOD,
+    REGISTER_INVALID, // Received, but the device had no value to give ("---" or an error flag)
+};
+
+struct RegisterReading {
+    double value; // NAN for strings and invalid readings
+    double time_s; // Monotonic, when the bytes holding it were read
+    uint32_t updates; // Writes so far
+    enum RegisterQuality quality;
+    char text[REGISTER_TEXT_MAX]; // Empty unless the register holds a string
+};
+
+struct RegisterStore {
+    unsigned int count;
+    uint32_t *sequence;
+    double *value;
+    double *time_s;
+    uint8_t *quality;
+    char (*text)[REGISTER_TEXT_MAX];
+};
+
+bool RegisterStoreInit(struct RegisterStore *store, unsigned int count);
+void RegisterStoreFree(struct RegisterStore *store);
+
+// Writer.  Text may be NULL, longer strings are cut short
+void RegisterStoreWrite(struct RegisterStore *store, unsigned int index, double value, const char *text,
+                        enum RegisterQuality quality, double time_s);
+
+// Any thread.  Returns false if nothing has been written there yet
+bool RegisterStoreRead(const struct RegisterStore *store, unsigned int index, struct RegisterReading *reading);
+
+// Any thread.  Writes so far, enough to tell whether a register changed since last looked at
+uint32_t RegisterStoreUpdates(const struct RegisterStore *store, unsigned int index);
+
+const char *RegisterQualityName(enum RegisterQuality quality);
+
+#endif
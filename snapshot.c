@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+// CBOR major types and the simple values used here (RFC 8949)
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_TAG 6
+#define CBOR_MAP_INDEFINITE 0xbf
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT64 0xfb
+#define CBOR_BREAK 0xff
+#define CBOR_TAG_EPOCH 1
+
+static void Put(struct Snapshot *snapshot, const void *data, unsigned int length) {
+    if( snapshot->overflow || (length > (SNAPSHOT_MAX - snapshot->length)) ) {
+        snapshot->overflow = true;
+        return;
+    }
+
+    memcpy(snapshot->buffer + snapshot->length, data, length);
+    snapshot->length += length;
+}
+
+static void PutByte(struct Snapshot *snapshot, uint8_t byte) {
+    Put(snapshot, &byte, 1);
+}
+
+static void PutText(struct Snapshot *snapshot, const char *text) {
+    Put(snapshot, text, strlen(text));
+}
+
+// Initial byte and argument of a CBOR item, in the shortest form that holds the value
+static void PutCborHead(struct Snapshot *snapshot, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    unsigned int size;
+
+    if(value < 24) {
+        PutByte(snapshot, (major << 5) | value);
+        return;
+    }
+
+    size = (value <= 0xff) ? 1 : (value <= 0xffff) ? 2 : (value <= 0xffffffff) ? 4 : 8;
+    head[0] = (major << 5) | ( (size == 1) ? 24 : (size == 2) ? 25 : (size == 4) ? 26 : 27 );
+
+    for (unsigned int i = 0; i < size; i++) {
+        head[size - i] = (uint8_t)( value >> (8 * i) );
+    }
+
+    Put(snapshot, head, size + 1);
+}
+
+static void PutCborText(struct Snapshot *snapshot, const char *text) {
+    unsigned int length = strlen(text);
+
+    PutCborHead(snapshot, CBOR_TEXT, length);
+    Put(snapshot, text, length);
+}
+
+static void PutCborFloat(struct Snapshot *snapshot, double value) {
+    uint8_t encoded[9] = { CBOR_FLOAT64 };
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (unsigned int i = 0; i < 8; i++) {
+        encoded[8 - i] = (uint8_t)( bits >> (8 * i) );
+    }
+
+    Put(snapshot, encoded, sizeof(encoded));
+}
+
+// Quoted, with anything JSON doesn't allow raw escaped
+static void PutJsonString(struct Snapshot *snapshot, const char *text) {
+    char escape[8];
+
+    PutByte(snapshot, '"');
+
+    for (const char *c = text; *c != '\0'; c++) {
+        if( (*c == '"') || (*c == '\\') ) {
+            escape[0] = '\\';
+            escape[1] = *c;
+            Put(snapshot, escape, 2);
+        }
+        else if( (uint8_t)*c < 0x20 ) {
+            snprintf(escape, sizeof(escape), "\\u%04x", (uint8_t)*c);
+            Put(snapshot, escape, 6);
+        }
+        else {
+            PutByte(snapshot, *c);
+        }
+    }
+
+    PutByte(snapshot, '"');
+}
+
+static void PutName(struct Snapshot *snapshot, const char *name) {
+    if(snapshot->format == SNAPSHOT_CBOR) {
+        PutCborText(snapshot, name);
+        return;
+    }
+
+    if(snapshot->count > 0) {
+        PutByte(snapshot, ',');
+    }
+
+    PutJsonString(snapshot, name);
+    PutByte(snapshot, ':');
+}
+
+// Plain decimal as the register formatting produces it, an optional sign, digits and an optional fraction.
+// Sets *fraction if there is a decimal point
+static bool IsDecimal(const char *text, bool *fraction) {
+    const char *c = text;
+
+    *fraction = false;
+
+    if(*c == '-') {
+        c++;
+    }
+
+    if( (*c < '0') || (*c > '9') ) {
+        return false;
+    }
+
+    while( (*c >= '0') && (*c <= '9') ) {
+        c++;
+    }
+
+    if(*c == '.') {
+        *fraction = true;
+        c++;
+
+        if( (*c < '0') || (*c > '9') ) {
+            return false;
+        }
+
+        while( (*c >= '0') && (*c <= '9') ) {
+            c++;
+        }
+    }
+
+    return (*c == '\0');
+}
+
+void SnapshotBegin(struct Snapshot *snapshot, enum SnapshotFormat format, double time_s) {
+    char text[64];
+
+    snapshot->format = format;
+    snapshot->length = 0;
+    snapshot->count = 0;
+    snapshot->sequence++;
+    snapshot->open = true;
+    snapshot->overflow = false;
+
+    if(format == SNAPSHOT_CBOR) {
+        PutByte(snapshot, CBOR_MAP_INDEFINITE);
+        PutCborText(snapshot, "time");
+        PutCborHead(snapshot, CBOR_TAG, CBOR_TAG_EPOCH);
+        PutCborFloat(snapshot, time_s);
+        PutCborText(snapshot, "values");
+        PutByte(snapshot, CBOR_MAP_INDEFINITE);
+    }
+    else {
+        snprintf(text, sizeof(text), "{\"time\":%0.3f,\"values\":{", time_s);
+        PutText(snapshot, text);
+    }
+}
+
+void SnapshotAddNumber(struct Snapshot *snapshot, const char *name, const char *text) {
+    bool fraction;
+    long long integer;
+
+    if( !IsDecimal(text, &fraction) ) {
+        SnapshotAddNull(snapshot, name);
+        return;
+    }
+
+    PutName(snapshot, name);
+
+    if(snapshot->format == SNAPSHOT_JSON) {
+        PutText(snapshot, text);
+    }
+    else if(fraction) {
+        PutCborFloat(snapshot, strtod(text, NULL));
+    }
+    else {
+        integer = strtoll(text, NULL, 10);
+
+        if(integer >= 0) {
+            PutCborHead(snapshot, CBOR_UNSIGNED, (uint64_t)integer);
+        }
+        else {
+            PutCborHead(snapshot, CBOR_NEGATIVE, (uint64_t)( -(integer + 1) ));
+        }
+    }
+
+    snapshot->count++;
+}
+
+void SnapshotAddString(struct Snapshot *snapshot, const char *name, const char *value) {
+    PutName(snapshot, name);
+
+    if(snapshot->format == SNAPSHOT_CBOR) {
+        PutCborText(snapshot, value);
+    }
+    else {
+        PutJsonString(snapshot, value);
+    }
+
+    snapshot->count++;
+}
+
+void SnapshotAddNull(struct Snapshot *snapshot, const char *name) {
+    PutName(snapshot, name);
+
+    if(snapshot->format == SNAPSHOT_CBOR) {
+        PutByte(snapshot, CBOR_NULL);
+    }
+    else {
+        PutText(snapshot, "null");
+    }
+
+    snapshot->count++;
+}
+
+bool SnapshotFinish(struct Snapshot *snapshot) {
+    if(snapshot->format == SNAPSHOT_CBOR) {
+        PutByte(snapshot, CBOR_BREAK);
+        PutByte(snapshot, CBOR_BREAK);
+    }
+    else {
+        PutText(snapshot, "}}");
+    }
+
+    snapshot->open = false;
+
+    return !snapshot->overflow;
+}
@@ -0,0 +1,37 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum SnapshotFormat {
+    SNAPSHOT_JSON,
+    SNAPSHOT_CBOR,
+};
+
+#define SNAPSHOT_MAX 4096
+
+// One document holding a set of register values and the time they were collected.  In JSON this is
+//   {"time":1697520000.123,"values":{"soc":65.4,"model":"BMV-702","ttg":null}}
+// and CBOR gets the same map, with the time as a tag 1 epoch float.  Building one never allocates.
+struct Snapshot {
+    enum SnapshotFormat format;
+    uint8_t buffer[SNAPSHOT_MAX];
+    unsigned int length;
+    unsigned int count; // Values added since SnapshotBegin()
+    unsigned long sequence; // Bumped by each SnapshotBegin(), so callers can tell which snapshot they added to
+    bool open;
+    bool overflow; // Ran out of room, the document is incomplete
+};
+
+void SnapshotBegin(struct Snapshot *snapshot, enum SnapshotFormat format, double time_s);
+
+// A number formatted as decimal text.  Anything that doesn't parse as a finite number is added as null
+void SnapshotAddNumber(struct Snapshot *snapshot, const char *name, const char *text);
+void SnapshotAddString(struct Snapshot *snapshot, const char *name, const char *value);
+void SnapshotAddNull(struct Snapshot *snapshot, const char *name);
+
+// Closes the document.  Returns false if it overflowed and shouldn't be sent
+bool SnapshotFinish(struct Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "transport.h"
+
+#define VEDIRECT_BAUD B19200
+
+struct TransportBackend {
+    const char *prefix; // Before the address in the device given, empty for the default
+    const char *name;
+    int (*open)(const char *address); // Returns a non-blocking descriptor, or -1 with errno set
+    bool connects; // Opening only starts the connection, it is made once the descriptor is writable
+};
+
+// Raw 8N1 with no flow control.  With VTIME at zero, Linux only reports a tty readable to epoll once VMIN
+// bytes are waiting, so anything above one would hold a short HEX response back until the next TEXT block.
+// Reads take everything there is anyway, see ReadDevice()
+static int OpenSerial(const char *path) {
+    struct termios options;
+    int fd;
+
+    if( (fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0 ) {
+        return -1;
+    }
+
+    if(tcgetattr(fd, &options) < 0) {
+        goto failed;
+    }
+
+    cfmakeraw(&options);
+    cfsetispeed(&options, VEDIRECT_BAUD);
+    cfsetospeed(&options, VEDIRECT_BAUD);
+    options.c_cflag |= CLOCAL | CREAD;
+    options.c_cflag &= ~(CSTOPB | CRTSCTS);
+    options.c_cc[VMIN] = 1;
+    options.c_cc[VTIME] = 0;
+
+    if(tcsetattr(fd, TCSANOW, &options) < 0) {
+        goto failed;
+    }
+
+    // Whatever arrived before we were listening is likely half a frame
+    tcflush(fd, TCIOFLUSH);
+
+    return fd;
+
+failed:
+    close(fd);
+    return -1;
+}
+
+// Connects without waiting.  Requests are a few bytes each and answered in turn, so Nagle would only add
+// delay, and keepalives find a bridge that vanished without closing the connection
+static int OpenTcp(const char *address) {
+    struct addrinfo hints = {0};
+    struct addrinfo *results;
+    char host[256];
+    const char *port = strrchr(address, ':');
+    const int on = 1;
+    size_t length;
+    int status;
+    int fd = -1;
+
+    if( (port == NULL) || (port[1] == '\0') || ((length = port - address) >= sizeof(host)) ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // [::1]:3000 for an IPv6 address
+    if( (length >= 2) && (address[0] == '[') && (address[length - 1] == ']') ) {
+        address++;
+        length -= 2;
+    }
+
+    memcpy(host, address, length);
+    host[length] = '\0';
+    port++;
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    // Name lookup errors have no errno of their own
+    if( (status = getaddrinfo(host, port, &hints, &results)) != 0 ) {
+        if(status != EAI_SYSTEM) {
+            errno = EHOSTUNREACH;
+        }
+        return -1;
+    }
+
+    for (struct addrinfo *result = results; result != NULL; result = result->ai_next) {
+        if( (fd = socket(result->ai_family, result->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, result->ai_protocol)) < 0 ) {
+            continue;
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+        if( (connect(fd, result->ai_addr, result->ai_addrlen) == 0) || (errno == EINPROGRESS) ) {
+            break;
+        }
+
+        status = errno;
+        close(fd);
+        fd = -1;
+        errno = status;
+    }
+
+    freeaddrinfo(results);
+
+    return fd;
+}
+
+// Read and write, so a FIFO doesn't report end of file each time its writer goes.  A regular file is refused
+// here rather than by epoll, which only says EPERM
+static int OpenFile(const char *path) {
+    struct stat status;
+    int fd;
+
+    if( (fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0 ) {
+        return -1;
+    }
+
+    if( (fstat(fd, &status) == 0) && S_ISREG(status.st_mode) ) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    return fd;
+}
+
+// The default comes last, it matches anything
+static const struct TransportBackend transport_backends[] = {
+    { "tcp:", "tcp", OpenTcp, true },
+    { "file:", "file", OpenFile, false },
+    { "", "serial", OpenSerial, false },
+};
+
+#define TRANSPORT_BACKEND_COUNT ( sizeof(transport_backends) / sizeof(struct TransportBackend) )
+
+void TransportInit(struct Transport *transport, const char *device) {
+    memset(transport, 0, sizeof(*transport));
+    transport->fd = -1;
+
+    for (unsigned int i = 0; i < TRANSPORT_BACKEND_COUNT; i++) {
+        if( !strncmp(device, transport_backends[i].prefix, strlen(transport_backends[i].prefix)) ) {
+            transport->backend = &transport_backends[i];
+            transport->address = device + strlen(transport_backends[i].prefix);
+            break;
+        }
+    }
+}
+
+bool TransportOpen(struct Transport *transport) {
+    if( (transport->fd = transport->backend->open(transport->address)) < 0 ) {
+        return false;
+    }
+
+    // Counted once made, a connection refused or timed out isn't one
+    if( !(transport->connecting = transport->backend->connects) ) {
+        transport->stats.connects++;
+    }
+
+    return true;
+}
+
+bool TransportConnected(struct Transport *transport) {
+    socklen_t length = sizeof(int);
+    int error = 0;
+
+    if( getsockopt(transport->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 ) {
+        error = errno;
+    }
+
+    if(error != 0) {
+        TransportClose(transport);
+        errno = error;
+        return false;
+    }
+
+    transport->connecting = false;
+    transport->stats.connects++;
+
+    return true;
+}
+
+bool TransportIsOpen(const struct Transport *transport) {
+    return (transport->fd >= 0) && !transport->connecting;
+}
+
+void TransportClose(struct Transport *transport) {
+    if(transport->fd >= 0) {
+        close(transport->fd);
+        transport->fd = -1;
+    }
+
+    transport->connecting = false;
+}
+
+void TransportHangUp(struct Transport *transport) {
+    if( TransportIsOpen(transport) ) {
+        transport->stats.disconnects++;
+    }
+
+    TransportClose(transport);
+}
+
+ssize_t TransportRead(struct Transport *transport, void *buffer, size_t size) {
+    ssize_t count = read(transport->fd, buffer, size);
+
+    if(count > 0) {
+        transport->stats.bytes_read += count;
+    }
+    else if( (count < 0) && (errno != EAGAIN) && (errno != EINTR) ) {
+        transport->stats.read_errors++;
+    }
+
+    return count;
+}
+
+bool TransportWrite(struct Transport *transport, const void *data, size_t length) {
+    ssize_t count;
+
+    transport->stats.writes++;
+
+    // Closed while waiting to reconnect, or still connecting.  The request times out like any other that goes
+    // unanswered
+    if( !TransportIsOpen(transport) ) {
+        transport->stats.write_errors++;
+        return false;
+    }
+
+    if( (count = write(transport->fd, data, length)) < 0 ) {
+        if( (errno == EAGAIN) || (errno == EINTR) ) {
+            transport->stats.short_writes++;
+        }
+        else {
+            transport->stats.write_errors++;
+        }
+        return false;
+    }
+
+    transport->stats.bytes_written += count;
+
+    if( (size_t)count < length ) {
+        transport->stats.short_writes++;
+        return false;
+    }
+
+    return true;
+}
+
+const char *TransportName(const struct Transport *transport) {
+    return transport->backend->name;
+}
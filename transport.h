@@ -0,0 +1,65 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// The link to one VE.Direct device.  Which backend is used follows from how the device is given:
+//   /dev/ttyUSB0     a local serial port, or the slave side of a pty, set to raw 19200 8N1
+//   tcp:host:port    a serial-over-IP bridge such as ser2net in raw mode, so one server can poll devices
+//                    all over the LAN
+//   file:path        a FIFO or anything else that takes no line settings.  Not a regular file, which epoll
+//                    can't wait on, replay a capture with -r instead
+// Every backend comes down to one non-blocking file descriptor, so the event loop waits on them all alike.
+
+struct TransportBackend;
+
+// Kept across reopens, so they cover the life of the device rather than of one connection
+struct TransportStatistics {
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long writes;
+    unsigned long short_writes; // Not taken whole, the rest is dropped and the request sent again on timeout
+    unsigned long read_errors;
+    unsigned long write_errors;
+    unsigned long connects; // Links made, the first included.  A TCP connection once it completes
+    unsigned long disconnects;
+};
+
+struct Transport {
+    const struct TransportBackend *backend;
+    const char *address; // What follows the backend's prefix
+    int fd; // -1 while closed
+    bool connecting; // Open, but the connection is only made once fd is writable, see TransportConnected()
+    struct TransportStatistics stats;
+};
+
+// Chooses the backend for a device as given with -d.  Opening is left to TransportOpen()
+void TransportInit(struct Transport *transport, const char *device);
+
+// Sets errno and returns false on failure, EINVAL for a regular file.  A TCP connection is still under way when
+// this returns, with connecting set
+bool TransportOpen(struct Transport *transport);
+
+// Call once fd is writable, or reports an error, while connecting.  Returns false with errno set if the
+// connection failed, fd is closed then
+bool TransportConnected(struct Transport *transport);
+
+// Open and connected
+bool TransportIsOpen(const struct Transport *transport);
+void TransportClose(struct Transport *transport);
+
+// The far end went away.  Closes the descriptor so it can be opened again later
+void TransportHangUp(struct Transport *transport);
+
+// Returns the count read, 0 if the far end has gone, or -1 with errno set.  EAGAIN when there is nothing yet
+ssize_t TransportRead(struct Transport *transport, void *buffer, size_t size);
+
+// Writes what it can without blocking.  Returns false unless all of it was taken
+bool TransportWrite(struct Transport *transport, const void *data, size_t length);
+
+// "serial", "tcp" or "file"
+const char *TransportName(const struct Transport *transport);
+
+#endif
@@ -0,0 +1,372 @@
+#include <string.h>
+
+#include "vedirect.h"
+
+// Registers of the BMV-700 series.  Writable ones can be set over MQTT, see <topic_root>/set/<name>
+const struct VEDirectHexMsg vedirect_hex_lookup[] = {
+    { "id",                           0x0100, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "revision",                     0x0101, VE_TYPE_UN24,   1.0,        "",        VE_READ,        VALID_BMV712                },
+    { "serial",                       0x010A, VE_TYPE_STR32,  1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "model",                        0x010B, VE_TYPE_STR32,  1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "description",                  0x010C, VE_TYPE_STR20,  1.0,        "",        VE_READ,        VALID_BMV712                },
+    { "uptime",                       0x0120, VE_TYPE_UN32,   1.0,        "s",       VE_READ,        VALID_ALL                   },
+    { "bluetooth",                    0x0150, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_BMV712                }, // [0: HAS_SUPPORT_FOR_BLE_MODE, 1: BLE_MODE_OFF_IS_PERMANENT, 2-31: reserved]
+    { "main_voltage",                 0xED8D, VE_TYPE_SN16,   0.01,       "V",       VE_READ,        VALID_ALL                   },
+    { "aux_voltage",                  0xED7D, VE_TYPE_SN16,   0.01,       "V",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "current_coarse",               0xED8F, VE_TYPE_SN16,   0.1,        "A",       VE_READ,        VALID_ALL                   },
+    { "current_fine",                 0xED8C, VE_TYPE_SN32,   0.001,      "A",       VE_READ,        VALID_ALL                   },
+    { "power",                        0xED8E, VE_TYPE_SN16,   1.0,        "W",       VE_READ,        VALID_ALL                   },
+    { "consumed_ah",                  0xEEFF, VE_TYPE_SN32,   0.1,        "Ah",      VE_READ,        VALID_ALL                   },
+    { "soc",                          0x0FFF, VE_TYPE_UN16,   0.01,       "%",       VE_READ,        VALID_ALL                   },
+    { "ttg",                          0x0FFE, VE_TYPE_UN16,   1.0,        "min",     VE_READ,        VALID_ALL                   },
+    { "temp",                         0xEDEC, VE_TYPE_UN16,   0.01,       "K",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "midpoint_voltage",             0x0382, VE_TYPE_UN16,   0.01,       "V",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "midpoint_voltage_dev",         0x0383, VE_TYPE_SN16,   0.1,        "%",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "sync_state",                   0xEEB6, VE_TYPE_UN8,    1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "max_discharge",                0x0300, VE_TYPE_SN32,   0.1,        "Ah",      VE_READ,        VALID_ALL                   },
+    { "last_discharge",               0x0301, VE_TYPE_SN32,   0.1,        "Ah",      VE_READ,        VALID_ALL                   },
+    { "avg_discharge",                0x0302, VE_TYPE_SN32,   0.1,        "Ah",      VE_READ,        VALID_ALL                   },
+    { "num_cycles",                   0x0303, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "num_full_discharge",           0x0304, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "cumulative_ah",                0x0305, VE_TYPE_SN32,   0.1,        "Ah",      VE_READ,        VALID_ALL                   },
+    { "min_voltage",                  0x0306, VE_TYPE_SN32,   0.01,       "V",       VE_READ,        VALID_ALL                   },
+    { "max_voltage",                  0x0307, VE_TYPE_SN32,   0.01,       "V",       VE_READ,        VALID_ALL                   },
+    { "time_since_full_charge",       0x0308, VE_TYPE_UN32,   1.0,        "s",       VE_READ,        VALID_ALL                   },
+    { "num_auto_sync",                0x0309, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "num_low_volt_alarm",           0x030A, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "num_high_volt_alarm",          0x030B, VE_TYPE_UN32,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "min_aux_voltage",              0x030E, VE_TYPE_SN32,   0.01,       "V",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "max_aux_voltage",              0x030F, VE_TYPE_SN32,   0.01,       "V",       VE_READ,        VALID_BMV702 | VALID_BMV712 },
+    { "energy_discharged",            0x0310, VE_TYPE_UN32,   0.01,       "kWh",     VE_READ,        VALID_ALL                   },
+    { "energy_charged",               0x0311, VE_TYPE_UN32,   0.01,       "kWh",     VE_READ,        VALID_ALL                   },
+    { "battery_capacity",             0x1000, VE_TYPE_UN16,   1.0,        "Ah",      VE_READ_WRITE,  VALID_ALL                   },
+    { "charged_voltage",              0x1001, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "tail_current",                 0x1002, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "charged_detection_time",       0x1003, VE_TYPE_UN16,   1.0,        "min",     VE_READ_WRITE,  VALID_ALL                   },
+    { "charge_efficiency",            0x1004, VE_TYPE_UN16,   1.0,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "peukert_coefficient",          0x1005, VE_TYPE_UN16,   0.01,       "",        VE_READ_WRITE,  VALID_ALL                   },
+    { "current_threshold",            0x1006, VE_TYPE_UN16,   0.01,       "A",       VE_READ_WRITE,  VALID_ALL                   },
+    { "ttg_delta_t",                  0x1007, VE_TYPE_UN16,   1.0,        "min",     VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_low_soc_set",            0x1008, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_low_soc_clear",          0x1009, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "user_current_zero",            0x1034, VE_TYPE_SN16,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "alarm_buzzer",                 0xEEFC, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "alarm_low_voltage",            0x0320, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_low_voltage_clear",      0x0321, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_high_voltage",           0x0322, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_high_voltage_clear",     0x0323, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_low_aux_voltage",        0x0324, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_low_aux_voltage_clear",  0x0325, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_high_aux_voltage",       0x0326, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_high_aux_voltage_clear", 0x0327, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_low_soc",                0x0328, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_low_soc_clear",          0x0329, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_ALL                   },
+    { "alarm_low_temperature",        0x032A, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_low_temperature_clear",  0x032B, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_high_temperature",       0x032C, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_high_temperature_clear", 0x032D, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "alarm_mid_voltage",            0x0331, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_BMV712                },
+    { "alarm_mid_voltage_clear",      0x0332, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_BMV712                },
+    { "alarm_acknowledge",            0x031F, VE_TYPE_NONE,   1.0,        "",        VE_WRITE,       VALID_ALL                   },
+    { "relay_mode",                   0x034F, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // [0: default, 1: charge, 2: remain]
+    { "relay_invert",                 0x034D, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "relay_state",                  0x034E, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // [0: open, 1: closed]
+    { "relay_min_enable_time",        0x100A, VE_TYPE_UN16,   1.0,        "min",     VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_disable_time",           0x100B, VE_TYPE_UN16,   1.0,        "min",     VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_low_voltage",            0x0350, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_low_voltage_clear",      0x0351, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_high_voltage",           0x0352, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_high_voltage_clear",     0x0353, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "relay_aux_low_voltage",        0x0354, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_aux_low_voltage_clear",  0x0355, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_aux_high_voltage",       0x0356, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_aux_high_voltage_clear", 0x0357, VE_TYPE_UN16,   0.1,        "V",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_low_temperature",        0x035A, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_low_temperature_clear",  0x035B, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_high_temperature",       0x035C, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_high_temperature_clear", 0x035D, VE_TYPE_UN16,   0.01,       "K",       VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "relay_mid_voltage",            0x0361, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_BMV712                },
+    { "relay_mid_voltage_clear",      0x0362, VE_TYPE_UN16,   0.1,        "%",       VE_READ_WRITE,  VALID_BMV712                },
+    { "backlight_intensity",          0xEEFE, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   },
+    { "backlight_always_on",          0x0400, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "scroll_speed",                 0xEEF5, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   },
+    { "show_voltage",                 0xEEE0, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "show_aux_voltage",             0xEEE1, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 }, // bool
+    { "show_mid_voltage",             0xEEE2, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 }, // bool
+    { "show_current",                 0xEEE3, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "show_consumed_ah",             0xEEE4, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "show_soc",                     0xEEE5, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "show_ttg",                     0xEEE6, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "show_temperature",             0xEEE7, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 }, // bool
+    { "show_power",                   0xEEE8, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "zero_current",                 0x1029, VE_TYPE_NONE,   1.0,        "",        VE_WRITE,       VALID_ALL                   },
+    { "sync",                         0x102C, VE_TYPE_NONE,   1.0,        "",        VE_WRITE,       VALID_ALL                   },
+    { "restore_defaults",             0x0004, VE_TYPE_NONE,   1.0,        "",        VE_WRITE,       VALID_ALL                   },
+    { "clear_history",                0x1030, VE_TYPE_NONE,   1.0,        "",        VE_WRITE,       VALID_ALL                   },
+    { "sw_version",                   0xEEF9, VE_TYPE_UN16,   1.0,        "",        VE_READ,        VALID_ALL                   },
+    { "setup_lock",                   0xEEF6, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "shunt_amps",                   0xEEFB, VE_TYPE_UN16,   1.0,        "A",       VE_READ_WRITE,  VALID_ALL                   },
+    { "shunt_volts",                  0xEEFA, VE_TYPE_UN16,   0.001,      "V",       VE_READ_WRITE,  VALID_ALL                   },
+    { "temperature_unit",             0xEEF7, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 }, // [0: celcius, 1: fahrenheit]
+    { "temperature_coefficient",      0xEEF4, VE_TYPE_UN16,   0.1,        "%CAP/C",  VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 },
+    { "aux_input",                    0xEEF8, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV702 | VALID_BMV712 }, // [0: start, 1: mid, 2: temp]
+    { "start_sync",                   0x0FFD, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_ALL                   }, // bool
+    { "settings_changed_timestamp",   0xEC41, VE_TYPE_UN32,   1.0,        "s",       VE_READ_WRITE,  VALID_BMV712                }, // [0: local change, 0x00000001-0xFFFFFFFE: seconds since change by app, 0xFFFFFFFF: no change]
+    { "bluetooth_mode",               0x0090, VE_TYPE_UN8,    1.0,        "",        VE_READ_WRITE,  VALID_BMV712                }, // [0: disabled, 1: enabled, 2-7: reserved]
+};
+
+// TODO: Only valid entries for BMV-702 are present.  Extend this to other devices.
+const struct VEDirectTextMsg vedirect_text_lookup[] = {
+    { "main_voltage",           "V",        VE_TYPE_TXT_FLOAT,  0.001,  "V"     }, // Main of channel 1 (battery) voltage
+    { "current_fine",           "I",        VE_TYPE_TXT_FLOAT,  0.001,  "A"     }, // Main of channel 1 (battery) current
+    { "power",                  "P",        VE_TYPE_TXT_INT,    1.0,    "W"     }, // Instantaneous power
+    { "load_current",           "LI",       VE_TYPE_TXT_FLOAT,  0.001,  "A"     }, // Load current
+    { "pv_voltage",             "VPV",      VE_TYPE_TXT_FLOAT,  0.001,  "V"     }, // PV voltage
+    { "pv_power",               "PPV",      VE_TYPE_TXT_INT,    1.0,    "W"     }, // PV power
+    { "error",                  "ERR",      VE_TYPE_TXT_INT,    1.0,    ""      }, // Error code
+    { "charge_state",           "CS",       VE_TYPE_TXT_INT,    1.0,    ""      }, // Charge state code
+    { "consumed_ah",            "CE",       VE_TYPE_TXT_FLOAT,  0.001,  "Ah"    }, // Consumed Ah
+    { "soc",                    "SOC",      VE_TYPE_TXT_FLOAT,  0.1,    "%"     }, // State-of-charge
+    { "ttg",                    "TTG",      VE_TYPE_TXT_INT,    1.0,    "Min"   }, // Time-to-go
+    { "alarm_state",            "Alarm",    VE_TYPE_TXT_BOOL,   1.0,    ""      }, // Alarm condition active
+    { "relay_state",            "Relay",    VE_TYPE_TXT_BOOL,   1.0,    ""      }, // Relay state
+    { "alarm_reason",           "AR",       VE_TYPE_TXT_INT,    1.0,    ""      }, // Alarm reason
+    { "sw_version",             "FW",       VE_TYPE_TXT_INT,    1.0,    ""      }, // Firmware version
+    { "max_discharge",          "H1",       VE_TYPE_TXT_FLOAT,  0.001,  "Ah"    }, // Depth of deepest discharge
+    { "last_discharge",         "H2",       VE_TYPE_TXT_FLOAT,  0.001,  "Ah"    }, // Depth of last discharge
+    { "average_discharge",      "H3",       VE_TYPE_TXT_FLOAT,  0.001,  "Ah"    }, // Depth of average discharge
+    { "num_cycles",             "H4",       VE_TYPE_TXT_INT,    1.0,    ""      }, // Number of charge cycles
+    { "num_full_discharge",     "H5",       VE_TYPE_TXT_INT,    1.0,    ""      }, // Number of full discharges
+    { "cumulative_ah",          "H6",       VE_TYPE_TXT_FLOAT,  0.001,  "Ah"    }, // Cumulative Ah drawn
+    { "min_voltage",            "H7",       VE_TYPE_TXT_FLOAT,  0.001,  "V"     }, // Minimum main (battery) voltage
+    { "max_voltage",            "H8",       VE_TYPE_TXT_FLOAT,  0.001,  "V"     }, // Maximum main (battery) voltage
+    { "time_since_full_charge", "H9",       VE_TYPE_TXT_INT,    1.0,    "Sec"   }, // Number of seconds since last full charge
+    { "num_auto_sync",          "H10",      VE_TYPE_TXT_INT,    1.0,    ""      }, // Number of automatic synchronizations
+    { "num_low_volt_alarm",     "H11",      VE_TYPE_TXT_INT,    1.0,    ""      }, // Number of low main voltage alarms
+    { "num_high_volt_alarm",    "H12",      VE_TYPE_TXT_INT,    1.0,    ""      }, // Number of high main voltage alarms
+    { "energy_discharged",      "H17",      VE_TYPE_TXT_FLOAT,  0.01,   "kWh"   }, // Amount of discharged energy
+    { "energy_charged",         "H18",      VE_TYPE_TXT_FLOAT,  0.01,   "kWh"   }, // Amount of charged energy
+    { "energy_total",           "H19",      VE_TYPE_TXT_FLOAT,  0.01,   "kWh"   }, // Energy total
+    { "energy_today",           "H20",      VE_TYPE_TXT_FLOAT,  0.01,   "kWh"   }, // Energy today
+    { "max_power_today",        "H21",      VE_TYPE_TXT_FLOAT,  1.0,    "W"     }, // Max power today
+    { "energy_yesterday",       "H22",      VE_TYPE_TXT_FLOAT,  0.01,   "kWh"   }, // Energy yesterday
+    { "max_power_yesterday",    "H23",      VE_TYPE_TXT_FLOAT,  1.0,    "W"     }, // Max power yesterday
+    { "id",                     "PID",      VE_TYPE_TXT_INT,    1.0,    ""      }, // Product ID
+};
+
+const unsigned int vedirect_hex_lookup_count = sizeof(vedirect_hex_lookup) / sizeof(struct VEDirectHexMsg);
+const unsigned int vedirect_text_lookup_count = sizeof(vedirect_text_lookup) / sizeof(struct VEDirectTextMsg);
+
+#define XX VE_HEX_INVALID
+const uint8_t ve_hex_nibble[256] = {
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, 10, 11, 12, 13, 14, 15, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+    XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX, XX,
+};
+#undef XX
+
+const struct VEHexTypeInfo ve_hex_type_info[] = {
+    [VE_TYPE_NONE]  = { 0,  false, false },
+    [VE_TYPE_UN8]   = { 1,  false, false },
+    [VE_TYPE_SN8]   = { 1,  true,  false },
+    [VE_TYPE_UN16]  = { 2,  false, false },
+    [VE_TYPE_SN16]  = { 2,  true,  false },
+    [VE_TYPE_UN24]  = { 3,  false, false },
+    [VE_TYPE_SN24]  = { 3,  true,  false },
+    [VE_TYPE_UN32]  = { 4,  false, false },
+    [VE_TYPE_SN32]  = { 4,  true,  false },
+    [VE_TYPE_STR20] = { 20, false, true  },
+    [VE_TYPE_STR32] = { 32, false, true  },
+};
+
+bool ve_decode_hex_value(const char *hex, unsigned int hex_len, enum VEDirectHexType type, struct VEHexValue *value) {
+    const struct VEHexTypeInfo *info = &ve_hex_type_info[type];
+    unsigned int length;
+    uint32_t raw;
+
+    value->integer = 0;
+    value->string[0] = '\0';
+
+    if(info->is_string) {
+        // Strings are sent as one hex pair per character and may be shorter than the maximum
+        length = hex_len / 2;
+        if(length > info->size) {
+            length = info->size;
+        }
+
+        for (unsigned int i = 0; i < length; i++) {
+            if( !ve_hex_decode_le(hex + (2 * i), 1, &raw) ) {
+                return false;
+            }
+
+            value->string[i] = (char)raw;
+            if(raw == 0) {
+                break;
+            }
+        }
+
+        value->string[length] = '\0';
+        return true;
+    }
+
+    if( (info->size == 0) || (hex_len < (2u * info->size)) ) {
+        return false;
+    }
+
+    if( !ve_hex_decode_le(hex, info->size, &raw) ) {
+        return false;
+    }
+
+    value->integer = raw;
+    if( info->is_signed && (raw & ( (uint32_t)1 << ((8 * info->size) - 1) )) ) {
+        value->integer -= (int64_t)1 << (8 * info->size);
+    }
+
+    return true;
+}
+
+// Slot storage for the built in tables, sized at compile time for a load factor below one half
+#define VE_HEX_INDEX_SIZE ( (2 * sizeof(vedirect_hex_lookup) / sizeof(struct VEDirectHexMsg)) + 1 )
+#define VE_TEXT_INDEX_SIZE ( (2 * sizeof(vedirect_text_lookup) / sizeof(struct VEDirectTextMsg)) + 1 )
+
+static uint16_t hex_name_slots[VE_HEX_INDEX_SIZE];
+static uint16_t hex_address_slots[VE_HEX_INDEX_SIZE];
+static uint16_t text_name_slots[VE_TEXT_INDEX_SIZE];
+
+static struct VEHexIndex hex_index;
+static struct VETextIndex text_index;
+
+// FNV-1a
+static uint32_t ve_hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+
+    while(*name != '\0') {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static uint32_t ve_hash_address(unsigned int address) {
+    return (address * 2654435761u) >> 8;
+}
+
+// Linear probing from the hashed slot to the first free one.  Duplicate keys keep the first table entry.
+static void ve_index_insert(uint16_t *slots, unsigned int size, uint32_t hash, uint16_t position) {
+    unsigned int slot = hash % size;
+
+    while(slots[slot] != VE_INDEX_EMPTY) {
+        slot = (slot + 1) % size;
+    }
+
+    slots[slot] = position;
+}
+
+void ve_hex_index_build(struct VEHexIndex *index, const struct VEDirectHexMsg *table, unsigned int count, uint16_t *name_slots, uint16_t *address_slots, unsigned int size) {
+    index->table = table;
+    index->count = count;
+    index->name_slots = name_slots;
+    index->address_slots = address_slots;
+    index->size = size;
+
+    memset(name_slots, 0xFF, size * sizeof(uint16_t));
+    memset(address_slots, 0xFF, size * sizeof(uint16_t));
+
+    for (unsigned int i = 0; i < count; i++) {
+        if( ve_hex_index_find_name(index, table[i].name) == NULL ) {
+            ve_index_insert(name_slots, size, ve_hash_name(table[i].name), i);
+        }
+
+        if( ve_hex_index_find_address(index, table[i].address) == NULL ) {
+            ve_index_insert(address_slots, size, ve_hash_address(table[i].address), i);
+        }
+    }
+}
+
+const struct VEDirectHexMsg *ve_hex_index_find_name(const struct VEHexIndex *index, const char *name) {
+    unsigned int slot = ve_hash_name(name) % index->size;
+
+    while(index->name_slots[slot] != VE_INDEX_EMPTY) {
+        if( !strcmp(name, index->table[index->name_slots[slot]].name) ) {
+            return &index->table[index->name_slots[slot]];
+        }
+
+        slot = (slot + 1) % index->size;
+    }
+
+    return NULL;
+}
+
+const struct VEDirectHexMsg *ve_hex_index_find_address(const struct VEHexIndex *index, unsigned int address) {
+    unsigned int slot = ve_hash_address(address) % index->size;
+
+    while(index->address_slots[slot] != VE_INDEX_EMPTY) {
+        if( address == index->table[index->address_slots[slot]].address ) {
+            return &index->table[index->address_slots[slot]];
+        }
+
+        slot = (slot + 1) % index->size;
+    }
+
+    return NULL;
+}
+
+void ve_text_index_build(struct VETextIndex *index, const struct VEDirectTextMsg *table, unsigned int count, uint16_t *name_slots, unsigned int size) {
+    index->table = table;
+    index->count = count;
+    index->name_slots = name_slots;
+    index->size = size;
+
+    memset(name_slots, 0xFF, size * sizeof(uint16_t));
+
+    for (unsigned int i = 0; i < count; i++) {
+        if( ve_text_index_find_name(index, table[i].vreg_name) == NULL ) {
+            ve_index_insert(name_slots, size, ve_hash_name(table[i].vreg_name), i);
+        }
+    }
+}
+
+const struct VEDirectTextMsg *ve_text_index_find_name(const struct VETextIndex *index, const char *name) {
+    unsigned int slot = ve_hash_name(name) % index->size;
+
+    while(index->name_slots[slot] != VE_INDEX_EMPTY) {
+        if( !strcmp(name, index->table[index->name_slots[slot]].vreg_name) ) {
+            return &index->table[index->name_slots[slot]];
+        }
+
+        slot = (slot + 1) % index->size;
+    }
+
+    return NULL;
+}
+
+void ve_lookup_init(void) {
+    ve_hex_index_build(&hex_index, vedirect_hex_lookup, vedirect_hex_lookup_count, hex_name_slots, hex_address_slots, VE_HEX_INDEX_SIZE);
+    ve_text_index_build(&text_index, vedirect_text_lookup, vedirect_text_lookup_count, text_name_slots, VE_TEXT_INDEX_SIZE);
+}
+
+const struct VEDirectHexMsg *ve_lookup_by_hex_name(const char *name) {
+    return ve_hex_index_find_name(&hex_index, name);
+}
+
+const struct VEDirectHexMsg *ve_lookup_by_hex_address(const unsigned int address) {
+    return ve_hex_index_find_address(&hex_index, address);
+}
+
+const struct VEDirectTextMsg *ve_lookup_by_text_name(const char *name) {
+    return ve_text_index_find_name(&text_index, name);
+}
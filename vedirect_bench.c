@@ -0,0 +1,413 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmarks for the VE.Direct protocol helpers and the daemon's parsing.  Run with "make bench".
+// The daemon is compiled in without its main(), and linked with the stub broker, so what is timed is
+// its own code.
+#define VEDIRECT_NO_MAIN
+#include "vedirect_to_mqtt.c"
+
+// Counted by the stub broker, mosquitto_stub.c
+extern unsigned long publish_count;
+
+#define LOOKUP_ITERATIONS 2000000
+#define DECODE_ITERATIONS 5000000
+#define FRAME_ITERATIONS 2000000
+#define CORPUS_MAX 256
+
+static volatile unsigned long sink; // Keeps results live so the compiler can't drop the work being timed
+
+// HEX frames as ParseHexMessage() gets them, without the leading ':' and trailing '\n'
+struct FrameCorpus {
+    char frames[CORPUS_MAX][HEX_MESSAGE_MAX + 1];
+    unsigned int count;
+};
+
+// One TEXT field as ParseTextBlock() hands it on
+struct TextCorpusLine {
+    const char *label;
+    const char *value;
+};
+
+// A BMV-702 block from README.md, and the same block a moment later, so the publish filters see both
+// repeats and changes
+const struct TextCorpusLine text_corpus[] = {
+    { "PID", "0x203" }, { "V", "12905" }, { "I", "-15468" }, { "P", "-200" }, { "CE", "-68268" }, { "SOC", "654" },
+    { "TTG", "127" }, { "Alarm", "OFF" }, { "Relay", "OFF" }, { "AR", "0" }, { "BMV", "702" }, { "FW", "0308" },
+    { "H1", "-160896" }, { "H2", "-68268" }, { "H3", "-38254" }, { "H4", "77" }, { "H5", "0" }, { "H6", "-14869411" },
+    { "H7", "2" }, { "H8", "14533" }, { "H9", "24821" }, { "H10", "101" }, { "H11", "0" }, { "H12", "0" },
+    { "H17", "19227" }, { "H18", "17113" },
+    { "PID", "0x203" }, { "V", "12907" }, { "I", "-15301" }, { "P", "-197" }, { "CE", "-68272" }, { "SOC", "654" },
+    { "TTG", "129" }, { "Alarm", "OFF" }, { "Relay", "OFF" }, { "AR", "0" }, { "BMV", "702" }, { "FW", "0308" },
+    { "H1", "-160896" }, { "H2", "-68272" }, { "H3", "-38254" }, { "H4", "77" }, { "H5", "0" }, { "H6", "-14869415" },
+    { "H7", "2" }, { "H8", "14533" }, { "H9", "24822" }, { "H10", "101" }, { "H11", "0" }, { "H12", "0" },
+    { "H17", "19227" }, { "H18", "17113" },
+};
+
+#define TEXT_CORPUS_COUNT ( sizeof(text_corpus) / sizeof(struct TextCorpusLine) )
+
+// The original linear scan lookups, copying the matched entry out, for comparison
+bool linear_lookup_by_hex_name(struct VEDirectHexMsg *vedirect_msg, const struct VEDirectHexMsg *table, unsigned int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if( !strcmp(name, table[i].name) ) {
+            *vedirect_msg = table[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool linear_lookup_by_hex_address(struct VEDirectHexMsg *vedirect_msg, const struct VEDirectHexMsg *table, unsigned int count, const unsigned int address) {
+    for (int i = 0; i < count; i++) {
+        if( address == table[i].address ) {
+            *vedirect_msg = table[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The original switch cascade and per-type unrolled decode from ParseHexMessage, for comparison.
+// Kept out of line like the new decoder, so neither gets specialised for a constant type.
+unsigned int legacy_asciiHexToInt(char ch) {
+  unsigned int num = 0;
+  if( (ch >= '0') && (ch <= '9') ) {
+    num = ch - '0';
+  }
+  else {
+    switch(ch) {
+      case 'A': case 'a': num = 10; break;
+      case 'B': case 'b': num = 11; break;
+      case 'C': case 'c': num = 12; break;
+      case 'D': case 'd': num = 13; break;
+      case 'E': case 'e': num = 14; break;
+      case 'F': case 'f': num = 15; break;
+      default: num = 0;
+    }
+  }
+
+  return num;
+}
+
+__attribute__((noinline)) double legacy_decode(const char *msg_buf, enum VEDirectHexType type) {
+    double data = 0;
+
+    switch(type) {
+        case VE_TYPE_UN8:
+            data = (uint8_t)( ( legacy_asciiHexToInt(*(msg_buf + 0)) << 4 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 1)) << 0 ) );
+        break;
+
+        case VE_TYPE_SN16:
+            data = (int16_t)( ( legacy_asciiHexToInt(*(msg_buf + 0)) << 4  ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 1)) << 0  ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 2)) << 12 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 3)) << 8  ) );
+        break;
+
+        case VE_TYPE_UN24:
+            data = (uint32_t)( ( legacy_asciiHexToInt(*(msg_buf + 0)) << 4  ) +
+                               ( legacy_asciiHexToInt(*(msg_buf + 1)) << 0  ) +
+                               ( legacy_asciiHexToInt(*(msg_buf + 2)) << 12 ) +
+                               ( legacy_asciiHexToInt(*(msg_buf + 3)) << 8  ) +
+                               ( legacy_asciiHexToInt(*(msg_buf + 4)) << 20 ) +
+                               ( legacy_asciiHexToInt(*(msg_buf + 5)) << 16 ) );
+        break;
+
+        case VE_TYPE_SN32:
+            data = (int32_t)( ( legacy_asciiHexToInt(*(msg_buf + 0)) << 4  ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 1)) << 0  ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 2)) << 12 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 3)) << 8  ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 4)) << 20 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 5)) << 16 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 6)) << 28 ) +
+                              ( legacy_asciiHexToInt(*(msg_buf + 7)) << 24 ) );
+        break;
+
+        default:
+        break;
+    }
+
+    return data;
+}
+
+void BenchDecode(const char *label, const char *hex, enum VEDirectHexType type) {
+    struct VEHexValue value;
+    double start;
+    double legacy_ns, table_ns;
+    double total = 0;
+    unsigned int hex_len = strlen(hex) - 1;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < DECODE_ITERATIONS; n++) {
+        total += legacy_decode(hex + (n & 1), type); // Offset varies so the call can't be hoisted out of the loop
+    }
+    legacy_ns = 1.0e9 * (monotonic_timestamp() - start) / DECODE_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < DECODE_ITERATIONS; n++) {
+        if( ve_decode_hex_value(hex + (n & 1), hex_len, type, &value) ) {
+            total += value.integer;
+        }
+    }
+    table_ns = 1.0e9 * (monotonic_timestamp() - start) / DECODE_ITERATIONS;
+
+    sink += (unsigned long)total;
+
+    printf("%8s %12.1f %12.1f\r\n", label, legacy_ns, table_ns);
+}
+
+// Synthetic register table of the given size.  Names share a long common prefix like the real ones do.
+struct VEDirectHexMsg *MakeHexTable(unsigned int count) {
+    struct VEDirectHexMsg *table = calloc(count, sizeof(struct VEDirectHexMsg));
+    char name[32];
+
+    for (unsigned int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "register_%05u", i);
+        table[i].name = strdup(name);
+        table[i].address = (uint16_t)(0x0100 + (i * 7));
+        table[i].type = VE_TYPE_UN16;
+        table[i].multiplier = 1.0;
+        table[i].units = "";
+        table[i].rw_flags = VE_READ;
+        table[i].v_flags = VALID_ALL;
+    }
+
+    return table;
+}
+
+void FreeHexTable(struct VEDirectHexMsg *table, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        free(table[i].name);
+    }
+
+    free(table);
+}
+
+// Keys are visited in a scrambled order so the scan isn't always hitting the front of the table
+unsigned int KeyOrder(unsigned int n, unsigned int count) {
+    return (n * 2654435761u) % count;
+}
+
+void BenchLookup(const struct VEDirectHexMsg *table, unsigned int count) {
+    struct VEHexIndex index;
+    struct VEDirectHexMsg copy;
+    const struct VEDirectHexMsg *found;
+    uint16_t *name_slots = calloc((2 * count) + 1, sizeof(uint16_t));
+    uint16_t *address_slots = calloc((2 * count) + 1, sizeof(uint16_t));
+    double start;
+    double linear_name_ns, linear_address_ns, index_name_ns, index_address_ns;
+    unsigned long total = 0;
+
+    ve_hex_index_build(&index, table, count, name_slots, address_slots, (2 * count) + 1);
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < LOOKUP_ITERATIONS; n++) {
+        if( linear_lookup_by_hex_name(&copy, table, count, table[KeyOrder(n, count)].name) ) {
+            total += copy.address;
+        }
+    }
+    linear_name_ns = 1.0e9 * (monotonic_timestamp() - start) / LOOKUP_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < LOOKUP_ITERATIONS; n++) {
+        if( linear_lookup_by_hex_address(&copy, table, count, table[KeyOrder(n, count)].address) ) {
+            total += copy.address;
+        }
+    }
+    linear_address_ns = 1.0e9 * (monotonic_timestamp() - start) / LOOKUP_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < LOOKUP_ITERATIONS; n++) {
+        if( (found = ve_hex_index_find_name(&index, table[KeyOrder(n, count)].name)) != NULL ) {
+            total += found->address;
+        }
+    }
+    index_name_ns = 1.0e9 * (monotonic_timestamp() - start) / LOOKUP_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < LOOKUP_ITERATIONS; n++) {
+        if( (found = ve_hex_index_find_address(&index, table[KeyOrder(n, count)].address)) != NULL ) {
+            total += found->address;
+        }
+    }
+    index_address_ns = 1.0e9 * (monotonic_timestamp() - start) / LOOKUP_ITERATIONS;
+
+    sink += total;
+
+    printf("%8u %12.1f %12.1f %12.1f %12.1f\r\n", count, linear_name_ns, index_name_ns, linear_address_ns, index_address_ns);
+
+    free(name_slots);
+    free(address_slots);
+}
+
+// Command character, bytes as hex and the checksum, as the device sends a frame
+void AddFrame(struct FrameCorpus *corpus, char command, const uint8_t *bytes, unsigned int count) {
+    char *frame = corpus->frames[corpus->count++];
+    unsigned int length = 0;
+
+    frame[length++] = command;
+    for (unsigned int i = 0; i < count; i++) {
+        length += sprintf(frame + length, "%02X", bytes[i]);
+    }
+
+    sprintf(frame + length, "%02X", CalculateChecksum(frame));
+}
+
+// A GET response for every readable register in the table, twice over with different values
+void MakeFrameCorpus(struct FrameCorpus *corpus) {
+    const struct VEDirectHexMsg *hex_msg;
+    const struct VEHexTypeInfo *info;
+    uint8_t bytes[3 + 33];
+    unsigned int count;
+    uint32_t raw;
+
+    corpus->count = 0;
+
+    for (unsigned int pass = 0; pass < 2; pass++) {
+        for (unsigned int i = 0; (i < vedirect_hex_lookup_count) && (corpus->count < CORPUS_MAX); i++) {
+            hex_msg = &vedirect_hex_lookup[i];
+            info = &ve_hex_type_info[hex_msg->type];
+
+            if( !(hex_msg->rw_flags & VE_READ) ) {
+                continue;
+            }
+
+            bytes[0] = hex_msg->address & 0xFF;
+            bytes[1] = hex_msg->address >> 8;
+            bytes[2] = 0;
+            count = 3;
+
+            if(info->is_string) {
+                count += sprintf((char *)bytes + count, "BMV-70%u", 2 + pass);
+            }
+            else {
+                raw = 0x129A + (17 * i) + (3 * pass);
+                for (unsigned int j = 0; j < info->size; j++) {
+                    bytes[count++] = (uint8_t)( raw >> (8 * j) );
+                }
+            }
+
+            AddFrame(corpus, VE_RSP_GET, bytes, count);
+        }
+    }
+}
+
+void BenchFrames(const struct FrameCorpus *corpus) {
+    struct VEDevice *device = &devices[0];
+    char request[50];
+    double start;
+    double checksum_ns, verify_ns, build_ns, parse_ns;
+    unsigned long total = 0;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < FRAME_ITERATIONS; n++) {
+        total += CalculateChecksum((char *)corpus->frames[n % corpus->count]);
+    }
+    checksum_ns = 1.0e9 * (monotonic_timestamp() - start) / FRAME_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < FRAME_ITERATIONS; n++) {
+        const char *frame = corpus->frames[n % corpus->count];
+        total += VerifyChecksum(frame, strlen(frame));
+    }
+    verify_ns = 1.0e9 * (monotonic_timestamp() - start) / FRAME_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < FRAME_ITERATIONS; n++) {
+        BuildRequest(request, vedirect_hex_lookup[n % vedirect_hex_lookup_count].address);
+        total += request[3];
+    }
+    build_ns = 1.0e9 * (monotonic_timestamp() - start) / FRAME_ITERATIONS;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < FRAME_ITERATIONS; n++) {
+        device->rx_time_s = start;
+        ParseHexMessage(device, (char *)corpus->frames[n % corpus->count]);
+        DrainPublishQueue();
+    }
+    parse_ns = 1.0e9 * (monotonic_timestamp() - start) / FRAME_ITERATIONS;
+
+    sink += total;
+
+    printf("%8u %12.1f %12.1f %12.1f %12.1f\r\n", corpus->count, checksum_ns, verify_ns, build_ns, parse_ns);
+}
+
+void BenchText(void) {
+    struct VEDevice *device = &devices[0];
+    const struct TextCorpusLine *line;
+    unsigned long published = publish_count;
+    double start;
+    double parse_ns;
+
+    start = monotonic_timestamp();
+    for (unsigned int n = 0; n < FRAME_ITERATIONS; n++) {
+        line = &text_corpus[n % TEXT_CORPUS_COUNT];
+        device->rx_time_s = start;
+        ParseTextMessage(device, line->label, line->value);
+        DrainPublishQueue();
+    }
+    parse_ns = 1.0e9 * (monotonic_timestamp() - start) / FRAME_ITERATIONS;
+
+    printf("%8u %12.1f %12.1f\r\n", (unsigned int)TEXT_CORPUS_COUNT, parse_ns,
+           100.0 * (publish_count - published) / FRAME_ITERATIONS);
+}
+
+int main(int argc, char *argv[]) {
+    const unsigned int table_sizes[] = { 8, 32, 128, 512, 2048 };
+    struct VEDirectHexMsg *table;
+    static struct FrameCorpus corpus;
+
+    ve_lookup_init();
+
+    // A device as the daemon would set one up, publishing every register to the stub broker.  The timings take
+    // in queueing each message and taking it off again, as the publisher thread would
+    if( !AddDevice("bench", "bench") || !InitDevice(&devices[0]) ||
+        !PublishQueueInit(&publish_queue, PUBLISH_QUEUE_BYTES, PUBLISH_PAYLOAD_MAX, PUBLISH_DROP_OLDEST) ) {
+        return (EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < vedirect_hex_lookup_count; i++) {
+        devices[0].hex_outputs[i].publish = true;
+    }
+    mqtt_connected = 1;
+
+    MakeFrameCorpus(&corpus);
+
+    printf("Register lookup, ns per lookup\r\n");
+    printf("%8s %12s %12s %12s %12s\r\n", "entries", "scan name", "index name", "scan addr", "index addr");
+
+    BenchLookup(vedirect_hex_lookup, vedirect_hex_lookup_count);
+
+    for (int i = 0; i < ( sizeof(table_sizes) / sizeof(table_sizes[0]) ); i++) {
+        table = MakeHexTable(table_sizes[i]);
+        BenchLookup(table, table_sizes[i]);
+        FreeHexTable(table, table_sizes[i]);
+    }
+
+    printf("\r\nHex payload decode, ns per value\r\n");
+    printf("%8s %12s %12s\r\n", "type", "legacy", "table");
+
+    BenchDecode("UN8", "9A9A", VE_TYPE_UN8);
+    BenchDecode("SN16", "9219A9", VE_TYPE_SN16);
+    BenchDecode("UN24", "9219A0B9", VE_TYPE_UN24);
+    BenchDecode("SN32", "D4FDFFFFD", VE_TYPE_SN32);
+
+    printf("\r\nHEX frames, ns per frame\r\n");
+    printf("%8s %12s %12s %12s %12s\r\n", "frames", "checksum", "verify", "build GET", "parse");
+
+    BenchFrames(&corpus);
+
+    printf("\r\nTEXT fields, ns per field\r\n");
+    printf("%8s %12s %12s\r\n", "fields", "parse", "published %");
+
+    BenchText();
+
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,788 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <termios.h>
+#include <time.h>
+
+#include "vedirect.h"
+
+// Emulates BMV-702 or MPPT devices on pseudo-terminals, for load testing without hardware.  Each device sends
+// TEXT blocks periodically and answers GET, SET and PING HEX frames.  With -a, registers that follow the simulation
+// are also sent as async HEX frames whenever their value changes, as newer firmware does.  Run with no arguments for one BMV, then start
+// the daemon with the -d options printed on the first line.
+
+#define EMULATOR_MAX_DEVICES 1024
+#define FRAME_MAX 80 // Same limit as the daemon's HEX_MESSAGE_MAX
+#define TEXT_BLOCK_MAX 512
+#define PENDING_MAX 16 // Responses waiting out their delay, per device
+#define SETTINGS_MAX 16 // Registers written with SET that are remembered, per device
+#define POLL_MAX_MS 1000
+
+static volatile int running = 1;
+
+// Simulated physical state, in the units the register tables publish in
+enum Quantity {
+    Q_VOLTAGE,
+    Q_CURRENT,
+    Q_POWER,
+    Q_CONSUMED_AH,
+    Q_SOC,
+    Q_TTG,
+    Q_PV_VOLTAGE,
+    Q_PV_POWER,
+    Q_YIELD_TODAY,
+    Q_COUNT,
+    Q_NONE = Q_COUNT,
+};
+
+// Register names from the lookup tables that follow the simulation.  Anything else reads as zero
+// unless the profile gives it a fixed value
+struct QuantityName {
+    const char *name;
+    enum Quantity quantity;
+};
+
+const struct QuantityName quantity_names[] = {
+    { "main_voltage",       Q_VOLTAGE       },
+    { "current_fine",       Q_CURRENT       },
+    { "current_coarse",     Q_CURRENT       },
+    { "power",              Q_POWER         },
+    { "consumed_ah",        Q_CONSUMED_AH   },
+    { "soc",                Q_SOC           },
+    { "ttg",                Q_TTG           },
+    { "pv_voltage",         Q_PV_VOLTAGE    },
+    { "pv_power",           Q_PV_POWER      },
+    { "energy_today",       Q_YIELD_TODAY   },
+};
+
+// One line of a TEXT block.  A NULL value is taken from the simulation through vedirect_text_lookup
+struct TextLine {
+    const char *label;
+    const char *value;
+};
+
+struct EmulatorProfile {
+    const char *name;
+    uint32_t product_id; // Returned for the "id" register
+    uint16_t firmware; // Returned for PING
+    bool is_charger;
+    const struct TextLine *text;
+    unsigned int text_count;
+};
+
+const struct TextLine bmv_text[] = {
+    { "PID", "0x203" }, { "V", NULL }, { "I", NULL }, { "P", NULL }, { "CE", NULL }, { "SOC", NULL }, { "TTG", NULL },
+    { "Alarm", "OFF" }, { "Relay", "OFF" }, { "AR", "0" }, { "BMV", "702" }, { "FW", "0308" },
+    { "H1", "-160896" }, { "H2", "-68268" }, { "H3", "-38254" }, { "H4", "77" }, { "H5", "0" }, { "H6", "-14869411" },
+    { "H7", "2" }, { "H8", "14533" }, { "H9", "24821" }, { "H10", "101" }, { "H11", "0" }, { "H12", "0" },
+    { "H17", "19227" }, { "H18", "17113" },
+};
+
+const struct TextLine mppt_text[] = {
+    { "PID", "0xA053" }, { "FW", "159" }, { "SER#", "HQ1828A1B2C" }, { "V", NULL }, { "I", NULL }, { "VPV", NULL },
+    { "PPV", NULL }, { "CS", "3" }, { "MPPT", "2" }, { "OR", "0x00000000" }, { "ERR", "0" }, { "LOAD", "ON" },
+    { "H19", "1234" }, { "H20", NULL }, { "H21", "350" }, { "H22", "210" }, { "H23", "420" }, { "HSDS", "12" },
+};
+
+const struct EmulatorProfile emulator_profiles[] = {
+    { "bmv",    0x0203, 0x0308, false,  bmv_text,   sizeof(bmv_text) / sizeof(struct TextLine)  },
+    { "mppt",   0xA053, 0x0159, true,   mppt_text,  sizeof(mppt_text) / sizeof(struct TextLine) },
+};
+
+// A register value written with SET, returned by later GETs in place of the simulation
+struct Setting {
+    uint16_t address;
+    uint64_t raw;
+};
+
+struct PendingResponse {
+    double due_s;
+    unsigned int length;
+    char frame[FRAME_MAX + 8];
+};
+
+struct EmulatedDevice {
+    int master_fd;
+    int slave_fd; // Held open so the pty survives the daemon closing and reopening it
+    char slave_path[64];
+    double quantities[Q_COUNT];
+    double next_text_s;
+    int64_t async_sent[sizeof(quantity_names) / sizeof(struct QuantityName)]; // Raw value last sent async
+    struct Setting settings[SETTINGS_MAX];
+    unsigned int setting_count;
+
+    // HEX frame being received
+    char frame[FRAME_MAX + 1];
+    unsigned int frame_length;
+    bool in_frame;
+
+    // FIFO of delayed responses
+    struct PendingResponse pending[PENDING_MAX];
+    unsigned int pending_head;
+    unsigned int pending_tail;
+
+    unsigned long text_blocks;
+    unsigned long gets;
+    unsigned long sets;
+    unsigned long pings;
+    unsigned long async_frames;
+    unsigned long error_responses;
+    unsigned long bad_frames;
+    unsigned long dropped_responses;
+    unsigned long corrupted_bytes;
+};
+
+// Settings, from the command line
+const struct EmulatorProfile *profile = &emulator_profiles[0];
+unsigned int device_count = 1;
+double text_period_s = 1.0;
+double response_delay_s = 0.005;
+double response_jitter_s = 0.0;
+double noise_probability = 0.0; // Chance of any byte sent being corrupted
+double error_probability = 0.0; // Chance of a GET or SET being answered with an error flag
+bool send_async = false;
+double run_time_s = 0.0; // Zero runs until interrupted
+
+struct EmulatedDevice *devices;
+
+double monotonic_timestamp(void) {
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + ( spec.tv_nsec / 1.0e9 );
+}
+
+enum Quantity FindQuantity(const char *name) {
+    for (int i = 0; i < ( sizeof(quantity_names) / sizeof(struct QuantityName) ); i++) {
+        if( !strcmp(quantity_names[i].name, name) ) {
+            return quantity_names[i].quantity;
+        }
+    }
+
+    return Q_NONE;
+}
+
+void InitQuantities(struct EmulatedDevice *device) {
+    double *q = device->quantities;
+
+    q[Q_VOLTAGE] = 12.9 + (drand48() * 0.2);
+    q[Q_CURRENT] = profile->is_charger ? 5.0 : -10.0;
+    q[Q_CONSUMED_AH] = -68.0 * drand48();
+    q[Q_SOC] = 100.0 + (q[Q_CONSUMED_AH] / 2.0); // 200Ah bank
+    q[Q_PV_VOLTAGE] = 35.0;
+    q[Q_YIELD_TODAY] = 0.0;
+}
+
+// Random walk once per TEXT period, keeping the related quantities consistent with each other
+void UpdateQuantities(struct EmulatedDevice *device, double interval_s) {
+    double *q = device->quantities;
+
+    q[Q_CURRENT] += (drand48() - 0.5) * 0.4;
+    q[Q_VOLTAGE] += (drand48() - 0.5) * 0.004;
+    q[Q_POWER] = q[Q_VOLTAGE] * q[Q_CURRENT];
+
+    if(profile->is_charger) {
+        q[Q_CURRENT] = fmax(q[Q_CURRENT], 0);
+        q[Q_PV_VOLTAGE] += (drand48() - 0.5) * 0.1;
+        q[Q_PV_POWER] = q[Q_POWER] * 1.03;
+        q[Q_YIELD_TODAY] += q[Q_PV_POWER] * interval_s / 3.6e6;
+    }
+    else {
+        q[Q_CONSUMED_AH] = fmin(q[Q_CONSUMED_AH] + (q[Q_CURRENT] * interval_s / 3600.0), 0);
+        q[Q_SOC] = 100.0 + (q[Q_CONSUMED_AH] / 2.0);
+        q[Q_TTG] = (q[Q_CURRENT] < 0) ? ( 60.0 * (200.0 + q[Q_CONSUMED_AH]) / -q[Q_CURRENT] ) : -1;
+    }
+}
+
+// Value of a register in its raw units, that is published value divided by the multiplier
+int64_t RawValue(const struct EmulatedDevice *device, const char *name, float multiplier) {
+    enum Quantity quantity = FindQuantity(name);
+
+    if( !strcmp(name, "id") ) {
+        return profile->product_id;
+    }
+
+    if( (quantity == Q_NONE) || (multiplier == 0) ) {
+        return 0;
+    }
+
+    return llround(device->quantities[quantity] / multiplier);
+}
+
+// Flip a random bit in each byte that the noise setting picks out
+void AddNoise(struct EmulatedDevice *device, char *data, unsigned int length) {
+    if(noise_probability <= 0) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        if(drand48() < noise_probability) {
+            data[i] ^= 1 << (lrand48() % 8);
+            device->corrupted_bytes++;
+        }
+    }
+}
+
+// Sends what fits.  A daemon that isn't reading loses data, as it would on a real UART
+void Send(struct EmulatedDevice *device, char *data, unsigned int length) {
+    AddNoise(device, data, length);
+
+    if( write(device->master_fd, data, length) < 0 ) {
+        // EAGAIN when the pty buffer is full
+    }
+}
+
+// ":<command><bytes as hex><checksum>\n" where the command nibble and all bytes sum to 0x55.  Returns the length
+unsigned int BuildFrame(char *out, char command, const uint8_t *bytes, unsigned int count) {
+    uint8_t sum = ve_hex_nibble[(uint8_t)command];
+    unsigned int length = 0;
+
+    out[length++] = ':';
+    out[length++] = command;
+
+    for (unsigned int i = 0; i < count; i++) {
+        length += sprintf(out + length, "%02X", bytes[i]);
+        sum += bytes[i];
+    }
+
+    length += sprintf(out + length, "%02X\n", (uint8_t)(0x55 - sum));
+    return length;
+}
+
+void SendTextBlock(struct EmulatedDevice *device) {
+    const struct VEDirectTextMsg *text_msg;
+    const struct TextLine *line;
+    char block[TEXT_BLOCK_MAX];
+    char value[24];
+    const char *value_string;
+    unsigned int length = 0;
+    uint8_t sum = 0;
+
+    for (unsigned int i = 0; i < profile->text_count; i++) {
+        line = &profile->text[i];
+        value_string = line->value;
+
+        if(value_string == NULL) {
+            text_msg = ve_lookup_by_text_name(line->label);
+
+            if(text_msg == NULL) {
+                value_string = "0";
+            }
+            else if(text_msg->type == VE_TYPE_TXT_BOOL) {
+                value_string = RawValue(device, text_msg->name, 1.0) ? "ON" : "OFF";
+            }
+            else {
+                snprintf(value, sizeof(value), "%lld", (long long)RawValue(device, text_msg->name, text_msg->multiplier));
+                value_string = value;
+            }
+        }
+
+        length += snprintf(block + length, sizeof(block) - length, "\r\n%s\t%s", line->label, value_string);
+    }
+
+    length += snprintf(block + length, sizeof(block) - length, "\r\nChecksum\t");
+
+    for (unsigned int i = 0; i < length; i++) {
+        sum += (uint8_t)block[i];
+    }
+    block[length++] = (char)(uint8_t)(0 - sum);
+
+    device->text_blocks++;
+    Send(device, block, length);
+}
+
+// Queues a response to go out once its delay has passed.  Dropped if too many are already waiting
+void QueueResponse(struct EmulatedDevice *device, char command, const uint8_t *bytes, unsigned int count) {
+    struct PendingResponse *response;
+
+    if( (device->pending_head - device->pending_tail) >= PENDING_MAX ) {
+        device->dropped_responses++;
+        return;
+    }
+
+    response = &device->pending[device->pending_head % PENDING_MAX];
+    response->length = BuildFrame(response->frame, command, bytes, count);
+    response->due_s = monotonic_timestamp() + response_delay_s + (drand48() * response_jitter_s);
+
+    // Keep the FIFO in order even when jitter would let a later response overtake
+    if( (device->pending_head != device->pending_tail) &&
+        (response->due_s < device->pending[(device->pending_head - 1) % PENDING_MAX].due_s) ) {
+        response->due_s = device->pending[(device->pending_head - 1) % PENDING_MAX].due_s;
+    }
+
+    device->pending_head++;
+}
+
+struct Setting *FindSetting(struct EmulatedDevice *device, uint16_t address) {
+    for (unsigned int i = 0; i < device->setting_count; i++) {
+        if(device->settings[i].address == address) {
+            return &device->settings[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Little endian value of a register as it follows the address and flags in a frame.  Returns the length
+unsigned int EncodeValue(struct EmulatedDevice *device, const struct VEDirectHexMsg *hex_msg, uint8_t *out) {
+    const struct VEHexTypeInfo *type_info = &ve_hex_type_info[hex_msg->type];
+    const struct Setting *setting;
+    uint64_t raw;
+
+    if(type_info->is_string) {
+        return snprintf((char *)out, type_info->size + 1, "%s", profile->name);
+    }
+
+    if( (setting = FindSetting(device, hex_msg->address)) != NULL ) {
+        raw = setting->raw;
+    }
+    else {
+        raw = (uint64_t)RawValue(device, hex_msg->name, hex_msg->multiplier);
+    }
+
+    for (unsigned int i = 0; i < type_info->size; i++) {
+        out[i] = (uint8_t)(raw >> (8 * i));
+    }
+
+    return type_info->size;
+}
+
+void AnswerGet(struct EmulatedDevice *device, const uint8_t *bytes, unsigned int count) {
+    static const uint8_t error_flags[] = { VE_RSP_FLG_UNKNOWN, VE_RSP_FLG_UNSUPPORTED, VE_RSP_FLG_PARAMETER_ERROR };
+    const struct VEDirectHexMsg *hex_msg;
+    uint8_t response[3 + 33]; // Address, flags and the longest string with its terminator
+    unsigned int length = 3;
+
+    if(count < 3) {
+        device->bad_frames++;
+        return;
+    }
+
+    device->gets++;
+
+    // Address and flags are echoed back
+    response[0] = bytes[0];
+    response[1] = bytes[1];
+    response[2] = 0;
+
+    hex_msg = ve_lookup_by_hex_address(bytes[0] | (bytes[1] << 8));
+
+    if(hex_msg == NULL) {
+        response[2] = VE_RSP_FLG_UNKNOWN;
+    }
+    else if( (error_probability > 0) && (drand48() < error_probability) ) {
+        response[2] = error_flags[lrand48() % sizeof(error_flags)];
+    }
+    else if(hex_msg->type != VE_TYPE_NONE) {
+        length += EncodeValue(device, hex_msg, response + length);
+    }
+
+    if(response[2] != 0) {
+        device->error_responses++;
+    }
+
+    QueueResponse(device, VE_RSP_GET, response, length);
+}
+
+// A writable register takes the value sent and is answered with it, as the device does.  Anything else,
+// or data of the wrong length for the register, gets an error flag
+void AnswerSet(struct EmulatedDevice *device, const uint8_t *bytes, unsigned int count) {
+    static const uint8_t error_flags[] = { VE_RSP_FLG_UNKNOWN, VE_RSP_FLG_UNSUPPORTED, VE_RSP_FLG_PARAMETER_ERROR };
+    const struct VEDirectHexMsg *hex_msg;
+    struct Setting *setting;
+    uint8_t response[3 + 4];
+    unsigned int length = 3;
+    unsigned int size;
+
+    if(count < 3) {
+        device->bad_frames++;
+        return;
+    }
+
+    device->sets++;
+
+    response[0] = bytes[0];
+    response[1] = bytes[1];
+    response[2] = 0;
+
+    hex_msg = ve_lookup_by_hex_address(bytes[0] | (bytes[1] << 8));
+    size = (hex_msg != NULL) ? ve_hex_type_info[hex_msg->type].size : 0;
+
+    if(hex_msg == NULL) {
+        response[2] = VE_RSP_FLG_UNKNOWN;
+    }
+    else if( !(hex_msg->rw_flags & VE_WRITE) || ve_hex_type_info[hex_msg->type].is_string || ((count - 3) != size) ) {
+        response[2] = VE_RSP_FLG_PARAMETER_ERROR;
+    }
+    else if( (error_probability > 0) && (drand48() < error_probability) ) {
+        response[2] = error_flags[lrand48() % sizeof(error_flags)];
+    }
+    else if(size > 0) {
+        if( ((setting = FindSetting(device, hex_msg->address)) == NULL) && (device->setting_count < SETTINGS_MAX) ) {
+            setting = &device->settings[device->setting_count++];
+            setting->address = hex_msg->address;
+        }
+
+        if(setting != NULL) {
+            setting->raw = 0;
+            for (unsigned int i = 0; i < size; i++) {
+                setting->raw |= (uint64_t)bytes[3 + i] << (8 * i);
+            }
+        }
+
+        memcpy(response + length, bytes + 3, size);
+        length += size;
+    }
+
+    if(response[2] != 0) {
+        device->error_responses++;
+    }
+
+    QueueResponse(device, VE_RSP_SET, response, length);
+}
+
+// Sends an async frame for each simulated register whose value has changed since it was last sent
+void SendAsync(struct EmulatedDevice *device) {
+    const struct VEDirectHexMsg *hex_msg;
+    uint8_t frame_bytes[3 + 8];
+    char frame[FRAME_MAX + 8];
+    int64_t raw;
+
+    for (int i = 0; i < ( sizeof(quantity_names) / sizeof(struct QuantityName) ); i++) {
+        if( ((hex_msg = ve_lookup_by_hex_name(quantity_names[i].name)) == NULL) || (hex_msg->type == VE_TYPE_NONE) ||
+            ve_hex_type_info[hex_msg->type].is_string ) {
+            continue;
+        }
+
+        raw = RawValue(device, hex_msg->name, hex_msg->multiplier);
+        if(raw == device->async_sent[i]) {
+            continue;
+        }
+
+        frame_bytes[0] = hex_msg->address & 0xFF;
+        frame_bytes[1] = hex_msg->address >> 8;
+        frame_bytes[2] = 0;
+
+        device->async_sent[i] = raw;
+        device->async_frames++;
+        Send(device, frame, BuildFrame(frame, VE_CMD_ASYNC, frame_bytes, 3 + EncodeValue(device, hex_msg, frame_bytes + 3)));
+    }
+}
+
+// Handles one complete HEX frame, without the leading ':' and trailing '\n'
+void ProcessFrame(struct EmulatedDevice *device) {
+    uint8_t bytes[FRAME_MAX / 2];
+    uint8_t sum;
+    unsigned int count = 0;
+    uint8_t version[2];
+    uint32_t byte;
+
+    // Command nibble, whole bytes and a checksum that makes them all sum to 0x55
+    if( (device->frame_length < 3) || !(device->frame_length & 1) ||
+        ((sum = ve_hex_nibble[(uint8_t)device->frame[0]]) == VE_HEX_INVALID) ) {
+        device->bad_frames++;
+        return;
+    }
+
+    for (unsigned int i = 1; i < device->frame_length; i += 2) {
+        if( !ve_hex_decode_le(device->frame + i, 1, &byte) ) {
+            device->bad_frames++;
+            return;
+        }
+
+        bytes[count++] = byte;
+        sum += byte;
+    }
+
+    if(sum != 0x55) {
+        device->bad_frames++;
+        return;
+    }
+
+    count--; // Drop the checksum
+
+    switch(device->frame[0]) {
+        case VE_CMD_GET:
+            AnswerGet(device, bytes, count);
+        break;
+
+        case VE_CMD_SET:
+            AnswerSet(device, bytes, count);
+        break;
+
+        case VE_CMD_PING:
+            device->pings++;
+            version[0] = profile->firmware & 0xFF;
+            version[1] = profile->firmware >> 8;
+            QueueResponse(device, VE_RSP_PING, version, 2);
+        break;
+
+        default:
+            QueueResponse(device, VE_RSP_UNKNOWN, NULL, 0);
+        break;
+    }
+}
+
+void ReadDevice(struct EmulatedDevice *device) {
+    char data[256];
+    ssize_t count;
+
+    if( (count = read(device->master_fd, data, sizeof(data))) <= 0 ) {
+        return;
+    }
+
+    for (ssize_t i = 0; i < count; i++) {
+        if(data[i] == ':') {
+            device->in_frame = true;
+            device->frame_length = 0;
+        }
+        else if(!device->in_frame) {
+            continue;
+        }
+        else if(data[i] == '\n') {
+            device->frame[device->frame_length] = '\0';
+            device->in_frame = false;
+            ProcessFrame(device);
+        }
+        else if(device->frame_length < FRAME_MAX) {
+            device->frame[device->frame_length++] = data[i];
+        }
+        else {
+            device->in_frame = false;
+            device->bad_frames++;
+        }
+    }
+}
+
+// Sends any TEXT block or response that has come due.  Returns when the device next needs attention
+double ServiceDevice(struct EmulatedDevice *device, double now) {
+    struct PendingResponse *response;
+
+    if(now >= device->next_text_s) {
+        UpdateQuantities(device, text_period_s);
+        SendTextBlock(device);
+
+        if(send_async) {
+            SendAsync(device);
+        }
+
+        device->next_text_s += text_period_s;
+        if(device->next_text_s <= now) {
+            device->next_text_s = now + text_period_s;
+        }
+    }
+
+    while(device->pending_tail != device->pending_head) {
+        response = &device->pending[device->pending_tail % PENDING_MAX];
+
+        if(response->due_s > now) {
+            return fmin(response->due_s, device->next_text_s);
+        }
+
+        Send(device, response->frame, response->length);
+        device->pending_tail++;
+    }
+
+    return device->next_text_s;
+}
+
+bool OpenDevice(struct EmulatedDevice *device, unsigned int index) {
+    struct termios attributes;
+
+    memset(device, 0, sizeof(*device));
+
+    if( openpty(&device->master_fd, &device->slave_fd, device->slave_path, NULL, NULL) < 0 ) {
+        fprintf(stderr, "Unable to create pty: %s\n", strerror(errno));
+        return false;
+    }
+
+    // Raw, so nothing the emulator sends is echoed back to it
+    tcgetattr(device->slave_fd, &attributes);
+    cfmakeraw(&attributes);
+    tcsetattr(device->slave_fd, TCSANOW, &attributes);
+
+    fcntl(device->master_fd, F_SETFL, fcntl(device->master_fd, F_GETFL) | O_NONBLOCK);
+
+    InitQuantities(device);
+
+    // Nothing has been sent async yet, so every register goes out the first time
+    for (int i = 0; i < ( sizeof(quantity_names) / sizeof(struct QuantityName) ); i++) {
+        device->async_sent[i] = INT64_MIN;
+    }
+
+    // Spread the TEXT blocks out rather than have every device send at once
+    device->next_text_s = monotonic_timestamp() + (text_period_s * index / device_count);
+
+    return true;
+}
+
+void PrintStatistics(double elapsed_s) {
+    unsigned long totals[9] = {0};
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        totals[0] += devices[i].text_blocks;
+        totals[1] += devices[i].gets;
+        totals[2] += devices[i].pings;
+        totals[3] += devices[i].error_responses;
+        totals[4] += devices[i].bad_frames;
+        totals[5] += devices[i].dropped_responses;
+        totals[6] += devices[i].corrupted_bytes;
+        totals[7] += devices[i].async_frames;
+        totals[8] += devices[i].sets;
+    }
+
+    printf("Emulated %u %s devices for %0.1f s\r\n", device_count, profile->name, elapsed_s);
+    printf("Sent %lu TEXT blocks, answered %lu GETs (%0.1f/s per device), %lu SETs and %lu PINGs\r\n", totals[0], totals[1],
+           (elapsed_s > 0) ? ( totals[1] / elapsed_s / device_count ) : 0.0, totals[8], totals[2]);
+    printf("%lu error flag responses, %lu bad frames received, %lu responses dropped, %lu bytes corrupted\r\n",
+           totals[3], totals[4], totals[5], totals[6]);
+
+    if(send_async) {
+        printf("Sent %lu async frames\r\n", totals[7]);
+    }
+}
+
+void SignalHandler(int signum)
+{
+    running = 0;
+}
+
+void Usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-a] [-n count] [-m bmv|mppt] [-p period_ms] [-r delay_ms] [-j jitter_ms] [-N noise] [-e errors] [-s seed] [-t seconds]\n", program);
+    fprintf(stderr, "  -a  Send async HEX frames when simulated registers change\n");
+    fprintf(stderr, "  -n  Number of devices to emulate (default 1)\n");
+    fprintf(stderr, "  -m  Device type (default bmv)\n");
+    fprintf(stderr, "  -p  TEXT block period (default 1000 ms)\n");
+    fprintf(stderr, "  -r  Delay before answering a HEX frame (default 5 ms)\n");
+    fprintf(stderr, "  -j  Random extra delay of up to this much (default 0 ms)\n");
+    fprintf(stderr, "  -N  Probability of each byte sent being corrupted (default 0)\n");
+    fprintf(stderr, "  -e  Probability of a GET or SET being answered with an error flag (default 0)\n");
+    fprintf(stderr, "  -s  Random seed\n");
+    fprintf(stderr, "  -t  Stop after this long (default run until interrupted)\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct pollfd *fds;
+    double start_s;
+    double now;
+    double wake_s;
+    int option;
+    int timeout_ms;
+    long seed = time(NULL);
+
+    while( (option = getopt(argc, argv, "ae:j:m:n:N:p:r:s:t:")) != -1 ) {
+        switch(option) {
+            case 'a': send_async = true; break;
+            case 'e': error_probability = atof(optarg); break;
+            case 'j': response_jitter_s = atof(optarg) / 1000.0; break;
+            case 'n': device_count = atoi(optarg); break;
+            case 'N': noise_probability = atof(optarg); break;
+            case 'p': text_period_s = atof(optarg) / 1000.0; break;
+            case 'r': response_delay_s = atof(optarg) / 1000.0; break;
+            case 's': seed = atol(optarg); break;
+            case 't': run_time_s = atof(optarg); break;
+
+            case 'm':
+                profile = NULL;
+                for (int i = 0; i < ( sizeof(emulator_profiles) / sizeof(struct EmulatorProfile) ); i++) {
+                    if( !strcmp(emulator_profiles[i].name, optarg) ) {
+                        profile = &emulator_profiles[i];
+                    }
+                }
+
+                if(profile == NULL) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+            break;
+
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if( (device_count == 0) || (device_count > EMULATOR_MAX_DEVICES) || (text_period_s <= 0) ) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, SignalHandler);
+    signal(SIGTERM, SignalHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    srand48(seed);
+    ve_lookup_init();
+
+    devices = calloc(device_count, sizeof(struct EmulatedDevice));
+    fds = calloc(device_count, sizeof(struct pollfd));
+
+    if( (devices == NULL) || (fds == NULL) ) {
+        fprintf(stderr, "Unable to allocate devices\n");
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        if( !OpenDevice(&devices[i], i) ) {
+            return 1;
+        }
+
+        fds[i].fd = devices[i].master_fd;
+        fds[i].events = POLLIN;
+    }
+
+    // First line is ready to paste onto the daemon's command line
+    for (unsigned int i = 0; i < device_count; i++) {
+        printf("%s-d %s%u=%s", (i > 0) ? " " : "", profile->name, i, devices[i].slave_path);
+    }
+    printf("\n");
+    fflush(NULL);
+
+    start_s = monotonic_timestamp();
+
+    while(running) {
+        now = monotonic_timestamp();
+
+        if( (run_time_s > 0) && ((now - start_s) >= run_time_s) ) {
+            break;
+        }
+
+        wake_s = now + (POLL_MAX_MS / 1000.0);
+        for (unsigned int i = 0; i < device_count; i++) {
+            wake_s = fmin(wake_s, ServiceDevice(&devices[i], now));
+        }
+
+        timeout_ms = (int)ceil( (wake_s - monotonic_timestamp()) * 1000.0 );
+
+        if( poll(fds, device_count, (timeout_ms > 0) ? timeout_ms : 0) <= 0 ) {
+            continue;
+        }
+
+        for (unsigned int i = 0; i < device_count; i++) {
+            if(fds[i].revents & POLLIN) {
+                ReadDevice(&devices[i]);
+            }
+        }
+    }
+
+    PrintStatistics(monotonic_timestamp() - start_s);
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        close(devices[i].master_fd);
+        close(devices[i].slave_fd);
+    }
+
+    free(devices);
+    free(fds);
+
+    return (EXIT_SUCCESS);
+}
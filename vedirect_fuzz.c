@@ -0,0 +1,275 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Feeds arbitrary bytes through the daemon's receive state machine, and from there the HEX and TEXT parsers
+// and everything they publish to.  "make fuzz" builds it with AddressSanitizer and UndefinedBehaviorSanitizer,
+// so a read or write out of bounds stops the run with a report.
+//
+// Built as it is, this is a standalone driver: each file named is run once, then mutated pieces of them are run
+// for the number of iterations given with -n.  Captures made with the daemon's -c option are decoded to the bytes
+// the device sent.  Built with clang, -fsanitize=fuzzer and -DLIBFUZZER, libFuzzer drives
+// LLVMFuzzerTestOneInput() instead, with a corpus of raw byte files.
+#define VEDIRECT_NO_MAIN
+#include "vedirect_to_mqtt.c"
+
+// Counted by the stub broker, mosquitto_stub.c
+extern unsigned long publish_count;
+
+#define FUZZ_INPUT_MAX 8192
+#define FUZZ_MUTATIONS_MAX 8
+
+static struct VEDevice *fuzz_device;
+
+// One device set up as the daemon does it, publishing everything to the stub broker
+static void FuzzInit(void) {
+    ve_lookup_init();
+
+    // Small enough that a single input can fill it, so the overflow handling is run too
+    if( !AddDevice("fuzz", "fuzz") || !InitDevice(&devices[0]) ||
+        !PublishQueueInit(&publish_queue, 16 * (sizeof(struct PublishSlot) + SNAPSHOT_MAX), SNAPSHOT_MAX, PUBLISH_COALESCE) ) {
+        abort();
+    }
+
+    fuzz_device = &devices[0];
+
+    for (unsigned int i = 0; i < vedirect_hex_lookup_count; i++) {
+        fuzz_device->hex_outputs[i].publish = true;
+    }
+
+    mqtt_connected = 1;
+}
+
+// The first byte chooses the output format and which register has a GET or SET waiting for its answer, so
+// matched responses are covered as well as unsolicited ones.  Every byte, the first included, then goes
+// through the receive state machine from the state of a freshly opened port
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    struct InFlightRequest *request;
+
+    if(fuzz_device == NULL) {
+        FuzzInit();
+    }
+
+    request = &fuzz_device->in_flight;
+
+    fuzz_device->receive_state = GET_START_CHAR;
+    fuzz_device->resume_state = GET_START_CHAR;
+    fuzz_device->message_length = 0;
+    ResetTextBlock(&fuzz_device->text_block);
+
+    snapshot_output = (size > 0) && (data[0] & 0x80);
+    snapshot_format = ( (size > 0) && (data[0] & 0x40) ) ? SNAPSHOT_CBOR : SNAPSHOT_JSON;
+
+    request->state = TX_WAITING;
+    request->command = ( (size > 0) && (data[0] & 0x20) ) ? VE_CMD_SET : VE_CMD_GET;
+    request->address = vedirect_hex_lookup[( (size > 0) ? data[0] : 0 ) % vedirect_hex_lookup_count].address;
+    request->sent_s = monotonic_timestamp();
+    request->set_received_s = request->sent_s;
+
+    for (size_t i = 0; i < size; i++) {
+        fuzz_device->rx_time_s = request->sent_s;
+        ProcessReceivedChar(fuzz_device, (char)data[i]);
+    }
+
+    DrainPublishQueue();
+
+    return 0;
+}
+
+#ifndef LIBFUZZER
+
+struct FuzzSeed {
+    uint8_t *data;
+    size_t size;
+};
+
+// Characters that move the state machine on, picked more often than chance would
+const char fuzz_interesting[] = { ':', '\n', '\r', '\t', '7', '8', 'A', '0', 'F', '-' };
+
+// Reads a file whole.  A capture is decoded to the bytes that were read from the device
+bool LoadSeed(const char *path, struct FuzzSeed *seed) {
+    FILE *file;
+    char line[CAPTURE_LINE_MAX];
+    unsigned int index;
+    int consumed;
+    double offset_s;
+    size_t capacity = 65536;
+    const char *c;
+
+    seed->size = 0;
+
+    if( ((file = fopen(path, "r")) == NULL) || ((seed->data = malloc(capacity)) == NULL) ) {
+        fprintf(stderr, "Unable to read %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    if( (fgets(line, sizeof(line), file) != NULL) && !strncmp(line, "# VE.Direct capture", 19) ) {
+        while( fgets(line, sizeof(line), file) != NULL ) {
+            if( (line[0] == '#') || (sscanf(line, "%lf %u %n", &offset_s, &index, &consumed) < 2) ) {
+                continue;
+            }
+
+            for (c = line + consumed; isxdigit((unsigned char)c[0]) && isxdigit((unsigned char)c[1]); c += 2) {
+                if(seed->size == capacity) {
+                    seed->data = realloc(seed->data, capacity *= 2);
+                }
+                seed->data[seed->size++] = (ve_hex_nibble[(uint8_t)c[0]] << 4) | ve_hex_nibble[(uint8_t)c[1]];
+            }
+        }
+    }
+    else {
+        rewind(file);
+        while( !feof(file) ) {
+            if(seed->size == capacity) {
+                seed->data = realloc(seed->data, capacity *= 2);
+            }
+            seed->size += fread(seed->data + seed->size, 1, capacity - seed->size, file);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// A random piece of a seed with a few bytes flipped, replaced, inserted, dropped or repeated.  Repeats
+// make the long unterminated frames and fields that the buffer limits have to stop
+size_t Mutate(uint8_t *out, const struct FuzzSeed *seed) {
+    size_t size = 0;
+    size_t start, length, at;
+    unsigned int mutations = 1 + (lrand48() % FUZZ_MUTATIONS_MAX);
+
+    if(seed->size > 0) {
+        size = 1 + ( lrand48() % ((seed->size < (FUZZ_INPUT_MAX / 2)) ? seed->size : (FUZZ_INPUT_MAX / 2)) );
+        start = lrand48() % (seed->size - size + 1);
+        memcpy(out, seed->data + start, size);
+    }
+
+    for (unsigned int i = 0; i < mutations; i++) {
+        at = (size > 0) ? (lrand48() % size) : 0;
+
+        switch(lrand48() % 6) {
+            case 0: // Flip a bit
+                if(size > 0) {
+                    out[at] ^= 1 << (lrand48() % 8);
+                }
+            break;
+
+            case 1: // Any byte at all
+                if(size > 0) {
+                    out[at] = lrand48();
+                }
+            break;
+
+            case 2: // Insert a character the state machine cares about
+                if(size < FUZZ_INPUT_MAX) {
+                    memmove(out + at + 1, out + at, size - at);
+                    out[at] = fuzz_interesting[lrand48() % sizeof(fuzz_interesting)];
+                    size++;
+                }
+            break;
+
+            case 3: // Drop a run
+                length = (size > at) ? ( lrand48() % (size - at) ) : 0;
+                memmove(out + at, out + at + length, size - at - length);
+                size -= length;
+            break;
+
+            case 4: // Repeat one byte many times
+                length = lrand48() % 512;
+                if( (size > 0) && ((size + length) <= FUZZ_INPUT_MAX) ) {
+                    memmove(out + at + length, out + at, size - at);
+                    memset(out + at, out[at + length], length);
+                    size += length;
+                }
+            break;
+
+            case 5: // Repeat a run
+                length = (size > at) ? ( lrand48() % (size - at) ) : 0;
+                if( (size + length) <= FUZZ_INPUT_MAX ) {
+                    memmove(out + at + length, out + at, size - at);
+                    size += length;
+                }
+            break;
+        }
+    }
+
+    return size;
+}
+
+void Usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-n runs] [-s seed] [file]...\n", program);
+    fprintf(stderr, "  -n  Mutated inputs to run after the files (default 100000)\n");
+    fprintf(stderr, "  -s  Random seed\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct FuzzSeed *seeds;
+    static uint8_t input[FUZZ_INPUT_MAX];
+    unsigned long runs = 100000;
+    unsigned long bytes = 0;
+    long random_seed = time(NULL);
+    unsigned int seed_count;
+    struct FuzzSeed empty = { NULL, 0 };
+    size_t size;
+    double start_s;
+    int option;
+
+    while( (option = getopt(argc, argv, "n:s:")) != -1 ) {
+        switch(option) {
+            case 'n': runs = strtoul(optarg, NULL, 10); break;
+            case 's': random_seed = atol(optarg); break;
+
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    seed_count = argc - optind;
+    if( (seeds = calloc(seed_count + 1, sizeof(struct FuzzSeed))) == NULL ) {
+        return 1;
+    }
+
+    // Here as well as on the first input, so the statistics below have a device to read with no input at all
+    FuzzInit();
+
+    printf("Seed %ld\r\n", random_seed);
+    srand48(random_seed);
+    start_s = monotonic_timestamp();
+
+    for (unsigned int i = 0; i < seed_count; i++) {
+        if( !LoadSeed(argv[optind + i], &seeds[i]) ) {
+            return 1;
+        }
+
+        LLVMFuzzerTestOneInput(seeds[i].data, seeds[i].size);
+        bytes += seeds[i].size;
+    }
+
+    for (unsigned long n = 0; n < runs; n++) {
+        size = Mutate(input, (seed_count > 0) ? &seeds[n % seed_count] : &empty);
+        LLVMFuzzerTestOneInput(input, size);
+        bytes += size;
+    }
+
+    printf("Ran %u files and %lu mutated inputs, %lu bytes in %0.1f s\r\n", seed_count, runs, bytes, monotonic_timestamp() - start_s);
+    printf("TEXT blocks: %lu good, %lu bad checksum, %lu overflowed\r\n", fuzz_device->text_block_stats.good,
+           fuzz_device->text_block_stats.bad_checksum, fuzz_device->text_block_stats.overflow);
+    printf("HEX frames: %lu good, %lu bad checksum, %lu with error flags\r\n", fuzz_device->hex_frame_stats.good,
+           fuzz_device->hex_frame_stats.bad_checksum, fuzz_device->hex_frame_stats.flag_unknown +
+           fuzz_device->hex_frame_stats.flag_unsupported + fuzz_device->hex_frame_stats.flag_parameter_error +
+           fuzz_device->hex_frame_stats.flag_other);
+    printf("Stub broker: %lu publishes\r\n", publish_count);
+
+    for (unsigned int i = 0; i < seed_count; i++) {
+        free(seeds[i].data);
+    }
+    free(seeds);
+
+    return (EXIT_SUCCESS);
+}
+
+#endif
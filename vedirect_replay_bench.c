@@ -0,0 +1,26 @@
+#include <stddef.h>
+
+// Linked into the daemon along with the stub broker for "make replay-bench", so a replayed capture measures
+// the receive, parse and publish path and not the broker.  The link wraps the allocator so that
+// ProcessReplayThread() can report allocations per frame.
+
+unsigned long allocation_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    __atomic_add_fetch(&allocation_count, 1, __ATOMIC_RELAXED);
+    return __real_realloc(pointer, size);
+}
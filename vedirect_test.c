@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Tests of the daemon's own code.  Run with "make test", the exit status is non-zero if any fail.  Like the
+// benchmarks, the daemon is compiled in without its main() and linked with the stub broker.
+#define VEDIRECT_NO_MAIN
+#include "vedirect_to_mqtt.c"
+
+// The queue is built in rather than linked, so a test can overtake its consumer, see TestQueueStaleTail()
+void StaleTailPause(struct PublishQueue *queue);
+#define PUBLISH_QUEUE_POP_PAUSE(queue) StaleTailPause(queue)
+#include "publish_queue.c"
+
+#define DEADBAND_SAMPLES 200000 // Per register, every raw value where the range is no larger
+#define DEADBAND_TEXT_RANGE 1000000 // TEXT fields have no fixed width, try this far either side of zero
+
+#define QUEUE_TOPICS 16
+#define QUEUE_ROUNDS 100000
+#define QUEUE_BYTES (16 * 64) // A slot per topic, so the slot being claimed is often the one coalesced into
+
+#define STALE_BYTES (4 * 64) // Four slots
+#define STALE_TIMEOUT_S 10 // A pop stuck on a slot it left claimed never returns
+
+// Each message carries a count that goes up with every push, whatever the topic
+struct QueueStress {
+    struct PublishQueue queue;
+    const char *topics[QUEUE_TOPICS];
+    unsigned long pushed_last[QUEUE_TOPICS];
+    unsigned long popped_last[QUEUE_TOPICS];
+    unsigned long popped;
+    unsigned long backwards; // Popped a value older than one already popped for the same topic
+    unsigned long corrupt;
+    unsigned int round; // Set by the producer once a round is pushed
+    unsigned int drained; // Set by the consumer once the queue is empty after that
+    int done;
+};
+
+static char queue_topic_names[QUEUE_TOPICS][8];
+
+int QueueTopic(const struct QueueStress *stress, const char *topic) {
+    for (int i = 0; i < QUEUE_TOPICS; i++) {
+        if(stress->topics[i] == topic) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void *QueueConsumer(void *context) {
+    struct QueueStress *stress = context;
+    static uint8_t buffer[sizeof(struct PublishSlot) + 64] __attribute__((aligned(8)));
+    struct PublishSlot *message = (struct PublishSlot *)buffer;
+    unsigned long value;
+    int topic;
+
+    for (;;) {
+        // Read before popping, so the queue is known to hold all of the round once it comes up empty
+        unsigned int round = __atomic_load_n(&stress->round, __ATOMIC_SEQ_CST);
+
+        while( PublishQueuePop(&stress->queue, message) ) {
+            if( ((topic = QueueTopic(stress, message->topic)) < 0) || (message->length != sizeof(value)) ) {
+                stress->corrupt++;
+                continue;
+            }
+
+            memcpy(&value, message->payload, sizeof(value));
+
+            if( (value % QUEUE_TOPICS) != (unsigned int)topic ) {
+                stress->corrupt++;
+            }
+            else if(value < stress->popped_last[topic]) {
+                stress->backwards++;
+            }
+
+            stress->popped_last[topic] = value;
+            stress->popped++;
+        }
+
+        __atomic_store_n(&stress->drained, round, __ATOMIC_SEQ_CST);
+
+        if( __atomic_load_n(&stress->done, __ATOMIC_SEQ_CST) ) {
+            return NULL;
+        }
+
+        sched_yield();
+    }
+}
+
+// The producer coalesces into slots while the consumer copies and claims them.  Whatever the interleaving, once
+// the consumer has emptied the queue the last value pushed for each topic must be the last one popped.  Each
+// round ends that way, so a value lost to a badly timed claim shows up in the round it was lost in
+bool TestQueueCoalesce(void) {
+    static struct QueueStress stress;
+    unsigned long value = QUEUE_TOPICS;
+    unsigned long lost = 0;
+    pthread_t consumer;
+    bool passed = true;
+
+    memset(&stress, 0, sizeof(stress));
+
+    if( !PublishQueueInit(&stress.queue, QUEUE_BYTES, sizeof(unsigned long), PUBLISH_COALESCE) || (stress.queue.size != QUEUE_TOPICS) ) {
+        printf("FAIL queue coalesce: no queue of %u slots\r\n", QUEUE_TOPICS);
+        return false;
+    }
+
+    // Topics are compared by address, as the daemon's are
+    for (int i = 0; i < QUEUE_TOPICS; i++) {
+        snprintf(queue_topic_names[i], sizeof(queue_topic_names[i]), "test/%d", i);
+        stress.topics[i] = queue_topic_names[i];
+    }
+
+    pthread_create(&consumer, NULL, QueueConsumer, &stress);
+
+    for (unsigned int round = 1; round <= QUEUE_ROUNDS; round++) {
+        // Fill the queue, then coalesce into every slot of it, including whichever the consumer is claiming
+        for (unsigned int n = 0; n < 2 * QUEUE_TOPICS; n++, value++) {
+            PublishQueuePush(&stress.queue, stress.topics[value % QUEUE_TOPICS], &value, sizeof(value), NULL, 0);
+            stress.pushed_last[value % QUEUE_TOPICS] = value;
+
+            // Let the consumer in once the queue is full, on one CPU it otherwise only runs between rounds
+            if(n == QUEUE_TOPICS - 1) {
+                sched_yield();
+            }
+        }
+
+        __atomic_store_n(&stress.round, round, __ATOMIC_SEQ_CST);
+
+        while( __atomic_load_n(&stress.drained, __ATOMIC_SEQ_CST) != round ) {
+            sched_yield();
+        }
+
+        for (int i = 0; i < QUEUE_TOPICS; i++) {
+            if(__atomic_load_n(&stress.popped_last[i], __ATOMIC_SEQ_CST) != stress.pushed_last[i]) {
+                if(lost++ == 0) {
+                    printf("FAIL queue coalesce: round %u %s last pushed %lu, last popped %lu\r\n", round,
+                           queue_topic_names[i], stress.pushed_last[i], stress.popped_last[i]);
+                }
+                passed = false;
+            }
+        }
+    }
+
+    __atomic_store_n(&stress.done, 1, __ATOMIC_SEQ_CST);
+    pthread_join(consumer, NULL);
+
+    if(lost > 0) {
+        printf("FAIL queue coalesce: %lu values lost over %u rounds\r\n", lost, QUEUE_ROUNDS);
+    }
+
+    if( (stress.backwards > 0) || (stress.corrupt > 0) ) {
+        printf("FAIL queue coalesce: %lu popped out of order, %lu corrupt\r\n", stress.backwards, stress.corrupt);
+        passed = false;
+    }
+
+    if(passed) {
+        printf("PASS queue coalesce: %u slots, %lu pushed, %lu coalesced, %lu dropped, %lu popped\r\n", stress.queue.size,
+               stress.queue.pushed, stress.queue.coalesced, stress.queue.dropped, stress.popped);
+    }
+
+    PublishQueueFree(&stress.queue);
+    return passed;
+}
+
+static struct PublishQueue *stale_queue; // Overtaken at its next pop, then cleared
+static unsigned long stale_value; // Next to push
+
+// Overruns the queue from inside a pop, after it has read the tail.  Every message is dropped, the one at the
+// tail among them, and every slot written again, the one the pop is about to read among them
+void StaleTailPause(struct PublishQueue *queue) {
+    if(queue != stale_queue) {
+        return;
+    }
+
+    stale_queue = NULL;
+
+    for (unsigned int i = 0; i < queue->size; i++, stale_value++) {
+        PublishQueuePush(queue, "test/stale", &stale_value, sizeof(stale_value), NULL, 0);
+    }
+}
+
+void StaleTailAlarm(int signal) {
+    static const char message[] = "FAIL queue stale tail: pop never returned\r\n";
+
+    // Exiting either way, printf isn't safe in a signal handler
+    if( write(STDOUT_FILENO, message, sizeof(message) - 1) < 0 ) {
+        _exit(EXIT_FAILURE);
+    }
+
+    _exit(EXIT_FAILURE);
+}
+
+// A pop that copies and claims a slot its stale tail points at, only for the tail to have moved on, must give the
+// claim back.  Left claimed, the slot holds a live message no pop will take, and the next to reach it waits forever
+bool TestQueueStaleTail(void) {
+    static struct PublishQueue queue;
+    static uint8_t buffer[sizeof(struct PublishSlot) + sizeof(unsigned long)] __attribute__((aligned(8)));
+    struct PublishSlot *message = (struct PublishSlot *)buffer;
+    unsigned long expected;
+    unsigned long value;
+    bool passed = true;
+
+    if( !PublishQueueInit(&queue, STALE_BYTES, sizeof(unsigned long), PUBLISH_DROP_OLDEST) ) {
+        printf("FAIL queue stale tail: no queue\r\n");
+        return false;
+    }
+
+    for (stale_value = 0; stale_value < queue.size; stale_value++) {
+        PublishQueuePush(&queue, "test/stale", &stale_value, sizeof(stale_value), NULL, 0);
+    }
+
+    // All of these are dropped by the overrun, the first to pop is the first pushed by it
+    expected = stale_value;
+
+    fflush(stdout);
+    signal(SIGALRM, StaleTailAlarm);
+    alarm(STALE_TIMEOUT_S);
+    stale_queue = &queue;
+
+    while( PublishQueuePop(&queue, message) ) {
+        memcpy(&value, message->payload, sizeof(value));
+
+        if(value != expected) {
+            printf("FAIL queue stale tail: popped %lu, expected %lu\r\n", value, expected);
+            passed = false;
+            break;
+        }
+        expected++;
+    }
+
+    alarm(0);
+
+    if( passed && (expected != stale_value) ) {
+        printf("FAIL queue stale tail: popped up to %lu of %lu pushed\r\n", expected, stale_value);
+        passed = false;
+    }
+
+    if(passed) {
+        printf("PASS queue stale tail: %u slots, %lu dropped\r\n", queue.size, queue.dropped);
+    }
+
+    PublishQueueFree(&queue);
+    return passed;
+}
+
+// Whether PublishValue() sends value, having last sent last
+bool DeadbandPublishes(struct RegisterOutput *output, double last, double value) {
+    unsigned long count = output->publish_count;
+
+    output->published = true;
+    output->last_value = last;
+    output->last_publish_s = monotonic_timestamp();
+    strcpy(output->last_payload, "last");
+
+    PublishValue(&devices[0], output, "next", 4, true, value, 0);
+
+    return (output->publish_count > count);
+}
+
+// Steps through the raw values of one register.  A move of the deadband either way, converted to register
+// steps, must be published, and a move of one step less must not.  Returns the number of failures
+unsigned long TestRegisterDeadband(const char *label, const struct PublishFilter *filter, float multiplier, int64_t min, int64_t max) {
+    static struct RegisterOutput output;
+    int decimals = MultiplierDecimals(multiplier);
+    int64_t step = llround(filter->deadband_absolute / multiplier);
+    int64_t stride = ((max - min) / DEADBAND_SAMPLES) + 1;
+    unsigned long failed = 0;
+    double last;
+
+    memset(&output, 0, sizeof(output));
+    output.name = filter->name;
+    snprintf(output.topic, sizeof(output.topic), "test/%s", filter->name);
+    output.decimals = decimals;
+    output.filter = filter;
+
+    for (int64_t raw = min + step; raw <= max - step; raw += stride) {
+        last = ScaledValue(raw, multiplier, decimals);
+
+        if( !DeadbandPublishes(&output, last, ScaledValue(raw + step, multiplier, decimals)) ||
+            !DeadbandPublishes(&output, last, ScaledValue(raw - step, multiplier, decimals)) ||
+            ((step > 1) && DeadbandPublishes(&output, last, ScaledValue(raw + step - 1, multiplier, decimals))) ||
+            ((step > 1) && DeadbandPublishes(&output, last, ScaledValue(raw - step + 1, multiplier, decimals))) ) {
+            if(failed++ == 0) {
+                printf("FAIL deadband: %s %s, deadband %g, from raw %lld\r\n", label, filter->name, filter->deadband_absolute,
+                       (long long)raw);
+            }
+        }
+    }
+
+    return failed;
+}
+
+// Every register with an absolute deadband, HEX and TEXT, over the range its type can hold
+bool TestDeadband(void) {
+    const struct VEDirectHexMsg *hex_msg;
+    const struct VEHexTypeInfo *info;
+    unsigned long failed = 0;
+    unsigned int registers = 0;
+    int64_t min, max;
+
+    for (int i = 0; i < ( sizeof(publish_filter_list) / sizeof(struct PublishFilter) ); i++) {
+        const struct PublishFilter *filter = &publish_filter_list[i];
+
+        if( (filter->deadband_absolute == 0) || (filter->deadband_relative != 0) ) {
+            continue;
+        }
+
+        if( (hex_msg = ve_lookup_by_hex_name(filter->name)) != NULL ) {
+            info = &ve_hex_type_info[hex_msg->type];
+            max = info->is_signed ? ((INT64_C(1) << (8 * info->size - 1)) - 1) : ((INT64_C(1) << (8 * info->size)) - 1);
+            min = info->is_signed ? (-max - 1) : 0;
+
+            failed += TestRegisterDeadband("hex", filter, hex_msg->multiplier, min, max);
+            registers++;
+        }
+
+        // Looked up by label when parsing, so find it by name here
+        for (unsigned int j = 0; j < vedirect_text_lookup_count; j++) {
+            if( !strcmp(vedirect_text_lookup[j].name, filter->name) ) {
+                failed += TestRegisterDeadband("text", filter, vedirect_text_lookup[j].multiplier, -DEADBAND_TEXT_RANGE, DEADBAND_TEXT_RANGE);
+                registers++;
+            }
+        }
+    }
+
+    if(failed > 0) {
+        printf("FAIL deadband: %lu values wrongly published or held back\r\n", failed);
+        return false;
+    }
+
+    printf("PASS deadband: %u registers\r\n", registers);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int failed = 0;
+
+    ve_lookup_init();
+
+    // A device for PublishValue() to publish from, its messages are queued and never sent
+    if( !AddDevice("test", "test") || !InitDevice(&devices[0]) ||
+        !PublishQueueInit(&publish_queue, PUBLISH_QUEUE_BYTES, PUBLISH_PAYLOAD_MAX, PUBLISH_DROP_OLDEST) ) {
+        return (EXIT_FAILURE);
+    }
+
+    failed += !TestDeadband();
+    failed += !TestQueueCoalesce();
+    failed += !TestQueueStaleTail();
+
+    printf("%s\r\n", failed ? "FAILED" : "All passed");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,4 +1,7 @@
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,41 +10,344 @@
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
 #include <systemd/sd-daemon.h>
 
 #include <mosquitto.h>
-#include <wiringSerial.h>
 #include "vedirect.h"
-
-
-// TODO: Parse returned messages, store data in intermediate form
-// TODO: Add thread for publish to MQTT
-// TODO: Only GETS right now.  Consider adding SET commands
+#include "logger.h"
+#include "histogram.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "transport.h"
+#include "publish_queue.h"
+#include "register_store.h"
+#include "metrics_server.h"
 
 static volatile int running = 1;
-int fd;
+static volatile int dump_statistics = 0;
+int epoll_fd;
 struct mosquitto *mqtt;
 
-pthread_t process_rx_thread;
-pthread_t process_rq_thread;
-pthread_t process_tx_thread;
+pthread_t process_devices_thread;
+pthread_t publisher_thread;
+static volatile int publishing = 1; // Cleared once the devices are no longer read, the queue is then emptied
+int stats_timer_fd = -1;
+int journal_timer_fd = -1;
+int set_event_fd = -1; // Signalled by the MQTT thread when it queues a SET
 
-pthread_mutex_t lock_request_list;
+// Set and counted by the MQTT thread's callbacks.  A new connection number tells the journal drain to
+// resend anything that was waiting for acknowledgement on the old one
+int mqtt_connected = 0;
+unsigned int mqtt_connection = 0;
 
-const char *mqtt_host = "192.168.43.57";
+const char *mqtt_host = "192.168.43.57"; // Overridden with -b
 const unsigned int mqtt_port = 1883;
-const char *bmv_topic_root = "bmv";
-const unsigned int min_request_period_us = 50000; // Too fast and the BMV will miss requests
 
-// TODO: Replace with dynamic FIFO/circular buffer
-unsigned int request_list[32]; // Added to periodically, processed immediately with small delay between
-unsigned int request_count = 0;
+// Used when no device is given on the command line, or a device is given without a topic root
+const char *default_device_path = "/dev/ttyS0";
+const char *default_topic_root = "bmv";
+
+// Each GET waits for its response before the next is sent.  The timeout and the gap before the next request
+// follow the measured round trip time, bounded by these.
+const unsigned int min_request_gap_us = 2000; // Too fast and the BMV will miss requests
+const unsigned int max_request_gap_us = 50000;
+const unsigned int min_response_timeout_us = 20000;
+const unsigned int max_response_timeout_us = 500000;
+const unsigned int max_request_retries = 2; // Timeout doubles on each retry
+
+// Newer firmware sends some registers unasked (VE_CMD_ASYNC) when they change.  A register that has arrived that
+// way within async_hold_s is left out of the periodic requests, which resume if the device stops sending it
+const double async_hold_s = 10;
+
+const unsigned int stats_period_s = 10; // How often each device publishes <root>/$stats
+
+// With -j, messages that can't go to the broker are kept in a journal file of journal_size_mb and sent
+// with QoS 1 once it is back, oldest first, at no more than journal_drain_per_s
+unsigned int journal_size_mb = 16; // Overridden with -J
+const unsigned int journal_drain_per_s = 200;
+const unsigned int journal_drain_period_ms = 100;
+const unsigned int journal_sync_s = 5; // How often the journal is written back to the file
+
+// Parsed values go to the publisher thread through a queue of about this size, see PublishMessage().  When it is
+// full the oldest message is dropped, or with -q coalesce a waiting message for the same topic is replaced
+#define PUBLISH_QUEUE_BYTES (512 * 1024)
+struct PublishQueue publish_queue;
+enum PublishOverflow publish_overflow = PUBLISH_DROP_OLDEST;
+
+// Messages too large for the publish queue's slots, which is only $stats, go through a few slots of their own.
+// A document waiting for the same device is replaced, the newer one is what matters
+#define LARGE_QUEUE_BYTES (64 * 1024)
+struct PublishQueue large_queue;
+
+// With -m, OpenMetrics scrapes are served on [host:]port by a thread of their own, see RenderMetrics().  Each
+// response is rendered into one buffer, sized at startup for the largest scrape, see MetricsBodySize()
+const char *metrics_address = NULL;
+#define METRICS_NUMBER_MAX 24 // Room for any one number in a scrape, "-1.234567890e+308" or a 64 bit count
+struct MetricsServer metrics_server;
+pthread_t metrics_thread;
+
+#define REQUEST_QUEUE_SIZE 32 // Must be a power of two
+#define SET_QUEUE_SIZE 8 // Must be a power of two
+
+// FIFO of register addresses waiting to be requested.  Added to periodically, processed immediately with small delay between
+struct RequestQueue {
+    unsigned int entries[REQUEST_QUEUE_SIZE];
+    unsigned int head; // Free running write index
+    unsigned int tail; // Free running read index
+    unsigned int max_depth;
+    unsigned long dropped;
+};
+
+enum TransmitState {
+    TX_IDLE,
+    TX_WAITING, // For the response to the request in flight
+    TX_GAP, // Between a response and the next request
+};
+
+// A write received over MQTT, checked against the register table and encoded ready to send
+struct SetRequest {
+    uint16_t address;
+    char message[50];
+    double received_s; // When the MQTT thread queued it
+};
+
+// A SET the MQTT thread refused.  Only the event loop publishes, so it answers them
+struct SetRejection {
+    unsigned int register_index;
+    const char *error;
+};
+
+// SETs waiting for the line.  They go ahead of any queued GET, so a write only waits for the request already
+// in flight however deep the poll queue is.  Filled by the MQTT thread and emptied by the event loop, so locked
+struct SetQueue {
+    pthread_mutex_t lock;
+    struct SetRequest entries[SET_QUEUE_SIZE];
+    unsigned int head; // Free running write index
+    unsigned int tail; // Free running read index
+
+    struct SetRejection rejections[SET_QUEUE_SIZE]; // Waiting to be answered
+    unsigned int rejections_head;
+    unsigned int rejections_tail;
+
+    unsigned long received; // Written by the MQTT thread
+    unsigned long rejected;
+    unsigned long completed; // Written by the event loop
+    unsigned long failed; // Refused by the device or never answered
+};
+
+// Registers that wipe the device's settings or history.  Any client of the broker can SET, so these are refused
+// over MQTT unless -w is given
+const char *destructive_set_list[] = {
+    "restore_defaults",
+    "clear_history",
+};
+
+#define DESTRUCTIVE_SET_COUNT ( sizeof(destructive_set_list) / sizeof(const char *) )
+
+bool destructive_sets = false;
+
+// The GET or SET currently on the wire.  Completed when the matching response is parsed, or by its deadline passing
+struct InFlightRequest {
+    enum TransmitState state;
+    char command; // VE_CMD_GET or VE_CMD_SET
+    uint16_t address;
+    double set_received_s; // Of a SET, for its latency
+    char message[50];
+    unsigned int attempt;
+    double timeout_s;
+    double deadline_s; // End of the response timeout or of the gap, depending on state
+    double sent_s;
+    double rtt_s; // Of the completing response
+
+    // Smoothed round trip time and its mean deviation, as TCP does it
+    double srtt_s;
+    double rttvar_s;
+    bool have_rtt;
+
+    unsigned long sent;
+    unsigned long answered_count;
+    unsigned long retries;
+    unsigned long timeouts; // Requests given up on after all retries
+};
+
+#define RX_RING_SIZE 1024 // Must be a power of two
+#define RX_BATCH_BUCKETS 8
+
+// Bytes are read from the UART in batches and drained into the frame state machine from here
+struct RxRingBuffer {
+    char data[RX_RING_SIZE];
+    unsigned int head; // Free running write index
+    unsigned int tail; // Free running read index
+};
+
+// Counters for how well reads from the UART are batched
+struct RxStatistics {
+    unsigned long read_calls;
+    unsigned long bytes;
+    unsigned long max_batch;
+    unsigned long batch_histogram[RX_BATCH_BUCKETS]; // Bucket n counts reads of 2^n to 2^(n+1)-1 bytes, last bucket is open ended
+};
+
+// Link quality counters for received HEX frames, per register and in total
+struct HexFrameStatistics {
+    unsigned long good;
+    unsigned long async; // Of the good frames, how many the device sent unasked
+    unsigned long bad_checksum;
+    unsigned long flag_unknown;
+    unsigned long flag_unsupported;
+    unsigned long flag_parameter_error;
+    unsigned long flag_other; // Flags set, but none of the three above
+};
+
+// Request to response timing for one register.  The send time is kept per address so a response is matched
+// to its own request, and cleared once matched so that unsolicited frames are not counted
+struct RegisterTiming {
+    double sent_s; // Of the latest attempt, zero when nothing is outstanding
+    struct Histogram *latency; // In microseconds, only allocated for registers that are requested
+    double async_s; // When the device last sent the register unasked, zero if never
+};
+
+#define TOPIC_MAX 64
+#define PAYLOAD_MAX 50
+#define PUBLISH_PAYLOAD_MAX ( PAYLOAD_MAX * 4 ) // Any message but a snapshot, the largest are aggregates
+
+// Limits on how often a register is published.  A value goes out when it moves by at least the larger of
+// the two deadbands from what was last published, or when nothing has been published for max_silence_s.
+// A change of exactly the deadband is published, so a deadband of one step of the register publishes every
+// change, as does a deadband of zero.
+struct PublishFilter {
+    const char *name; // Applies to both the hex and text register of this name
+    float deadband_absolute; // In published units
+    float deadband_relative; // Fraction of the last published value
+    float max_silence_s;
+};
+
+#define DEADBAND_TOLERANCE 1.0e-6 // Of the deadband, more than the float deadbands and the subtraction can be out by
+
+const struct PublishFilter default_publish_filter = { NULL, 0, 0, 60 };
+
+// TODO: Add command line switch or similar to control the filters
+struct PublishFilter publish_filter_list[] = {
+    { "main_voltage",       0.01,   0,      60  },
+    { "current_fine",       0.05,   0,      60  },
+    { "current_coarse",     0.1,    0,      60  },
+    { "power",              1,      0,      60  },
+    { "consumed_ah",        0.05,   0,      60  },
+    { "soc",                0.1,    0,      60  },
+    { "ttg",                0,      0.01,   60  },
+};
+
+bool publish_all = false; // Bypass the filters and publish every value received
+
+#define AGGREGATE_WINDOWS_MAX 4
+
+// Registers listed here are summarised rather than published sample by sample.  For each window the
+// minimum, maximum, mean, last value and sample count go out on <topic>/<window>s when it closes, so
+// a register can be polled far more often than it is published.  Windows with no samples publish nothing.
+struct AggregateConfig {
+    const char *name; // Applies to both the hex and text register of this name
+    float window_s[AGGREGATE_WINDOWS_MAX]; // Unused entries left zero
+};
+
+struct AggregateConfig aggregate_list[] = {
+    { "current_coarse",     { 1, 10, 60 } },
+    { "main_voltage",       { 1, 10, 60 } },
+};
+
+#define AGGREGATE_CONFIG_COUNT ( sizeof(aggregate_list) / sizeof(struct AggregateConfig) )
+
+// Running summary of one register over one window, a fixed size however many samples arrive
+struct Aggregate {
+    char topic[TOPIC_MAX];
+    double window_s;
+    double end_s; // When the current window closes, windows are aligned to multiples of their length
+    int decimals;
+    unsigned long count;
+    double min;
+    double max;
+    double sum;
+    double last;
+};
+
+// With -o json or -o cbor, values are gathered into one document per TEXT block and per pass of the request list
+// instead of each going to its own topic.  Snapshots carry every value, the publish filters don't apply to them
+bool snapshot_output = false;
+enum SnapshotFormat snapshot_format = SNAPSHOT_JSON;
+
+struct SnapshotOutput {
+    char topic[TOPIC_MAX];
+    struct Snapshot snapshot;
+    unsigned int fields; // Sent as soon as this many requested values are in.  Zero leaves it to the caller
+    unsigned int requested; // Values added so far from registers in the request list
+    unsigned long publish_count;
+    unsigned long overflow_count;
+};
+
+// How each register is published, worked out once at startup so the parse path doesn't format topics
+struct RegisterOutput {
+    const char *name;
+    char topic[TOPIC_MAX];
+    char set_result_topic[TOPIC_MAX]; // HEX registers only
+    bool string;
+    int decimals; // Multiplier as a power of ten (0.01 -> 2), or -1 if it isn't one
+    bool publish;
+    bool requested; // In the periodic request list, whether or not publish is set there
+    const struct PublishFilter *filter;
+
+    // Last value that went out
+    char last_payload[PAYLOAD_MAX];
+    double last_value;
+    double last_publish_s;
+    bool published;
+
+    unsigned long publish_count;
+    unsigned long suppress_count;
+
+    struct SnapshotOutput *snapshot;
+    unsigned long snapshot_sequence; // Sequence of the snapshot this register's value last went into
+
+    struct Aggregate *aggregates; // NULL unless the register is in aggregate_list
+    unsigned int aggregate_count;
+};
 
 enum ReceiveState {
     GET_START_CHAR,
     GET_HEX_DATA,
     GET_TEXT_DATA,
+    GET_TEXT_CHECKSUM,
+};
+
+#define HEX_MESSAGE_MAX 80 // Command, address, flags, up to 32 data bytes and checksum
+#define TEXT_BLOCK_MAX_FIELDS 32
+#define TEXT_NAME_MAX 9 // Label and value limits from the VE.Direct TEXT protocol
+#define TEXT_VALUE_MAX 33
+
+struct TextField {
+    char name[TEXT_NAME_MAX + 1];
+    char value[TEXT_VALUE_MAX + 1];
+};
+
+// A TEXT block is collected whole and only used once its Checksum field proves it intact
+struct TextBlock {
+    struct TextField fields[TEXT_BLOCK_MAX_FIELDS];
+    unsigned int count;
+    unsigned int length; // Characters so far in the name or value being received
+    bool in_value;
+    bool overflow; // Too many fields or an over-long name or value, the block will be discarded
+    uint8_t sum; // Modulo-256 sum of every byte in the block, zero when valid
+};
+
+struct TextBlockStatistics {
+    unsigned long good;
+    unsigned long bad_checksum;
+    unsigned long overflow;
 };
 
 struct VEPeriodicRequest {
@@ -50,17 +356,194 @@ struct VEPeriodicRequest {
     float  request_period_s;
     double last_update_s;
 //    float publish_period_s;
+
+    // Filled in at startup by InitRequestSchedule()
+    uint16_t address;
+    unsigned int register_index; // Into vedirect_hex_lookup
+    double next_due_s;
+
+    int text_index; // Into vedirect_text_lookup for the TEXT field carrying the same value, -1 if none does
+    unsigned long async_skip_count; // Times the request was left out because the device sent the value anyway
+    unsigned long text_skip_count; // Times the request was left out because the TEXT block had a fresh value
+
+    // Scheduling jitter, how late each request was queued relative to when it was due
+    unsigned long request_count;
+    double total_late_s;
+    double max_late_s;
 };
 
 // TODO: Add command line switch or similar to control the request list
 // NOTE: Setting any of these less than about 2 seconds can prevent the automatic VE.Direct TEXT protocol from being output
-struct VEPeriodicRequest periodic_request_list[] = {
+// Every device is polled for the same registers, each working through its own copy of this list
+const struct VEPeriodicRequest periodic_request_list[] = {
     { true, "soc", 3, 0 },
     { true, "current_coarse", 3, 0 },
     { true, "consumed_ah", 3, 0 },
     { true, "main_voltage", 3, 0 },
 };
 
+#define PERIODIC_REQUEST_COUNT ( sizeof(periodic_request_list) / sizeof(struct VEPeriodicRequest) )
+
+// $stats carries a latency object for each requested register on top of its fixed fields, so grows with the list
+#define STATS_LATENCY_MAX 192 // "name":{"count":...}, with every count and time at its longest
+#define STATS_PAYLOAD_MAX ( 2048 + (PERIODIC_REQUEST_COUNT * STATS_LATENCY_MAX) )
+
+// HEX registers holding the same quantity, in the same units, as a field of the TEXT block the device sends about
+// once a second.  A periodic request for one of these is left out while the TEXT value is younger than the
+// request period, and the TEXT value goes out on the HEX topic in its place, so the UART is only spent on
+// registers TEXT doesn't cover.  Resolution can differ, TEXT gives SOC to 0.1% where HEX gives 0.01%.  TTG isn't
+// here, TEXT sends -1 for an infinite time to go where HEX sends 0xFFFF
+struct TextEquivalent {
+    const char *hex_name;
+    const char *text_name;
+};
+
+const struct TextEquivalent text_equivalent_list[] = {
+    { "main_voltage",           "main_voltage" },
+    { "current_coarse",         "current_fine" },
+    { "current_fine",           "current_fine" },
+    { "power",                  "power" },
+    { "consumed_ah",            "consumed_ah" },
+    { "soc",                    "soc" },
+    { "max_discharge",          "max_discharge" },
+    { "last_discharge",         "last_discharge" },
+    { "avg_discharge",          "average_discharge" },
+    { "num_cycles",             "num_cycles" },
+    { "num_full_discharge",     "num_full_discharge" },
+    { "cumulative_ah",          "cumulative_ah" },
+    { "min_voltage",            "min_voltage" },
+    { "max_voltage",            "max_voltage" },
+    { "time_since_full_charge", "time_since_full_charge" },
+    { "num_auto_sync",          "num_auto_sync" },
+    { "num_low_volt_alarm",     "num_low_volt_alarm" },
+    { "num_high_volt_alarm",    "num_high_volt_alarm" },
+    { "energy_discharged",      "energy_discharged" },
+    { "energy_charged",         "energy_charged" },
+};
+
+#define TEXT_EQUIVALENT_COUNT ( sizeof(text_equivalent_list) / sizeof(struct TextEquivalent) )
+
+#define EVENT_WAIT_MS 1000 // Upper bound on how long shutdown waits for the event loop
+#define EVENT_BATCH_MAX 16
+
+struct VEDevice;
+
+enum EventSourceType {
+    EVENT_UART,
+    EVENT_TIMER,
+    EVENT_STATS, // Not tied to a device
+    EVENT_SET, // Not tied to a device
+};
+
+// What an epoll event refers to
+struct EventSource {
+    enum EventSourceType type;
+    struct VEDevice *device;
+};
+
+// Everything belonging to one VE.Direct port.  Only the event loop thread touches it once running
+struct VEDevice {
+    const char *path;
+    const char *topic_root;
+    struct Transport transport;
+    unsigned int link_losses; // Since data last came in, so a link that keeps failing is only logged once
+    int timer_fd; // Fires when the next request is due or the one in flight times out
+    struct EventSource uart_source;
+    struct EventSource timer_source;
+
+    // Receive side
+    struct RxRingBuffer rx_ring;
+    struct RxStatistics rx_stats;
+    char message_buffer[HEX_MESSAGE_MAX + 1];
+    unsigned int message_length;
+    struct TextBlock text_block;
+    enum ReceiveState receive_state;
+    enum ReceiveState resume_state; // Where to go once a HEX frame ends
+    struct TextBlockStatistics text_block_stats;
+    struct HexFrameStatistics hex_frame_stats;
+    struct HexFrameStatistics *hex_register_stats; // Parallel to vedirect_hex_lookup
+    struct RegisterTiming *register_timing; // Parallel to vedirect_hex_lookup
+    double rx_time_s; // When the bytes being parsed were read
+
+    // Latest value of every register, whether published or not.  Written here, read from any thread
+    struct RegisterStore hex_store; // Parallel to vedirect_hex_lookup
+    struct RegisterStore text_store; // Parallel to vedirect_text_lookup
+
+    // Transmit side
+    struct SetQueue set_queue;
+    struct RequestQueue request_queue;
+    struct InFlightRequest in_flight;
+
+    // Min-heap of indexes into requests, ordered by next_due_s
+    struct VEPeriodicRequest requests[PERIODIC_REQUEST_COUNT];
+    unsigned int schedule_heap[PERIODIC_REQUEST_COUNT];
+    unsigned int schedule_count;
+
+    struct RegisterOutput *hex_outputs; // Parallel to vedirect_hex_lookup
+    struct RegisterOutput *text_outputs; // Parallel to vedirect_text_lookup
+    struct SnapshotOutput hex_snapshot;
+    struct SnapshotOutput text_snapshot;
+
+    struct Aggregate *aggregates; // Every window of every aggregated register, see InitAggregates()
+    unsigned int aggregate_count;
+    double aggregate_due_s; // Earliest close of a window holding samples, zero if none do
+
+    // From read() returning to the value being handed to the MQTT client, in microseconds
+    struct Histogram publish_latency;
+
+    // From a SET arriving over MQTT to the device answering it, in microseconds
+    struct Histogram set_latency;
+
+    char stats_topic[TOPIC_MAX];
+    char set_topic[TOPIC_MAX]; // <topic_root>/set/+
+    unsigned long stats_last_frames;
+    unsigned long stats_last_bytes_read;
+    unsigned long stats_last_bytes_written;
+    double stats_last_s;
+};
+
+struct VEDevice *devices;
+unsigned int device_count = 0;
+
+// Raw UART bytes can be captured to a file and replayed later in place of the devices, see CaptureBatch()
+FILE *capture_file = NULL;
+double capture_start_s;
+FILE *replay_file = NULL;
+bool replay_fast = false; // Replay as fast as possible instead of at the captured pace
+unsigned int replay_repeat = 1;
+
+#define CAPTURE_LINE_MAX ( (2 * RX_RING_SIZE) + 64 )
+
+#define JOURNAL_INFLIGHT_MAX 16 // Must be a power of two
+
+struct JournalInFlight {
+    int mid;
+    uint64_t end; // Journal offset just past the message
+    bool acked;
+};
+
+// Journal messages sent and waiting for PUBACK, oldest first.  The event loop thread sends and releases,
+// the MQTT thread marks them acknowledged, so the window is locked
+struct JournalDrain {
+    pthread_mutex_t lock;
+    struct JournalInFlight entries[JOURNAL_INFLIGHT_MAX];
+    unsigned int head; // Free running write index
+    unsigned int tail; // Free running read index
+    uint64_t cursor; // Next journal offset to send
+    unsigned int connection; // mqtt_connection the window was sent on
+
+    unsigned long journaled;
+    unsigned long rejected; // Too large to ever fit
+    unsigned long sent;
+    unsigned long delivered;
+};
+
+struct Journal journal = { .fd = -1 };
+struct JournalDrain journal_drain = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Defined only by the replay benchmark build, which counts calls into the allocator
+extern unsigned long allocation_count __attribute__((weak));
+
 double timestamp(void) {
     struct timespec spec;
 
@@ -68,24 +551,78 @@ double timestamp(void) {
     return spec.tv_sec + ( spec.tv_nsec / 1.0e9 );
 }
 
-unsigned int asciiHexToInt(char ch) {
-  unsigned int num = 0;
-  if( (ch >= '0') && (ch <= '9') ) {
-    num = ch - '0';
-  }
-  else {
-    switch(ch) {
-      case 'A': case 'a': num = 10; break;
-      case 'B': case 'b': num = 11; break;
-      case 'C': case 'c': num = 12; break;
-      case 'D': case 'd': num = 13; break;
-      case 'E': case 'e': num = 14; break;
-      case 'F': case 'f': num = 15; break;
-      default: num = 0;
+// Use for measuring intervals, unaffected by wall clock jumps
+double monotonic_timestamp(void) {
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + ( spec.tv_nsec / 1.0e9 );
+}
+
+// Number of decimal places a multiplier shifts by, or -1 if it isn't a power of ten
+int MultiplierDecimals(float multiplier) {
+    double scale = 1.0;
+
+    for (int decimals = 0; decimals <= 6; decimals++) {
+        if( fabs( (multiplier * scale) - 1.0 ) < 1.0e-4 ) {
+            return decimals;
+        }
+        scale *= 10.0;
+    }
+
+    return -1;
+}
+
+// A raw register value in its units.  The multipliers are floats, so where they are a power of ten dividing by it
+// instead gives the nearest double to the decimal value, 13.02 rather than 13.0199995
+double ScaledValue(int64_t raw, float multiplier, int decimals) {
+    static const double pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+
+    return (decimals >= 0) ? (raw / pow10[decimals]) : (raw * multiplier);
+}
+
+// Writes value * 10^-value_decimals with exactly out_decimals places, rounding half away from zero,
+// like printf("%0.*f") would but without going through floating point.  Returns the length written.
+unsigned int FormatFixed(char *out, int64_t value, int value_decimals, int out_decimals) {
+    static const uint64_t pow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+    char digits[24];
+    unsigned int count = 0;
+    unsigned int length = 0;
+    uint64_t magnitude = (value < 0) ? -(uint64_t)value : (uint64_t)value;
+
+    if(out_decimals >= value_decimals) {
+        magnitude *= pow10[out_decimals - value_decimals];
+    }
+    else {
+        magnitude = ( magnitude + (pow10[value_decimals - out_decimals] / 2) ) / pow10[value_decimals - out_decimals];
+    }
+
+    // Least significant first, at least one digit before the point
+    do {
+        digits[count++] = '0' + (magnitude % 10);
+        magnitude /= 10;
+    } while( (magnitude > 0) || (count <= out_decimals) );
+
+    if( (value < 0) && ((count > 1) || (digits[0] != '0') || (out_decimals > 0)) ) {
+        out[length++] = '-';
+    }
+
+    while(count > 0) {
+        if(count == out_decimals) {
+            out[length++] = '.';
+        }
+        out[length++] = digits[--count];
     }
-  }
 
-  return num;
+    out[length] = '\0';
+    return length;
+}
+
+// Non-hex characters are treated as 0
+unsigned int asciiHexToInt(char ch) {
+  uint8_t num = ve_hex_nibble[(uint8_t)ch];
+
+  return (num == VE_HEX_INVALID) ? 0 : num;
 }
 
 // Expects message with leading ':' and trailing '\n' stripped
@@ -106,381 +643,2706 @@ uint8_t CalculateChecksum(char *msg) {
                 sum += asciiHexToInt(*(msg + 1));
                 msg += 2;
             }
+            else {
+                break; // Odd trailing digit, not part of a byte
+            }
+        }
+    }
+
+    return (0x55 - sum);
+}
+
+// Expects message with leading ':' and trailing '\n' stripped, checksum byte still attached
+// All bytes including the checksum add up to 0x55 for a valid frame
+bool VerifyChecksum(const char *msg, unsigned int msg_len) {
+    uint8_t sum;
+    uint32_t byte;
+
+    // Command nibble followed by whole bytes, the last of which is the checksum
+    if( (msg_len < 3) || !(msg_len & 1) ) {
+        return false;
+    }
+
+    sum = ve_hex_nibble[(uint8_t)msg[0]];
+    if(sum == VE_HEX_INVALID) {
+        return false;
+    }
+
+    for (unsigned int i = 1; i < msg_len; i += 2) {
+        if( !ve_hex_decode_le(msg + i, 1, &byte) ) {
+            return false;
+        }
+
+        sum += byte;
+    }
+
+    return (sum == 0x55);
+}
+
+const char *DescribeResponseFlags(uint32_t flags) {
+    if(flags & VE_RSP_FLG_UNKNOWN) {
+        return "unknown register";
+    }
+    else if(flags & VE_RSP_FLG_UNSUPPORTED) {
+        return "unsupported";
+    }
+    else if(flags & VE_RSP_FLG_PARAMETER_ERROR) {
+        return "parameter error";
+    }
+
+    return "unrecognised flags";
+}
+
+void BuildRequest(char *msg, uint16_t address) {
+    char temp[50];
+    sprintf(temp, "%c%0.2X%0.2X%0.2X", VE_CMD_GET, (uint8_t)(address & 0xFF), (uint8_t)(address >> 8), 0);
+    sprintf(msg, ":%s%0.2X\n", temp, CalculateChecksum(temp));
+}
+
+// Checks a value for a register, given in the units it is published in, and builds the SET frame writing it.
+// Returns NULL if it can be sent, otherwise the reason it can't
+const char *BuildSetRequest(char *msg, const struct VEDirectHexMsg *vedirect_msg, const char *text) {
+    const struct VEHexTypeInfo *info = &ve_hex_type_info[vedirect_msg->type];
+    unsigned int bits = 8 * info->size;
+    char temp[50];
+    unsigned int length;
+    char *end;
+    double scaled;
+    int64_t raw;
+
+    if( !(vedirect_msg->rw_flags & VE_WRITE) ) {
+        return "read only";
+    }
+
+    if(info->is_string) {
+        return "unsupported type";
+    }
+
+    length = sprintf(temp, "%c%02X%02X%02X", VE_CMD_SET, (uint8_t)(vedirect_msg->address & 0xFF), (uint8_t)(vedirect_msg->address >> 8), 0);
+
+    // Command registers such as zero_current take no data, whatever was sent
+    if(info->size > 0) {
+        scaled = round( strtod(text, &end) / vedirect_msg->multiplier );
+
+        while( isspace((unsigned char)*end) ) {
+            end++;
+        }
+
+        if( (end == text) || (*end != '\0') || !isfinite(scaled) ) {
+            return "invalid value";
+        }
+
+        if( info->is_signed ? ( (scaled < -ldexp(1, bits - 1)) || (scaled >= ldexp(1, bits - 1)) ) :
+                              ( (scaled < 0) || (scaled >= ldexp(1, bits)) ) ) {
+            return "out of range";
+        }
+
+        raw = (int64_t)scaled;
+        for (unsigned int i = 0; i < info->size; i++) {
+            length += sprintf(temp + length, "%02X", (uint8_t)(raw >> (8 * i)));
+        }
+    }
+
+    sprintf(msg, ":%s%02X\n", temp, CalculateChecksum(temp));
+    return NULL;
+}
+
+unsigned int RequestQueueDepth(const struct RequestQueue *queue) {
+    return queue->head - queue->tail;
+}
+
+// Appends to the tail of the queue.  When full the new entry is dropped and counted
+bool RequestQueuePush(struct RequestQueue *queue, unsigned int address) {
+    unsigned int depth = queue->head - queue->tail;
+
+    if(depth >= REQUEST_QUEUE_SIZE) {
+        queue->dropped++;
+        return false;
+    }
+
+    queue->entries[queue->head & (REQUEST_QUEUE_SIZE - 1)] = address;
+    queue->head++;
+    depth++;
+
+    if(depth > queue->max_depth) {
+        queue->max_depth = depth;
+    }
+
+    return true;
+}
+
+// Removes the oldest entry.  Returns false if the queue is empty
+bool RequestQueuePop(struct RequestQueue *queue, unsigned int *address) {
+    if(queue->head == queue->tail) {
+        return false;
+    }
+
+    *address = queue->entries[queue->tail & (REQUEST_QUEUE_SIZE - 1)];
+    queue->tail++;
+
+    return true;
+}
+
+// MQTT thread.  Returns false if the queue is full
+bool SetQueuePush(struct SetQueue *queue, const struct SetRequest *set) {
+    bool pushed = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if( (queue->head - queue->tail) < SET_QUEUE_SIZE ) {
+        queue->entries[queue->head & (SET_QUEUE_SIZE - 1)] = *set;
+        queue->head++;
+        pushed = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return pushed;
+}
+
+// MQTT thread.  Returns false if too many are waiting to be answered already
+bool SetQueueReject(struct SetQueue *queue, unsigned int register_index, const char *error) {
+    bool pushed = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if( (queue->rejections_head - queue->rejections_tail) < SET_QUEUE_SIZE ) {
+        queue->rejections[queue->rejections_head & (SET_QUEUE_SIZE - 1)] = (struct SetRejection){ register_index, error };
+        queue->rejections_head++;
+        pushed = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return pushed;
+}
+
+// Event loop thread.  Removes the oldest rejection, returns false if none are waiting
+bool SetQueueRejected(struct SetQueue *queue, struct SetRejection *rejection) {
+    bool popped = false;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->rejections_head != queue->rejections_tail) {
+        *rejection = queue->rejections[queue->rejections_tail & (SET_QUEUE_SIZE - 1)];
+        queue->rejections_tail++;
+        popped = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return popped;
+}
+
+// Event loop thread.  Removes the oldest entry, returns false if the queue is empty
+bool SetQueuePop(struct SetQueue *queue, struct SetRequest *set) {
+    bool popped = false;
+
+    // Unlocked peek, a SET queued meanwhile signals set_event_fd and is picked up then
+    if( __atomic_load_n(&queue->head, __ATOMIC_RELAXED) == queue->tail ) {
+        return false;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->head != queue->tail) {
+        *set = queue->entries[queue->tail & (SET_QUEUE_SIZE - 1)];
+        queue->tail++;
+        popped = true;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+
+    return popped;
+}
+
+double ClampSeconds(double value_s, unsigned int min_us, unsigned int max_us) {
+    return fmin( fmax(value_s, min_us / 1.0e6), max_us / 1.0e6 );
+}
+
+// Writes the request in flight and starts its response timeout
+void SendRequest(struct VEDevice *device, double now) {
+    struct InFlightRequest *request = &device->in_flight;
+    const struct VEDirectHexMsg *vedirect_msg;
+
+    TransportWrite(&device->transport, request->message, strlen(request->message));
+    //printf("<<< <UART> %s\r\n", request->message);
+
+    request->sent_s = now;
+    request->deadline_s = now + request->timeout_s;
+
+    if( (request->command == VE_CMD_GET) && ((vedirect_msg = ve_lookup_by_hex_address(request->address)) != NULL) ) {
+        device->register_timing[vedirect_msg - vedirect_hex_lookup].sent_s = now;
+    }
+
+    request->state = TX_WAITING;
+    request->sent++;
+}
+
+// Give the device a breather in proportion to how quickly it has been answering
+void StartRequestGap(struct VEDevice *device, double now) {
+    struct InFlightRequest *request = &device->in_flight;
+    double gap_s = request->have_rtt ? (request->srtt_s / 2) : (max_request_gap_us / 1.0e6);
+
+    request->deadline_s = now + ClampSeconds(gap_s, min_request_gap_us, max_request_gap_us);
+    request->state = TX_GAP;
+}
+
+// Only queues the message, so that the thread reading the devices never waits on the MQTT client.  The topic
+// must be one of those worked out at startup, it is not copied.  Publish latency is measured from read_s,
+// unless it is zero
+void PublishMessage(struct VEDevice *device, const char *topic, const void *payload, unsigned int length, double read_s) {
+    struct PublishQueue *queue = (length > publish_queue.payload_max) ? &large_queue : &publish_queue;
+
+    if( !PublishQueuePush(queue, topic, payload, length, device, read_s) ) {
+        LOG(LOG_WARNING, "%s: %s is too large to queue (%u bytes)", device->path, topic, length);
+    }
+}
+
+// Answers a SET on <topic_root>/set/<name>/result, with the value the device now holds or why it failed
+void PublishSetResult(struct VEDevice *device, const struct VEDirectHexMsg *vedirect_msg, const char *value, const char *error) {
+    char payload[PAYLOAD_MAX + 32];
+    unsigned int length;
+
+    if(error != NULL) {
+        length = snprintf(payload, sizeof(payload), "{\"status\":\"error\",\"error\":\"%s\"}", error);
+    }
+    else if(value != NULL) {
+        length = snprintf(payload, sizeof(payload), "{\"status\":\"ok\",\"value\":%s}", value);
+    }
+    else {
+        length = snprintf(payload, sizeof(payload), "{\"status\":\"ok\"}");
+    }
+
+    PublishMessage(device, device->hex_outputs[vedirect_msg - vedirect_hex_lookup].set_result_topic, payload, length, 0);
+}
+
+// Answers the SETs the MQTT thread refused
+void AnswerRejectedSets(struct VEDevice *device) {
+    struct SetRejection rejection;
+
+    while( SetQueueRejected(&device->set_queue, &rejection) ) {
+        PublishSetResult(device, &vedirect_hex_lookup[rejection.register_index], NULL, rejection.error);
+    }
+}
+
+// The SET in flight has been answered or given up on
+void SetCompleted(struct VEDevice *device, const struct VEDirectHexMsg *vedirect_msg, const char *value, const char *error) {
+    struct InFlightRequest *request = &device->in_flight;
+
+    if(error != NULL) {
+        device->set_queue.failed++;
+        LOG(LOG_WARNING, "%s: SET %s [0x%04X] failed: %s", device->path, vedirect_msg->name, vedirect_msg->address, error);
+    }
+    else {
+        device->set_queue.completed++;
+        HistogramRecord(&device->set_latency, (uint64_t)( (monotonic_timestamp() - request->set_received_s) * 1.0e6 ));
+    }
+
+    PublishSetResult(device, vedirect_msg, value, error);
+}
+
+// Called for every GET and SET response, whatever its flags.  Returns true if it answers the request in flight
+bool ResponseReceived(struct VEDevice *device, char command, uint16_t address) {
+    struct InFlightRequest *request = &device->in_flight;
+    double now;
+
+    if( (request->state != TX_WAITING) || (request->command != command) || (request->address != address) ) {
+        return false;
+    }
+
+    now = monotonic_timestamp();
+    request->rtt_s = now - request->sent_s;
+    request->answered_count++;
+
+    if(request->have_rtt) {
+        request->rttvar_s += ( fabs(request->rtt_s - request->srtt_s) - request->rttvar_s ) / 4;
+        request->srtt_s += (request->rtt_s - request->srtt_s) / 8;
+    }
+    else {
+        request->srtt_s = request->rtt_s;
+        request->rttvar_s = request->rtt_s / 2;
+        request->have_rtt = true;
+    }
+
+    StartRequestGap(device, now);
+
+    return true;
+}
+
+// Retries or gives up on an overdue request, ends a gap that has run its course and sends the next
+// queued request once the line is free.  Any SET waiting goes before the GETs
+void ServiceTransmit(struct VEDevice *device, double now) {
+    struct InFlightRequest *request = &device->in_flight;
+    struct SetRequest set;
+    unsigned int address;
+
+    if( (request->state == TX_WAITING) && (now >= request->deadline_s) ) {
+        if(request->attempt >= max_request_retries) {
+            request->timeouts++;
+            LOG(LOG_WARNING, "%s: No response to %s [0x%04X] after %u attempts", device->path,
+                (request->command == VE_CMD_SET) ? "SET" : "GET", request->address, request->attempt + 1);
+
+            if(request->command == VE_CMD_SET) {
+                SetCompleted(device, ve_lookup_by_hex_address(request->address), NULL, "no response");
+            }
+
+            StartRequestGap(device, now);
+        }
+        else {
+            request->retries++;
+            request->attempt++;
+            request->timeout_s = fmin(2 * request->timeout_s, max_response_timeout_us / 1.0e6);
+            SendRequest(device, now);
         }
     }
 
-    return (0x55 - sum);
+    if( (request->state == TX_GAP) && (now >= request->deadline_s) ) {
+        request->state = TX_IDLE;
+    }
+
+    if(request->state != TX_IDLE) {
+        return;
+    }
+
+    if( SetQueuePop(&device->set_queue, &set) ) {
+        request->command = VE_CMD_SET;
+        request->address = set.address;
+        request->set_received_s = set.received_s;
+        strcpy(request->message, set.message);
+    }
+    else if( RequestQueuePop(&device->request_queue, &address) ) {
+        request->command = VE_CMD_GET;
+        request->address = address;
+        BuildRequest(request->message, address);
+    }
+    else {
+        return;
+    }
+
+    request->attempt = 0;
+
+    // Until there is a measurement, be as cautious as the bounds allow
+    request->timeout_s = request->have_rtt ? (request->srtt_s + (4 * request->rttvar_s)) : (max_response_timeout_us / 1.0e6);
+    request->timeout_s = ClampSeconds(request->timeout_s, min_response_timeout_us, max_response_timeout_us);
+
+    SendRequest(device, now);
+}
+
+// Publisher thread.  Straight to the broker while it is connected.  With a journal, anything that can't go now
+// is kept for later
+void SendMessage(const struct PublishSlot *message) {
+    struct VEDevice *device = message->context;
+    bool connected = __atomic_load_n(&mqtt_connected, __ATOMIC_ACQUIRE);
+
+    if( !connected || (mosquitto_publish(mqtt, NULL, message->topic, message->length, message->payload, 0, false) != MOSQ_ERR_SUCCESS) ) {
+        if(journal.fd >= 0) {
+            if( JournalAppend(&journal, message->topic, message->payload, message->length) ) {
+                journal_drain.journaled++;
+            }
+            else {
+                journal_drain.rejected++;
+            }
+        }
+    }
+
+    if(message->time_s > 0) {
+        HistogramRecord(&device->publish_latency, (uint64_t)( (monotonic_timestamp() - message->time_s) * 1.0e6 ));
+    }
+}
+
+// Publisher thread.  Sends everything waiting in the queue
+void DrainPublishQueue(void) {
+    static uint8_t buffer[sizeof(struct PublishSlot) + SNAPSHOT_MAX] __attribute__((aligned(8)));
+    static uint8_t large_buffer[sizeof(struct PublishSlot) + STATS_PAYLOAD_MAX] __attribute__((aligned(8)));
+    struct PublishSlot *message = (struct PublishSlot *)buffer;
+
+    while( PublishQueuePop(&publish_queue, message) ) {
+        SendMessage(message);
+    }
+
+    message = (struct PublishSlot *)large_buffer;
+
+    while( PublishQueuePop(&large_queue, message) ) {
+        SendMessage(message);
+    }
+}
+
+// MQTT thread.  Marks a journal message acknowledged, it is released from the journal on the next drain
+void PublishCallback(struct mosquitto *mosq, void *obj, int mid) {
+    pthread_mutex_lock(&journal_drain.lock);
+
+    for (unsigned int i = journal_drain.tail; i != journal_drain.head; i++) {
+        struct JournalInFlight *entry = &journal_drain.entries[i & (JOURNAL_INFLIGHT_MAX - 1)];
+
+        if( (entry->mid == mid) && !entry->acked ) {
+            entry->acked = true;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&journal_drain.lock);
+}
+
+void ConnectCallback(struct mosquitto *mosq, void *obj, int rc) {
+    if(rc == 0) {
+        __atomic_add_fetch(&mqtt_connection, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&mqtt_connected, 1, __ATOMIC_RELEASE);
+        LOG(LOG_INFO, "Connected to MQTT broker %s:%u", mqtt_host, mqtt_port);
+
+        // A clean session forgets subscriptions, so they are made again on every connection.  Not while replaying
+        if(set_event_fd >= 0) {
+            for (unsigned int i = 0; i < device_count; i++) {
+                mosquitto_subscribe(mosq, NULL, devices[i].set_topic, 1);
+            }
+        }
+    }
+    else {
+        LOG(LOG_WARNING, "MQTT broker refused connection: %s", mosquitto_connack_string(rc));
+    }
+}
+
+void DisconnectCallback(struct mosquitto *mosq, void *obj, int rc) {
+    __atomic_store_n(&mqtt_connected, 0, __ATOMIC_RELEASE);
+
+    if(rc != 0) {
+        LOG(LOG_WARNING, "Lost connection to MQTT broker: %s", mosquitto_strerror(rc));
+    }
+}
+
+// True for registers in destructive_set_list, which only -w allows to be written
+bool IsDestructiveSet(const struct VEDirectHexMsg *vedirect_msg) {
+    for (int i = 0; i < DESTRUCTIVE_SET_COUNT; i++) {
+        if( !strcmp(destructive_set_list[i], vedirect_msg->name) ) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// MQTT thread.  Checks a write to <topic_root>/set/<name> and queues it for the device, or has the event loop
+// answer it on the result topic if it can't be done
+void MessageCallback(struct mosquitto *mosq, void *obj, const struct mosquitto_message *message) {
+    struct VEDevice *device = NULL;
+    const struct VEDirectHexMsg *vedirect_msg;
+    const char *name = NULL;
+    const char *error = NULL;
+    char text[PAYLOAD_MAX];
+    struct SetRequest set;
+    uint64_t one = 1;
+    unsigned int length;
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        length = strlen(devices[i].topic_root);
+
+        if( !strncmp(message->topic, devices[i].topic_root, length) && !strncmp(message->topic + length, "/set/", 5) ) {
+            device = &devices[i];
+            name = message->topic + length + 5;
+            break;
+        }
+    }
+
+    if(device == NULL) {
+        return;
+    }
+
+    if( (vedirect_msg = ve_lookup_by_hex_name(name)) == NULL ) {
+        error = "unknown register";
+    }
+    else if(message->retain) {
+        // Delivered again on every subscription, so it would be applied on every reconnect
+        error = "retained";
+    }
+    else if( !destructive_sets && IsDestructiveSet(vedirect_msg) ) {
+        error = "not allowed";
+    }
+    else if( (message->payloadlen < 0) || ((unsigned int)message->payloadlen >= sizeof(text)) ) {
+        error = "invalid value";
+    }
+    else {
+        memcpy(text, message->payload, message->payloadlen);
+        text[message->payloadlen] = '\0';
+
+        set.address = vedirect_msg->address;
+        set.received_s = monotonic_timestamp();
+
+        if( ((error = BuildSetRequest(set.message, vedirect_msg, text)) == NULL) && !SetQueuePush(&device->set_queue, &set) ) {
+            error = "busy";
+        }
+    }
+
+    pthread_mutex_lock(&device->set_queue.lock);
+    device->set_queue.received++;
+    if(error != NULL) {
+        device->set_queue.rejected++;
+    }
+    pthread_mutex_unlock(&device->set_queue.lock);
+
+    // A name that isn't a register has no result topic to answer on
+    if(error != NULL) {
+        LOG(LOG_WARNING, "%s: SET %s rejected: %s", device->path, name, error);
+
+        if( (vedirect_msg == NULL) || !SetQueueReject(&device->set_queue, vedirect_msg - vedirect_hex_lookup, error) ) {
+            return;
+        }
+    }
+    else {
+        LOG(LOG_DEBUG, "%s: SET %s to %s queued", device->path, name, text);
+    }
+
+    if( write(set_event_fd, &one, sizeof(one)) < 0 ) {
+        LOG(LOG_ERROR, "Unable to wake event loop for SET: %s", strerror(errno));
+    }
+}
+
+// Releases what the broker has acknowledged, then sends the next few journal messages with QoS 1
+void DrainJournal(void) {
+    struct JournalDrain *drain = &journal_drain;
+    struct JournalInFlight *entry;
+    struct JournalEntry message;
+    unsigned int budget = (journal_drain_per_s * journal_drain_period_ms) / 1000;
+    unsigned int connection = __atomic_load_n(&mqtt_connection, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&drain->lock);
+
+    // In order, so the journal is never released past a message still waiting
+    while( (drain->tail != drain->head) && drain->entries[drain->tail & (JOURNAL_INFLIGHT_MAX - 1)].acked ) {
+        JournalRelease(&journal, drain->entries[drain->tail & (JOURNAL_INFLIGHT_MAX - 1)].end);
+        drain->tail++;
+        drain->delivered++;
+    }
+
+    // Acknowledgements won't come on a new connection, so start again from the oldest not yet released
+    if(drain->connection != connection) {
+        drain->connection = connection;
+        drain->head = drain->tail;
+        drain->cursor = 0;
+    }
+
+    while( __atomic_load_n(&mqtt_connected, __ATOMIC_ACQUIRE) && (budget > 0) &&
+           ((drain->head - drain->tail) < JOURNAL_INFLIGHT_MAX) && JournalRead(&journal, &drain->cursor, &message) ) {
+        entry = &drain->entries[drain->head & (JOURNAL_INFLIGHT_MAX - 1)];
+        entry->acked = false;
+        entry->end = message.end;
+
+        // Lock held, so the callback can't look for the mid before it is stored
+        if( mosquitto_publish(mqtt, &entry->mid, message.topic, message.length, message.payload, 1, false) != MOSQ_ERR_SUCCESS ) {
+            break;
+        }
+
+        drain->cursor = message.end;
+        drain->head++;
+        drain->sent++;
+        budget--;
+    }
+
+    pthread_mutex_unlock(&drain->lock);
+}
+
+void PublishSnapshot(struct VEDevice *device, struct SnapshotOutput *output) {
+    if( !SnapshotFinish(&output->snapshot) ) {
+        output->overflow_count++;
+        LOG(LOG_WARNING, "%s: Snapshot for %s too large to publish", device->path, output->topic);
+        return;
+    }
+
+    output->publish_count++;
+
+    LOG(LOG_DEBUG, "<<< <MQTT> Publish %s (%u bytes)", output->topic, output->snapshot.length);
+    PublishMessage(device, output->topic, output->snapshot.buffer, output->snapshot.length, device->rx_time_s);
+}
+
+// Adds a value to the register's snapshot, starting one if need be.  A requested register coming round again
+// before a snapshot has all its fields means some didn't answer this pass, so what there is goes out first.
+// Values the device sends unasked or echoes from a SET ride along, but don't count toward the fields
+void AddSnapshotValue(struct VEDevice *device, struct RegisterOutput *output, const char *payload, unsigned int payload_length) {
+    struct SnapshotOutput *snapshot_output = output->snapshot;
+    struct Snapshot *snapshot = &snapshot_output->snapshot;
+
+    if( snapshot->open && (output->snapshot_sequence == snapshot->sequence) ) {
+        if( (snapshot_output->fields == 0) || !output->requested ) {
+            return; // Repeated within a TEXT block or a pass, keep the first
+        }
+
+        PublishSnapshot(device, snapshot_output);
+    }
+
+    if(!snapshot->open) {
+        SnapshotBegin(snapshot, snapshot_format, timestamp());
+        snapshot_output->requested = 0;
+    }
+
+    output->snapshot_sequence = snapshot->sequence;
+    snapshot_output->requested += output->requested;
+
+    if(payload_length == 0) {
+        SnapshotAddNull(snapshot, output->name);
+    }
+    else if(output->string) {
+        SnapshotAddString(snapshot, output->name, payload);
+    }
+    else {
+        SnapshotAddNumber(snapshot, output->name, payload);
+    }
+
+    if( (snapshot_output->fields > 0) && (snapshot_output->requested >= snapshot_output->fields) ) {
+        PublishSnapshot(device, snapshot_output);
+    }
+}
+
+void PublishAggregate(struct VEDevice *device, struct Aggregate *aggregate) {
+    char payload[PUBLISH_PAYLOAD_MAX];
+    unsigned int length;
+
+    length = snprintf(payload, sizeof(payload), "{\"min\":%0.*f,\"max\":%0.*f,\"mean\":%0.*f,\"last\":%0.*f,\"count\":%lu}",
+                      aggregate->decimals, aggregate->min, aggregate->decimals, aggregate->max,
+                      aggregate->decimals + 1, aggregate->sum / aggregate->count, aggregate->decimals, aggregate->last,
+                      aggregate->count);
+
+    LOG(LOG_DEBUG, "<<< <MQTT> Publish %s = %s", aggregate->topic, payload);
+    PublishMessage(device, aggregate->topic, payload, length, 0);
+
+    aggregate->count = 0;
+}
+
+// Closes the window if its time is up, publishing it if anything was seen
+void RollAggregate(struct VEDevice *device, struct Aggregate *aggregate, double now) {
+    if(now < aggregate->end_s) {
+        return;
+    }
+
+    if(aggregate->count > 0) {
+        PublishAggregate(device, aggregate);
+    }
+
+    aggregate->end_s = ( floor(now / aggregate->window_s) + 1 ) * aggregate->window_s;
+}
+
+void AggregateValue(struct VEDevice *device, struct RegisterOutput *output, double value) {
+    double now = monotonic_timestamp();
+    struct Aggregate *aggregate;
+
+    for (unsigned int i = 0; i < output->aggregate_count; i++) {
+        aggregate = &output->aggregates[i];
+
+        RollAggregate(device, aggregate, now);
+
+        if(aggregate->count == 0) {
+            aggregate->min = aggregate->max = aggregate->sum = value;
+        }
+        else {
+            aggregate->min = fmin(aggregate->min, value);
+            aggregate->max = fmax(aggregate->max, value);
+            aggregate->sum += value;
+        }
+        aggregate->last = value;
+        aggregate->count++;
+
+        if( (device->aggregate_due_s == 0) || (aggregate->end_s < device->aggregate_due_s) ) {
+            device->aggregate_due_s = aggregate->end_s;
+        }
+    }
+}
+
+// Publishes every window that has closed with samples in it, and works out when the next one will
+void ServiceAggregates(struct VEDevice *device, double now) {
+    if( (device->aggregate_due_s == 0) || (now < device->aggregate_due_s) ) {
+        return;
+    }
+
+    device->aggregate_due_s = 0;
+
+    for (unsigned int i = 0; i < device->aggregate_count; i++) {
+        struct Aggregate *aggregate = &device->aggregates[i];
+
+        if(aggregate->count > 0) {
+            RollAggregate(device, aggregate, now);
+        }
+
+        if( (aggregate->count > 0) && ((device->aggregate_due_s == 0) || (aggregate->end_s < device->aggregate_due_s)) ) {
+            device->aggregate_due_s = aggregate->end_s;
+        }
+    }
+}
+
+// Publish unless the register's filter says the value hasn't changed enough to be worth sending.  read_s is as
+// for PublishMessage()
+void PublishValue(struct VEDevice *device, struct RegisterOutput *output, const char *payload, unsigned int payload_length, bool numeric,
+                  double value, double read_s) {
+    const struct PublishFilter *filter = output->filter;
+    double now = monotonic_timestamp();
+    double threshold;
+    bool changed;
+
+    // Only the summaries of an aggregated register go out.  A sample that isn't a number has nothing to add
+    if(output->aggregates != NULL) {
+        if(numeric) {
+            AggregateValue(device, output, value);
+        }
+        return;
+    }
+
+    if(snapshot_output) {
+        AddSnapshotValue(device, output, payload, payload_length);
+        return;
+    }
+
+    if( output->published && !publish_all && ((now - output->last_publish_s) < filter->max_silence_s) ) {
+        changed = ( strcmp(payload, output->last_payload) != 0 );
+
+        if(changed && numeric) {
+            threshold = fmax(filter->deadband_absolute, filter->deadband_relative * fabs(output->last_value));
+            changed = ( fabs(value - output->last_value) >= threshold * (1.0 - DEADBAND_TOLERANCE) ) || (threshold == 0);
+        }
+
+        if(!changed) {
+            output->suppress_count++;
+            return;
+        }
+    }
+
+    memcpy(output->last_payload, payload, payload_length + 1);
+    output->last_value = value;
+    output->last_publish_s = now;
+    output->published = true;
+    output->publish_count++;
+
+    LOG(LOG_DEBUG, "<<< <MQTT> Publish %s = %s", output->topic, payload);
+    PublishMessage(device, output->topic, payload, payload_length, read_s);
+}
+
+void ParseTextMessage(struct VEDevice *device, const char *reg_name, const char *value_string) {
+    const struct VEDirectTextMsg *vedirect_msg;
+    struct RegisterOutput *output;
+    long reg_value;
+    char mqtt_payload[PAYLOAD_MAX];
+    unsigned int payload_length = 0;
+
+    //printf("ParseTextMessage(%s, %s)\r\n", reg_name, value_string); fflush(NULL);
+
+    reg_value = strtol(value_string, NULL, 10);
+
+    //DEBUG//printf("%s = %d\r\n", reg_name, reg_value); fflush(NULL);
+
+    if( (vedirect_msg = ve_lookup_by_text_name(reg_name)) != NULL ) {
+        output = &device->text_outputs[vedirect_msg - vedirect_text_lookup];
+
+        switch(vedirect_msg->type) {
+
+            case VE_TYPE_TXT_FLOAT:
+                //DEBUG//printf("--> Found %s = %0.3f\r\n", vedirect_msg->name, reg_value * vedirect_msg->multiplier); fflush(NULL);
+
+                if( !strcmp(value_string, "---") ) {
+                    // TODO: This might not be the best way to indicate invalid data
+                }
+                else if(output->decimals >= 0) {
+                    payload_length = FormatFixed(mqtt_payload, reg_value, output->decimals, 3);
+                }
+                else {
+                    payload_length = sprintf(mqtt_payload, "%0.3f", reg_value * vedirect_msg->multiplier);
+                }
+                break;
+
+            case VE_TYPE_TXT_INT:
+                //DEBUG//printf("--> Found %s = %0.3f\r\n", vedirect_msg->name, reg_value * vedirect_msg->multiplier); fflush(NULL);
+
+                if( !strcmp(value_string, "---") ) {
+                    // TODO: This might not be the best way to indicate invalid data
+                }
+                else {
+                    payload_length = FormatFixed(mqtt_payload, reg_value, 0, 0);
+                }
+                break;
+
+            case VE_TYPE_TXT_BOOL:
+                //DEBUG//printf("--> Found %s = %s\r\n", vedirect_msg->name, value_string); fflush(NULL);
+
+                if( !strcmp(value_string, "ON") ) {
+                    mqtt_payload[payload_length++] = '1';
+                }
+                else if( !strcmp(value_string, "OFF") ) {
+                    mqtt_payload[payload_length++] = '0';
+                }
+                else {
+                    // TODO: This might not be the best way to indicate invalid data
+                }
+
+                break;
+        }
+
+        mqtt_payload[payload_length] = '\0';
+
+        if(payload_length == 0) {
+            RegisterStoreWrite(&device->text_store, vedirect_msg - vedirect_text_lookup, NAN, NULL, REGISTER_INVALID, device->rx_time_s);
+        }
+        else {
+            RegisterStoreWrite(&device->text_store, vedirect_msg - vedirect_text_lookup,
+                               (vedirect_msg->type == VE_TYPE_TXT_BOOL) ? (mqtt_payload[0] == '1') :
+                                   ScaledValue(reg_value, vedirect_msg->multiplier, output->decimals),
+                               NULL, REGISTER_GOOD, device->rx_time_s);
+        }
+
+        PublishValue(device, output, mqtt_payload, payload_length, (payload_length > 0) && (vedirect_msg->type != VE_TYPE_TXT_BOOL),
+                     ScaledValue(reg_value, vedirect_msg->multiplier, output->decimals), device->rx_time_s);
+    }
+    else {
+        //DEBUG//printf("--> NOT FOUND %s\r\n", reg_name); fflush(NULL);
+    }
+
+}
+
+void ParseHexMessage(struct VEDevice *device, char *msg_buf) {
+    double now;
+    const struct VEDirectHexMsg *vedirect_msg;
+    unsigned int msg_len;
+    char c;
+    uint32_t address = 0;
+    uint32_t flags = 0;
+    struct VEHexValue value;
+    struct RegisterOutput *output;
+    char mqtt_payload[PAYLOAD_MAX];
+    unsigned int payload_length;
+    bool set_answered = false;
+    bool publish;
+
+    //printf("ParseHexMessage(%s)\r\n", msg_buf);
+
+    now = monotonic_timestamp(); // Time between request being sent and receipt of message
+    msg_len = strlen(msg_buf);
+
+    // Smallest valid message contains one command char plus four hex digts of address
+    if(msg_len >= 5) {
+
+        c = *msg_buf;
+
+        if( !VerifyChecksum(msg_buf, msg_len) ) {
+            device->hex_frame_stats.bad_checksum++;
+
+            // Best effort attribution, the address itself may be what got corrupted
+            if( ((c == VE_RSP_GET) || (c == VE_RSP_SET) || (c == VE_CMD_ASYNC)) && ve_hex_decode_le(msg_buf + 1, 2, &address) &&
+                ((vedirect_msg = ve_lookup_by_hex_address(address)) != NULL) ) {
+                device->hex_register_stats[vedirect_msg - vedirect_hex_lookup].bad_checksum++;
+            }
+
+            //printf("<UART> ERROR: Bad checksum on HEX frame %s\r\n", msg_buf);
+            return;
+        }
+
+        // SET responses and async frames are laid out like a GET response, the latter sent unasked
+        if( (c == VE_RSP_GET) || (c == VE_RSP_SET) || (c == VE_CMD_ASYNC) ) {
+            msg_buf++;
+
+            if( !ve_hex_decode_le(msg_buf, 2, &address) ) {
+                return;
+            }
+
+            // Lets the device move on to the next request
+            if(c != VE_CMD_ASYNC) {
+                set_answered = ResponseReceived(device, c, address) && (c == VE_RSP_SET);
+            }
+
+            if( (vedirect_msg = ve_lookup_by_hex_address(address)) != NULL ) {
+                struct HexFrameStatistics *register_stats = &device->hex_register_stats[vedirect_msg - vedirect_hex_lookup];
+                struct RegisterTiming *timing = &device->register_timing[vedirect_msg - vedirect_hex_lookup];
+
+                if(c == VE_CMD_ASYNC) {
+                    timing->async_s = now;
+                }
+                else if( (c == VE_RSP_GET) && (timing->sent_s > 0) ) {
+                    if(timing->latency != NULL) {
+                        HistogramRecord(timing->latency, (uint64_t)( (now - timing->sent_s) * 1.0e6 ));
+                    }
+                    timing->sent_s = 0;
+                }
+
+                //printf("Parsing data from %s [%0.4x], length = %d\r\n", vedirect_msg->name, address, msg_len);
+
+                msg_buf += 4; // Advance to the start of flags
+
+                if( (msg_len >= 7) && ve_hex_decode_le(msg_buf, 1, &flags) ) {
+
+                    //printf("Flags: %d\r\n", flags);
+
+                    if(flags != 0) {
+                        if(flags & VE_RSP_FLG_UNKNOWN) {
+                            device->hex_frame_stats.flag_unknown++;
+                            register_stats->flag_unknown++;
+                        }
+                        else if(flags & VE_RSP_FLG_UNSUPPORTED) {
+                            device->hex_frame_stats.flag_unsupported++;
+                            register_stats->flag_unsupported++;
+                        }
+                        else if(flags & VE_RSP_FLG_PARAMETER_ERROR) {
+                            device->hex_frame_stats.flag_parameter_error++;
+                            register_stats->flag_parameter_error++;
+                        }
+                        else {
+                            device->hex_frame_stats.flag_other++;
+                            register_stats->flag_other++;
+                        }
+
+                        if(set_answered) {
+                            SetCompleted(device, vedirect_msg, NULL, DescribeResponseFlags(flags));
+                        }
+                        else {
+                            // A failed SET leaves the value as it was, a failed GET means there is none to have
+                            RegisterStoreWrite(&device->hex_store, vedirect_msg - vedirect_hex_lookup, NAN, NULL,
+                                               REGISTER_INVALID, device->rx_time_s);
+
+                            LOG(LOG_WARNING, "%s %s [0x%04X] failed: %s (flags 0x%02X)", (c == VE_RSP_SET) ? "SET" : "GET",
+                                vedirect_msg->name, address, DescribeResponseFlags(flags), flags);
+                        }
+                    }
+                    else {
+                        device->hex_frame_stats.good++;
+                        register_stats->good++;
+
+                        if(c == VE_CMD_ASYNC) {
+                            device->hex_frame_stats.async++;
+                            register_stats->async++;
+                        }
+
+                        msg_buf += 2; // Point to the start of data bytes
+
+                        // Data is everything between the flags and the trailing checksum byte.  Command registers have none
+                        if( (vedirect_msg->type == VE_TYPE_NONE) ||
+                            !ve_decode_hex_value(msg_buf, (msg_len >= 9) ? (msg_len - 9) : 0, vedirect_msg->type, &value) ) {
+                            if(set_answered) {
+                                SetCompleted(device, vedirect_msg, NULL, NULL);
+                            }
+                            return;
+                        }
+
+                        //printf("Parsing data from %s [%0.4X] = %lld\r\n", vedirect_msg->name, address, (long long)value.integer);
+
+                        output = &device->hex_outputs[vedirect_msg - vedirect_hex_lookup];
+
+                        if(ve_hex_type_info[vedirect_msg->type].is_string) {
+                            RegisterStoreWrite(&device->hex_store, vedirect_msg - vedirect_hex_lookup, NAN, value.string,
+                                               REGISTER_GOOD, device->rx_time_s);
+                        }
+                        else {
+                            RegisterStoreWrite(&device->hex_store, vedirect_msg - vedirect_hex_lookup,
+                                               ScaledValue(value.integer, vedirect_msg->multiplier, output->decimals),
+                                               NULL, REGISTER_GOOD, device->rx_time_s);
+                        }
+
+                        // Registers in the periodic request list go out if publish is set there.  Anything else the
+                        // device sends unasked, or echoes back from a SET, goes out too
+                        publish = output->publish || ((c != VE_RSP_GET) && !output->requested);
+
+                        if(publish || set_answered) {
+                            if(ve_hex_type_info[vedirect_msg->type].is_string) {
+                                payload_length = snprintf(mqtt_payload, sizeof(mqtt_payload), "%s", value.string);
+                            }
+                            else if(output->decimals >= 0) {
+                                payload_length = FormatFixed(mqtt_payload, value.integer, output->decimals, 2);
+                            }
+                            else {
+                                payload_length = sprintf(mqtt_payload, "%0.2f", value.integer * vedirect_msg->multiplier);
+                            }
+
+                            if(set_answered) {
+                                SetCompleted(device, vedirect_msg, mqtt_payload, NULL);
+                            }
+
+                            if(publish) {
+                                PublishValue(device, output, mqtt_payload, payload_length, !ve_hex_type_info[vedirect_msg->type].is_string,
+                                             ScaledValue(value.integer, vedirect_msg->multiplier, output->decimals), device->rx_time_s);
+                            }
+                        }
+
+                    }
+                }
+                else if(set_answered) {
+                    // The request is off the line already, so this is the only answer the SET will get
+                    SetCompleted(device, vedirect_msg, NULL, "response too short");
+                }
+            }
+        }
+    }
+}
+
+// Publish every field of a TEXT block that passed its checksum
+void ParseTextBlock(struct VEDevice *device, const struct TextBlock *block) {
+    if(snapshot_output) {
+        SnapshotBegin(&device->text_snapshot.snapshot, snapshot_format, timestamp());
+    }
+
+    for (unsigned int i = 0; i < block->count; i++) {
+        ParseTextMessage(device, block->fields[i].name, block->fields[i].value);
+    }
+
+    if(snapshot_output) {
+        PublishSnapshot(device, &device->text_snapshot);
+    }
+}
+
+void ResetTextBlock(struct TextBlock *block) {
+    block->count = 0;
+    block->length = 0;
+    block->in_value = false;
+    block->overflow = false;
+    block->sum = 0;
+}
+
+// Add one character of a TEXT block.  Returns the state to continue in
+enum ReceiveState AddTextChar(struct TextBlock *block, char c) {
+    struct TextField *field = &block->fields[block->count];
+
+    block->sum += (uint8_t)c;
+
+    switch(c) {
+        case '\r':
+            // End of field
+            if( (block->length > 0) || block->in_value ) {
+                if(block->count < TEXT_BLOCK_MAX_FIELDS) {
+                    block->count++;
+                }
+                else {
+                    block->overflow = true;
+                }
+            }
+            block->length = 0;
+            block->in_value = false;
+        break;
+
+        case '\n':
+            // Start of the next field
+            block->length = 0;
+            block->in_value = false;
+        break;
+
+        case '\t':
+            if(block->count >= TEXT_BLOCK_MAX_FIELDS) {
+                block->overflow = true;
+            }
+            else if( !block->in_value ) {
+                field->name[block->length] = '\0';
+                field->value[0] = '\0';
+
+                // The byte following "Checksum<TAB>" is the checksum itself, whatever its value
+                if( !strcmp(field->name, "Checksum") ) {
+                    return GET_TEXT_CHECKSUM;
+                }
+
+                block->in_value = true;
+                block->length = 0;
+            }
+        break;
+
+        default:
+            if(block->count >= TEXT_BLOCK_MAX_FIELDS) {
+                block->overflow = true;
+            }
+            else if( block->in_value && (block->length < TEXT_VALUE_MAX) ) {
+                field->value[block->length++] = c;
+                field->value[block->length] = '\0';
+            }
+            else if( !block->in_value && (block->length < TEXT_NAME_MAX) ) {
+                field->name[block->length++] = c;
+                field->name[block->length] = '\0';
+            }
+            else {
+                block->overflow = true;
+            }
+        break;
+    }
+
+    return GET_TEXT_DATA;
+}
+
+// Feed one received character through the frame state machine
+// HEX frames may arrive in the middle of a TEXT block and are not part of its checksum
+void ProcessReceivedChar(struct VEDevice *device, char c) {
+    struct TextBlock *text_block = &device->text_block;
+
+    //DEBUG
+    //if ( isprint(c) ) {
+    //    printf( "%c", c );
+    //}
+    //else {
+    //    printf( "<%0.2X>", (uint8_t)c );
+    //}
+    //
+    //fflush(NULL);
+
+    switch(device->receive_state) {
+
+        case GET_START_CHAR:
+
+            if( c  == ':' ) {
+                //DEBUG//printf("<SOL>");
+                device->message_length = 0;
+                device->resume_state = GET_START_CHAR;
+                device->receive_state = GET_HEX_DATA;
+            }
+            else if( (c == '\r') || (c == '\n') ) {
+                ResetTextBlock(text_block);
+                device->receive_state = AddTextChar(text_block, c);
+            }
+        break;
+
+        case GET_HEX_DATA:
+
+            if( c == '\n' ) {
+                //DEBUG//printf("<EOL>\r\n");
+                device->message_buffer[device->message_length] = '\0';
+                ParseHexMessage(device, device->message_buffer);
+                device->receive_state = device->resume_state;
+            }
+            else if( c == ':' ) {
+                // ERROR - expected ETX before STX
+                //printf("<UART> ERROR: New packet began before previous packet finished\r\n");
+                device->message_length = 0;
+            }
+            else if( isprint(c) ) {
+                // Valid data, save/buffer it for later.  Frames too long for any register are dropped
+                //DEBUG//printf("%c", c);
+                if(device->message_length < HEX_MESSAGE_MAX) {
+                    device->message_buffer[device->message_length++] = c;
+                }
+                else {
+                    device->receive_state = device->resume_state;
+                }
+            }
+        break;
+
+        case GET_TEXT_DATA:
+
+            if( c == ':' ) {
+                device->message_length = 0;
+                device->resume_state = GET_TEXT_DATA;
+                device->receive_state = GET_HEX_DATA;
+            }
+            else {
+                device->receive_state = AddTextChar(text_block, c);
+            }
+        break;
+
+        case GET_TEXT_CHECKSUM:
+
+            text_block->sum += (uint8_t)c;
+
+            if(text_block->overflow) {
+                device->text_block_stats.overflow++;
+            }
+            else if(text_block->sum != 0) {
+                device->text_block_stats.bad_checksum++;
+                //printf("<UART> ERROR: TEXT block checksum mismatch\r\n");
+            }
+            else {
+                device->text_block_stats.good++;
+                ParseTextBlock(device, text_block);
+            }
+
+            ResetTextBlock(text_block);
+            device->receive_state = GET_START_CHAR;
+        break;
+
+    }
+}
+void RecordReadBatch(struct RxStatistics *stats, unsigned long count) {
+    unsigned int bucket = 0;
+
+    stats->read_calls++;
+    stats->bytes += count;
+
+    if(count > stats->max_batch) {
+        stats->max_batch = count;
+    }
+
+    while( (count >>= 1) && (bucket < (RX_BATCH_BUCKETS - 1)) ) {
+        bucket++;
+    }
+
+    stats->batch_histogram[bucket]++;
+}
+
+// One line per read: seconds since the capture started, device index, then the bytes in hex
+void CaptureBatch(const struct VEDevice *device, const char *data, unsigned int count) {
+    static const char digits[] = "0123456789abcdef";
+
+    fprintf(capture_file, "%0.6f %u ", monotonic_timestamp() - capture_start_s, (unsigned int)(device - devices));
+
+    for (unsigned int i = 0; i < count; i++) {
+        fputc(digits[(uint8_t)data[i] >> 4], capture_file);
+        fputc(digits[(uint8_t)data[i] & 0x0F], capture_file);
+    }
+
+    fputc('\n', capture_file);
+}
+
+// Feed whatever has arrived in the ring through the frame state machine
+void DrainRxRing(struct VEDevice *device) {
+    struct RxRingBuffer *ring = &device->rx_ring;
+
+    while(ring->tail != ring->head) {
+        ProcessReceivedChar(device, ring->data[ring->tail & (RX_RING_SIZE - 1)]);
+        ring->tail++;
+    }
+}
+
+// The link failed or the far end closed it.  Requests carry on and time out until ReconnectDevice() gets it back
+void LoseDevice(struct VEDevice *device, const char *reason) {
+    // A bridge whose serial side is gone may take each connection and close it again, which shouldn't log an
+    // error every attempt
+    device->link_losses++;
+    LOG((device->link_losses == 1) ? LOG_ERROR : LOG_DEBUG, "%s: Lost the %s link (%s), trying again every %u s",
+        device->path, TransportName(&device->transport), reason, stats_period_s);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, device->transport.fd, NULL);
+    TransportHangUp(&device->transport);
+
+    // A frame cut off part way mustn't run into the first bytes of the new connection
+    device->receive_state = GET_START_CHAR;
+    device->resume_state = GET_START_CHAR;
+    device->message_length = 0;
+    ResetTextBlock(&device->text_block);
+}
+
+// Called once epoll reports the UART readable, or hung up.  Reads everything available in one call
+// rather than fetching a byte at a time.  What arrived along with a hang up is read before it is dealt with,
+// by the read that finds nothing more
+void ReadDevice(struct VEDevice *device, bool hung_up) {
+    struct RxRingBuffer *ring = &device->rx_ring;
+    unsigned int space;
+    ssize_t count;
+
+    // Read as much as fits in the contiguous free space at the head of the ring
+    space = RX_RING_SIZE - (ring->head - ring->tail);
+    if( space > (RX_RING_SIZE - (ring->head & (RX_RING_SIZE - 1))) ) {
+        space = RX_RING_SIZE - (ring->head & (RX_RING_SIZE - 1));
+    }
+
+    count = TransportRead(&device->transport, &ring->data[ring->head & (RX_RING_SIZE - 1)], space);
+    device->rx_time_s = monotonic_timestamp();
+
+    if(count == 0) {
+        LoseDevice(device, "closed by the far end");
+        return;
+    }
+
+    if(count < 0) {
+        if( (errno != EAGAIN) && (errno != EINTR) ) {
+            LoseDevice(device, strerror(errno));
+        }
+        else if( hung_up && (errno == EAGAIN) ) {
+            LoseDevice(device, "hung up");
+        }
+        return;
+    }
+
+    if(device->link_losses > 0) {
+        if(device->link_losses > 1) {
+            LOG(LOG_WARNING, "%s: The %s link is back after %u tries", device->path, TransportName(&device->transport),
+                device->link_losses);
+        }
+        device->link_losses = 0;
+    }
+
+    if(capture_file != NULL) {
+        CaptureBatch(device, &ring->data[ring->head & (RX_RING_SIZE - 1)], count);
+    }
+
+    RecordReadBatch(&device->rx_stats, count);
+    ring->head += count;
+
+    DrainRxRing(device);
+}
+
+
+// Suppression ratio is the share of received values that the publish filters held back
+void PrintPublishStatistics(const char *label, const struct RegisterOutput *outputs, unsigned int count) {
+    unsigned long published = 0;
+    unsigned long suppressed = 0;
+
+    for (int i = 0; i < count; i++) {
+        published += outputs[i].publish_count;
+        suppressed += outputs[i].suppress_count;
+    }
+
+    printf("Publish %s: %lu published, %lu suppressed (%0.1f%% suppressed)\r\n", label, published, suppressed,
+           (published + suppressed) ? ( 100.0 * suppressed / (published + suppressed) ) : 0.0);
+
+    for (int i = 0; i < count; i++) {
+        if(outputs[i].suppress_count > 0) {
+            printf("Publish %s: %s %lu published, %lu suppressed (%0.1f%% suppressed)\r\n", label, outputs[i].topic,
+                   outputs[i].publish_count, outputs[i].suppress_count,
+                   100.0 * outputs[i].suppress_count / (outputs[i].publish_count + outputs[i].suppress_count));
+        }
+    }
+}
+
+// Read through the store as any other thread would, the values are those last received whether published or not
+void PrintRegisterValues(const char *label, const struct RegisterStore *store, const struct RegisterOutput *outputs) {
+    struct RegisterReading reading;
+    double now = monotonic_timestamp();
+
+    for (unsigned int i = 0; i < store->count; i++) {
+        if( !RegisterStoreRead(store, i, &reading) ) {
+            continue;
+        }
+
+        if(reading.text[0] != '\0') {
+            printf("Value %s: %s \"%s\"", label, outputs[i].name, reading.text);
+        }
+        else {
+            printf("Value %s: %s %.10g", label, outputs[i].name, reading.value);
+        }
+
+        printf(" (%s, %u updates, %0.1f s old)\r\n", RegisterQualityName(reading.quality), reading.updates, now - reading.time_s);
+    }
+}
+
+// Every frame seen on the device, whether or not it was good
+unsigned long DeviceFrames(const struct VEDevice *device) {
+    return device->text_block_stats.good + device->text_block_stats.bad_checksum + device->text_block_stats.overflow +
+           device->hex_frame_stats.good + device->hex_frame_stats.bad_checksum + device->hex_frame_stats.flag_unknown +
+           device->hex_frame_stats.flag_unsupported + device->hex_frame_stats.flag_parameter_error +
+           device->hex_frame_stats.flag_other;
+}
+
+// Appends to a buffer, stopping quietly once it is full.  The result is always terminated
+void Append(char *buffer, unsigned int size, unsigned int *length, const char *format, ...) {
+    va_list args;
+    int count;
+
+    if(*length >= size) {
+        return;
+    }
+
+    va_start(args, format);
+    count = vsnprintf(buffer + *length, size - *length, format, args);
+    va_end(args);
+
+    *length = (count < 0) ? size : (*length + count);
+}
+
+void AppendHistogram(char *buffer, unsigned int size, unsigned int *length, const char *name, const struct Histogram *histogram) {
+    Append(buffer, size, length, "\"%s\":{\"count\":%llu,\"mean_ms\":%0.3f,\"p50_ms\":%0.3f,\"p90_ms\":%0.3f,\"p99_ms\":%0.3f,\"max_ms\":%0.3f}",
+           name, (unsigned long long)HistogramCount(histogram), HistogramMean(histogram) / 1000.0,
+           HistogramPercentile(histogram, 50) / 1000.0, HistogramPercentile(histogram, 90) / 1000.0,
+           HistogramPercentile(histogram, 99) / 1000.0, HistogramMax(histogram) / 1000.0);
+}
+
+// Pipeline metrics for one device as a JSON object on <root>/$stats
+void PublishDeviceStatistics(struct VEDevice *device) {
+    const struct TransportStatistics *link_stats = &device->transport.stats;
+    char payload[STATS_PAYLOAD_MAX];
+    unsigned int length = 0;
+    unsigned long frames = DeviceFrames(device);
+    unsigned long published = 0;
+    unsigned long suppressed = 0;
+    double now = monotonic_timestamp();
+    bool first = true;
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        published += device->hex_outputs[i].publish_count;
+        suppressed += device->hex_outputs[i].suppress_count;
+    }
+    for (int i = 0; i < vedirect_text_lookup_count; i++) {
+        published += device->text_outputs[i].publish_count;
+        suppressed += device->text_outputs[i].suppress_count;
+    }
+
+    Append(payload, sizeof(payload), &length, "{\"frames\":%lu,\"frames_per_s\":%0.2f,\"async_frames\":%lu,", frames,
+           (frames - device->stats_last_frames) / (now - device->stats_last_s), device->hex_frame_stats.async);
+
+    Append(payload, sizeof(payload), &length, "\"parse_errors\":{\"text_bad_checksum\":%lu,\"text_overflow\":%lu,\"hex_bad_checksum\":%lu,"
+           "\"hex_unknown\":%lu,\"hex_unsupported\":%lu,\"hex_parameter_error\":%lu,\"hex_other_flags\":%lu},",
+           device->text_block_stats.bad_checksum, device->text_block_stats.overflow, device->hex_frame_stats.bad_checksum,
+           device->hex_frame_stats.flag_unknown, device->hex_frame_stats.flag_unsupported, device->hex_frame_stats.flag_parameter_error,
+           device->hex_frame_stats.flag_other);
+
+    Append(payload, sizeof(payload), &length, "\"link\":{\"type\":\"%s\",\"open\":%s,\"bytes_read\":%lu,\"bytes_written\":%lu,"
+           "\"read_bytes_per_s\":%0.1f,\"written_bytes_per_s\":%0.1f,\"short_writes\":%lu,\"read_errors\":%lu,\"write_errors\":%lu,"
+           "\"connects\":%lu,\"disconnects\":%lu},", TransportName(&device->transport), TransportIsOpen(&device->transport) ? "true" : "false",
+           link_stats->bytes_read, link_stats->bytes_written,
+           (link_stats->bytes_read - device->stats_last_bytes_read) / (now - device->stats_last_s),
+           (link_stats->bytes_written - device->stats_last_bytes_written) / (now - device->stats_last_s),
+           link_stats->short_writes, link_stats->read_errors, link_stats->write_errors, link_stats->connects, link_stats->disconnects);
+
+    Append(payload, sizeof(payload), &length, "\"queue\":{\"depth\":%u,\"max_depth\":%u,\"dropped\":%lu},",
+           RequestQueueDepth(&device->request_queue), device->request_queue.max_depth, device->request_queue.dropped);
+
+    Append(payload, sizeof(payload), &length, "\"requests\":{\"sent\":%lu,\"answered\":%lu,\"retries\":%lu,\"timeouts\":%lu,\"srtt_ms\":%0.3f},",
+           device->in_flight.sent, device->in_flight.answered_count, device->in_flight.retries, device->in_flight.timeouts,
+           1000.0 * device->in_flight.srtt_s);
+
+    Append(payload, sizeof(payload), &length, "\"set\":{\"received\":%lu,\"rejected\":%lu,\"done\":%lu,\"failed\":%lu,",
+           device->set_queue.received, device->set_queue.rejected, device->set_queue.completed, device->set_queue.failed);
+    AppendHistogram(payload, sizeof(payload), &length, "latency", &device->set_latency);
+    Append(payload, sizeof(payload), &length, "},");
+
+    Append(payload, sizeof(payload), &length, "\"publish\":{\"published\":%lu,\"suppressed\":%lu,\"snapshots\":%lu,\"snapshot_overflows\":%lu,",
+           published, suppressed, device->hex_snapshot.publish_count + device->text_snapshot.publish_count,
+           device->hex_snapshot.overflow_count + device->text_snapshot.overflow_count);
+    AppendHistogram(payload, sizeof(payload), &length, "latency", &device->publish_latency);
+
+    // Shared by every device
+    Append(payload, sizeof(payload), &length, ",\"queue\":{\"depth\":%u,\"max_depth\":%u,\"size\":%u,\"dropped\":%lu,\"coalesced\":%lu}",
+           PublishQueueDepth(&publish_queue), publish_queue.max_depth, publish_queue.size, publish_queue.dropped, publish_queue.coalesced);
+
+    Append(payload, sizeof(payload), &length, "},\"request_latency\":{");
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        if(device->register_timing[i].latency != NULL) {
+            Append(payload, sizeof(payload), &length, first ? "" : ",");
+            AppendHistogram(payload, sizeof(payload), &length, vedirect_hex_lookup[i].name, device->register_timing[i].latency);
+            first = false;
+        }
+    }
+    Append(payload, sizeof(payload), &length, "}}");
+
+    device->stats_last_frames = frames;
+    device->stats_last_bytes_read = link_stats->bytes_read;
+    device->stats_last_bytes_written = link_stats->bytes_written;
+    device->stats_last_s = now;
+
+    // Better nothing than a truncated document
+    if(length >= sizeof(payload)) {
+        LOG(LOG_WARNING, "%s: Statistics too large to publish", device->path);
+        return;
+    }
+
+    PublishMessage(device, device->stats_topic, payload, length, 0);
+}
+
+// OpenMetrics unit names for the units in the register tables.  Registers with any other unit are given none
+struct MetricUnit {
+    const char *units;
+    const char *name;
+};
+
+const struct MetricUnit metric_unit_list[] = {
+    { "V",      "volts" },
+    { "A",      "amperes" },
+    { "W",      "watts" },
+    { "Ah",     "ampere_hours" },
+    { "kWh",    "kilowatt_hours" },
+    { "%",      "percent" },
+    { "s",      "seconds" },
+    { "Sec",    "seconds" },
+    { "min",    "minutes" },
+    { "Min",    "minutes" },
+    { "K",      "kelvin" },
+};
+
+#define METRIC_UNIT_COUNT ( sizeof(metric_unit_list) / sizeof(struct MetricUnit) )
+
+// Counters kept by each device, each rendered as a counter with a sample per device.  Consecutive entries with
+// the same name are one family told apart by their labels
+struct DeviceCounter {
+    const char *name;
+    const char *unit; // OpenMetrics unit, empty for none
+    const char *labels; // Added after the device label, empty for none
+    const char *help;
+    size_t offset; // Of an unsigned long in struct VEDevice
+};
+
+const struct DeviceCounter device_counter_list[] = {
+    { "vedirect_link_read_bytes",    "bytes", "",                            "Bytes read from the device",                offsetof(struct VEDevice, transport.stats.bytes_read) },
+    { "vedirect_link_written_bytes", "bytes", "",                            "Bytes written to the device",               offsetof(struct VEDevice, transport.stats.bytes_written) },
+    { "vedirect_link_errors",        "",      "direction=\"read\"",          "Reads and writes that failed",              offsetof(struct VEDevice, transport.stats.read_errors) },
+    { "vedirect_link_errors",        "",      "direction=\"write\"",         "Reads and writes that failed",              offsetof(struct VEDevice, transport.stats.write_errors) },
+    { "vedirect_link_short_writes",  "",      "",                            "Writes the link didn't take whole",         offsetof(struct VEDevice, transport.stats.short_writes) },
+    { "vedirect_link_connects",      "",      "",                            "Times the link was opened",                 offsetof(struct VEDevice, transport.stats.connects) },
+    { "vedirect_link_disconnects",   "",      "",                            "Times the far end closed or lost the link", offsetof(struct VEDevice, transport.stats.disconnects) },
+    { "vedirect_text_blocks",        "",      "result=\"good\"",             "TEXT blocks received",                      offsetof(struct VEDevice, text_block_stats.good) },
+    { "vedirect_text_blocks",        "",      "result=\"bad_checksum\"",     "TEXT blocks received",                      offsetof(struct VEDevice, text_block_stats.bad_checksum) },
+    { "vedirect_text_blocks",        "",      "result=\"overflow\"",         "TEXT blocks received",                      offsetof(struct VEDevice, text_block_stats.overflow) },
+    { "vedirect_hex_frames",         "",      "result=\"good\"",             "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.good) },
+    { "vedirect_hex_frames",         "",      "result=\"bad_checksum\"",     "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.bad_checksum) },
+    { "vedirect_hex_frames",         "",      "result=\"unknown\"",          "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.flag_unknown) },
+    { "vedirect_hex_frames",         "",      "result=\"unsupported\"",      "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.flag_unsupported) },
+    { "vedirect_hex_frames",         "",      "result=\"parameter_error\"",  "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.flag_parameter_error) },
+    { "vedirect_hex_frames",         "",      "result=\"other_flags\"",      "HEX frames received",                       offsetof(struct VEDevice, hex_frame_stats.flag_other) },
+    { "vedirect_hex_async_frames",   "",      "",                            "Good HEX frames the device sent unasked",   offsetof(struct VEDevice, hex_frame_stats.async) },
+    { "vedirect_requests_sent",      "",      "",                            "GETs and SETs sent, retries included",      offsetof(struct VEDevice, in_flight.sent) },
+    { "vedirect_requests_answered",  "",      "",                            "GETs and SETs answered",                    offsetof(struct VEDevice, in_flight.answered_count) },
+    { "vedirect_request_retries",    "",      "",                            "GETs and SETs sent again on timeout",       offsetof(struct VEDevice, in_flight.retries) },
+    { "vedirect_request_timeouts",   "",      "",                            "GETs and SETs given up on",                 offsetof(struct VEDevice, in_flight.timeouts) },
+    { "vedirect_request_queue_drops", "",     "",                            "GETs dropped from a full request queue",    offsetof(struct VEDevice, request_queue.dropped) },
+    { "vedirect_sets",               "",      "result=\"received\"",         "SETs received over MQTT",                   offsetof(struct VEDevice, set_queue.received) },
+    { "vedirect_sets",               "",      "result=\"rejected\"",         "SETs received over MQTT",                   offsetof(struct VEDevice, set_queue.rejected) },
+    { "vedirect_sets",               "",      "result=\"done\"",             "SETs received over MQTT",                   offsetof(struct VEDevice, set_queue.completed) },
+    { "vedirect_sets",               "",      "result=\"failed\"",           "SETs received over MQTT",                   offsetof(struct VEDevice, set_queue.failed) },
+};
+
+#define DEVICE_COUNTER_COUNT ( sizeof(device_counter_list) / sizeof(struct DeviceCounter) )
+
+void AppendMetricFamily(char *buffer, unsigned int size, unsigned int *length, const char *name, const char *type,
+                        const char *unit, const char *help) {
+    Append(buffer, size, length, "# TYPE %s %s\n", name, type);
+    if(unit[0] != '\0') {
+        Append(buffer, size, length, "# UNIT %s %s\n", name, unit);
+    }
+    Append(buffer, size, length, "# HELP %s %s\n", name, help);
+}
+
+// Quoted, with backslash, double quote and newline escaped
+void AppendLabelValue(char *buffer, unsigned int size, unsigned int *length, const char *value) {
+    Append(buffer, size, length, "\"");
+
+    if( strpbrk(value, "\\\"\n") == NULL ) {
+        Append(buffer, size, length, "%s", value);
+    }
+    else {
+        for (; *value != '\0'; value++) {
+            if(*value == '\n') {
+                Append(buffer, size, length, "\\n");
+            }
+            else {
+                Append(buffer, size, length, ( (*value == '\\') || (*value == '"') ) ? "\\%c" : "%c", *value);
+            }
+        }
+    }
+
+    Append(buffer, size, length, "\"");
+}
+
+// Starts a sample, up to the closing brace of its labels
+void AppendSample(char *buffer, unsigned int size, unsigned int *length, const char *name, const char *suffix,
+                  const struct VEDevice *device) {
+    Append(buffer, size, length, "%s%s{device=", name, suffix);
+    AppendLabelValue(buffer, size, length, device->topic_root);
+}
+
+void AppendMetricValue(char *buffer, unsigned int size, unsigned int *length, double value) {
+    if( isnan(value) ) {
+        Append(buffer, size, length, " NaN\n");
+    }
+    else {
+        Append(buffer, size, length, " %.10g\n", value);
+    }
+}
+
+// Writes the name of a register's family, and returns its OpenMetrics unit or ""
+const char *RegisterFamilyName(char *family, size_t size, const char *kind, const char *name, const char *units) {
+    const char *unit = "";
+
+    for (int i = 0; i < METRIC_UNIT_COUNT; i++) {
+        if( !strcmp(units, metric_unit_list[i].units) ) {
+            unit = metric_unit_list[i].name;
+            break;
+        }
+    }
+
+    snprintf(family, size, "vedirect_%s_%s%s%s", kind, name, (unit[0] != '\0') ? "_" : "", unit);
+    return unit;
+}
+
+// One family per register, with a sample for each device that has received it.  Values the device had none for
+// show as NaN.  String registers are info families, carrying the string as a label
+void AppendRegisterFamily(char *buffer, unsigned int size, unsigned int *length, const char *kind, const char *name,
+                          const char *units, bool is_string, size_t store_offset, unsigned int index) {
+    struct RegisterReading reading;
+    char family[128];
+    char help[128];
+    const char *unit = RegisterFamilyName(family, sizeof(family), kind, name, units);
+
+    snprintf(help, sizeof(help), "Latest %s value of %s%s%s", kind, name, (units[0] != '\0') ? ", in " : "", units);
+    AppendMetricFamily(buffer, size, length, family, is_string ? "info" : "gauge", unit, help);
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        if( !RegisterStoreRead((const struct RegisterStore *)( (const char *)&devices[i] + store_offset ), index, &reading) ) {
+            continue;
+        }
+
+        if(is_string) {
+            AppendSample(buffer, size, length, family, "_info", &devices[i]);
+            Append(buffer, size, length, ",value=");
+            AppendLabelValue(buffer, size, length, reading.text);
+            Append(buffer, size, length, "} 1\n");
+        }
+        else {
+            AppendSample(buffer, size, length, family, "", &devices[i]);
+            Append(buffer, size, length, "}");
+            AppendMetricValue(buffer, size, length, (reading.quality == REGISTER_GOOD) ? reading.value : NAN);
+        }
+    }
+}
+
+// Quantiles from a histogram of microseconds, as a summary in seconds
+void AppendLatencySummary(char *buffer, unsigned int size, unsigned int *length, const char *name, const struct VEDevice *device,
+                          const char *labels, const struct Histogram *histogram) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99 };
+    uint64_t count = HistogramCount(histogram);
+
+    for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        AppendSample(buffer, size, length, name, "", device);
+        Append(buffer, size, length, "%s,quantile=\"%g\"} %.6f\n", labels, quantiles[i],
+               HistogramPercentile(histogram, 100.0 * quantiles[i]) / 1.0e6);
+    }
+
+    AppendSample(buffer, size, length, name, "_count", device);
+    Append(buffer, size, length, "%s} %llu\n", labels, (unsigned long long)count);
+    AppendSample(buffer, size, length, name, "_sum", device);
+    Append(buffer, size, length, "%s} %.6f\n", labels, count ? ( HistogramMean(histogram) * count / 1.0e6 ) : 0.0);
+}
+
+// Renders a scrape for the metrics thread.  Register values come from the register stores.  The counters are read
+// as they stand while the event loop carries on, each is one aligned word so at worst it is a moment out of date
+unsigned int RenderMetrics(char *buffer, unsigned int size, void *context) {
+    unsigned int length = 0;
+    unsigned long sum;
+    char labels[TOPIC_MAX + 16];
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        if(vedirect_hex_lookup[i].type != VE_TYPE_NONE) {
+            AppendRegisterFamily(buffer, size, &length, "hex", vedirect_hex_lookup[i].name, vedirect_hex_lookup[i].units,
+                                 ve_hex_type_info[vedirect_hex_lookup[i].type].is_string, offsetof(struct VEDevice, hex_store), i);
+        }
+    }
+
+    for (int i = 0; i < vedirect_text_lookup_count; i++) {
+        AppendRegisterFamily(buffer, size, &length, "text", vedirect_text_lookup[i].name, vedirect_text_lookup[i].units,
+                             false, offsetof(struct VEDevice, text_store), i);
+    }
+
+    for (int i = 0; i < DEVICE_COUNTER_COUNT; i++) {
+        const struct DeviceCounter *counter = &device_counter_list[i];
+
+        if( (i == 0) || strcmp(counter->name, device_counter_list[i - 1].name) ) {
+            AppendMetricFamily(buffer, size, &length, counter->name, "counter", counter->unit, counter->help);
+        }
+
+        for (unsigned int j = 0; j < device_count; j++) {
+            AppendSample(buffer, size, &length, counter->name, "_total", &devices[j]);
+            Append(buffer, size, &length, "%s%s} %lu\n", (counter->labels[0] != '\0') ? "," : "", counter->labels,
+                   *(const unsigned long *)( (const char *)&devices[j] + counter->offset ));
+        }
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_requests_skipped", "counter", "",
+                       "Periodic requests left out as the value arrived anyway");
+    for (unsigned int i = 0; i < device_count; i++) {
+        sum = 0;
+        for (int j = 0; j < PERIODIC_REQUEST_COUNT; j++) {
+            sum += devices[i].requests[j].async_skip_count;
+        }
+        AppendSample(buffer, size, &length, "vedirect_requests_skipped", "_total", &devices[i]);
+        Append(buffer, size, &length, ",reason=\"async\"} %lu\n", sum);
+
+        sum = 0;
+        for (int j = 0; j < PERIODIC_REQUEST_COUNT; j++) {
+            sum += devices[i].requests[j].text_skip_count;
+        }
+        AppendSample(buffer, size, &length, "vedirect_requests_skipped", "_total", &devices[i]);
+        Append(buffer, size, &length, ",reason=\"text\"} %lu\n", sum);
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_values", "counter", "", "Values received, by whether the publish filters let them out");
+    for (unsigned int i = 0; i < device_count; i++) {
+        unsigned long published = 0;
+        unsigned long suppressed = 0;
+
+        for (int j = 0; j < vedirect_hex_lookup_count; j++) {
+            published += devices[i].hex_outputs[j].publish_count;
+            suppressed += devices[i].hex_outputs[j].suppress_count;
+        }
+        for (int j = 0; j < vedirect_text_lookup_count; j++) {
+            published += devices[i].text_outputs[j].publish_count;
+            suppressed += devices[i].text_outputs[j].suppress_count;
+        }
+
+        AppendSample(buffer, size, &length, "vedirect_values", "_total", &devices[i]);
+        Append(buffer, size, &length, ",result=\"published\"} %lu\n", published);
+        AppendSample(buffer, size, &length, "vedirect_values", "_total", &devices[i]);
+        Append(buffer, size, &length, ",result=\"suppressed\"} %lu\n", suppressed);
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_link_up", "gauge", "", "Whether the link to the device is open");
+    for (unsigned int i = 0; i < device_count; i++) {
+        AppendSample(buffer, size, &length, "vedirect_link_up", "", &devices[i]);
+        Append(buffer, size, &length, "} %d\n", TransportIsOpen(&devices[i].transport));
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_request_queue_depth", "gauge", "", "GETs waiting to be sent");
+    for (unsigned int i = 0; i < device_count; i++) {
+        AppendSample(buffer, size, &length, "vedirect_request_queue_depth", "", &devices[i]);
+        Append(buffer, size, &length, "} %u\n", RequestQueueDepth(&devices[i].request_queue));
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_request_round_trip_seconds", "gauge", "seconds",
+                       "Smoothed time from a request being sent to its answer");
+    for (unsigned int i = 0; i < device_count; i++) {
+        AppendSample(buffer, size, &length, "vedirect_request_round_trip_seconds", "", &devices[i]);
+        Append(buffer, size, &length, "} %.6f\n", devices[i].in_flight.srtt_s);
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_request_latency_seconds", "summary", "seconds",
+                       "Time from a GET being sent to its answer, by register");
+    for (unsigned int i = 0; i < device_count; i++) {
+        for (int j = 0; j < vedirect_hex_lookup_count; j++) {
+            if(devices[i].register_timing[j].latency != NULL) {
+                snprintf(labels, sizeof(labels), ",register=\"%s\"", vedirect_hex_lookup[j].name);
+                AppendLatencySummary(buffer, size, &length, "vedirect_request_latency_seconds", &devices[i], labels,
+                                     devices[i].register_timing[j].latency);
+            }
+        }
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_set_latency_seconds", "summary", "seconds",
+                       "Time from a SET arriving over MQTT to the device answering it");
+    for (unsigned int i = 0; i < device_count; i++) {
+        AppendLatencySummary(buffer, size, &length, "vedirect_set_latency_seconds", &devices[i], "", &devices[i].set_latency);
+    }
+
+    AppendMetricFamily(buffer, size, &length, "vedirect_publish_latency_seconds", "summary", "seconds",
+                       "Time from a value being read to it being handed to the MQTT client");
+    for (unsigned int i = 0; i < device_count; i++) {
+        AppendLatencySummary(buffer, size, &length, "vedirect_publish_latency_seconds", &devices[i], "", &devices[i].publish_latency);
+    }
+
+    // Shared by every device
+    Append(buffer, size, &length, "# TYPE vedirect_mqtt_connected gauge\n# HELP vedirect_mqtt_connected Whether the broker is connected\n"
+           "vedirect_mqtt_connected %d\n", __atomic_load_n(&mqtt_connected, __ATOMIC_ACQUIRE));
+
+    Append(buffer, size, &length, "# TYPE vedirect_publish_queue_depth gauge\n# HELP vedirect_publish_queue_depth Messages waiting for the publisher thread\n"
+           "vedirect_publish_queue_depth %u\n", PublishQueueDepth(&publish_queue));
+    Append(buffer, size, &length, "# TYPE vedirect_publish_queue_size gauge\n# HELP vedirect_publish_queue_size Messages the publish queue can hold\n"
+           "vedirect_publish_queue_size %u\n", publish_queue.size);
+    Append(buffer, size, &length, "# TYPE vedirect_publish_queue_messages counter\n# HELP vedirect_publish_queue_messages Messages given to the publish queue\n"
+           "vedirect_publish_queue_messages_total{result=\"queued\"} %lu\n"
+           "vedirect_publish_queue_messages_total{result=\"dropped\"} %lu\n"
+           "vedirect_publish_queue_messages_total{result=\"coalesced\"} %lu\n"
+           "vedirect_publish_queue_messages_total{result=\"too_large\"} %lu\n",
+           publish_queue.pushed, publish_queue.dropped, publish_queue.coalesced, publish_queue.too_large);
+
+    Append(buffer, size, &length, "# TYPE vedirect_metrics_scrapes counter\n# HELP vedirect_metrics_scrapes Responses rendered, this one included\n"
+           "vedirect_metrics_scrapes_total %lu\n", metrics_server.stats.scrapes + 1);
+
+    Append(buffer, size, &length, "# EOF\n");
+
+    return length;
+}
+
+// The largest body a scrape can render, or 0 if out of memory.  Rendered now, before anything is received, a
+// scrape holds every line but the register samples, and every count in it is as short as it will ever be.  So
+// each of those lines is given room for its number to grow, and a sample of every register for every device is
+// allowed for at its longest, a string register's info sample with every character of topic and text escaped
+unsigned int MetricsBodySize(void) {
+    const size_t sample = strlen("_info{device=\"\",value=\"\"} 1\n") + ( 2 * (REGISTER_TEXT_MAX - 1) ) + METRICS_NUMBER_MAX;
+    unsigned int size = 16 * 1024;
+    unsigned int length;
+    unsigned int lines = 0;
+    size_t topics = 0;
+    size_t body;
+    char family[128];
+    char *buffer = NULL;
+    char *grown;
+
+    for (;;) {
+        if( (grown = realloc(buffer, size)) == NULL ) {
+            free(buffer);
+            return 0;
+        }
+        buffer = grown;
+
+        if( (length = RenderMetrics(buffer, size, NULL)) < size ) {
+            break;
+        }
+        size *= 2;
+    }
+
+    for (unsigned int i = 0; i < length; i++) {
+        lines += (buffer[i] == '\n');
+    }
+    free(buffer);
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        topics += 2 * strlen(devices[i].topic_root);
+    }
+
+    body = length + ( (size_t)lines * METRICS_NUMBER_MAX );
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        if(vedirect_hex_lookup[i].type != VE_TYPE_NONE) {
+            RegisterFamilyName(family, sizeof(family), "hex", vedirect_hex_lookup[i].name, vedirect_hex_lookup[i].units);
+            body += ( device_count * (strlen(family) + sample) ) + topics;
+        }
+    }
+
+    for (int i = 0; i < vedirect_text_lookup_count; i++) {
+        RegisterFamilyName(family, sizeof(family), "text", vedirect_text_lookup[i].name, vedirect_text_lookup[i].units);
+        body += ( device_count * (strlen(family) + sample) ) + topics;
+    }
+
+    // A byte over, as a render that fills its buffer is taken to have been cut short
+    return (body < UINT_MAX) ? (body + 1) : 0;
+}
+
+void PrintDeviceStatistics(const struct VEDevice *device) {
+    const struct RxStatistics *rx_stats = &device->rx_stats;
+    const struct InFlightRequest *in_flight = &device->in_flight;
+    const struct TransportStatistics *link_stats = &device->transport.stats;
+
+    printf("Device %s (%s):\r\n", device->path, device->topic_root);
+
+    printf("Link: %s, %s, %lu bytes read, %lu bytes written in %lu writes (%lu short), %lu read errors, %lu write errors, "
+           "%lu connects, %lu disconnects\r\n", TransportName(&device->transport), TransportIsOpen(&device->transport) ? "open" : "closed",
+           link_stats->bytes_read, link_stats->bytes_written, link_stats->writes, link_stats->short_writes,
+           link_stats->read_errors, link_stats->write_errors, link_stats->connects, link_stats->disconnects);
+
+    printf("UART: %lu bytes in %lu reads (%0.1f bytes/read, max %lu)\r\n",
+           rx_stats->bytes, rx_stats->read_calls,
+           rx_stats->read_calls ? ( (double)rx_stats->bytes / rx_stats->read_calls ) : 0.0,
+           rx_stats->max_batch);
+
+    printf("UART: bytes/read histogram");
+    for (int i = 0; i < RX_BATCH_BUCKETS; i++) {
+        printf(" [%u%s]=%lu", 1u << i, (i == RX_BATCH_BUCKETS - 1) ? "+" : "", rx_stats->batch_histogram[i]);
+    }
+    printf("\r\n");
+
+    printf("TX queue: depth %u, max depth %u of %u, dropped %lu\r\n",
+           RequestQueueDepth(&device->request_queue), device->request_queue.max_depth, REQUEST_QUEUE_SIZE,
+           device->request_queue.dropped);
+
+    printf("TEXT blocks: %lu good, %lu bad checksum, %lu overflowed\r\n",
+           device->text_block_stats.good, device->text_block_stats.bad_checksum, device->text_block_stats.overflow);
+
+    printf("HEX frames: %lu good (%lu async), %lu bad checksum, %lu unknown, %lu unsupported, %lu parameter error, %lu other flags\r\n",
+           device->hex_frame_stats.good, device->hex_frame_stats.async, device->hex_frame_stats.bad_checksum, device->hex_frame_stats.flag_unknown,
+           device->hex_frame_stats.flag_unsupported, device->hex_frame_stats.flag_parameter_error, device->hex_frame_stats.flag_other);
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        const struct HexFrameStatistics *register_stats = &device->hex_register_stats[i];
+
+        if( register_stats->good || register_stats->bad_checksum || register_stats->flag_unknown ||
+            register_stats->flag_unsupported || register_stats->flag_parameter_error || register_stats->flag_other ) {
+            printf("HEX frames: %s %lu good (%lu async), %lu bad checksum, %lu unknown, %lu unsupported, %lu parameter error, %lu other flags\r\n",
+                   vedirect_hex_lookup[i].name, register_stats->good, register_stats->async, register_stats->bad_checksum, register_stats->flag_unknown,
+                   register_stats->flag_unsupported, register_stats->flag_parameter_error, register_stats->flag_other);
+        }
+    }
+
+    PrintPublishStatistics("hex", device->hex_outputs, vedirect_hex_lookup_count);
+    PrintPublishStatistics("text", device->text_outputs, vedirect_text_lookup_count);
+    PrintRegisterValues("hex", &device->hex_store, device->hex_outputs);
+    PrintRegisterValues("text", &device->text_store, device->text_outputs);
+
+    if(snapshot_output) {
+        printf("Snapshots: %lu hex, %lu text published, %lu too large\r\n", device->hex_snapshot.publish_count,
+               device->text_snapshot.publish_count, device->hex_snapshot.overflow_count + device->text_snapshot.overflow_count);
+    }
+
+    printf("TX flow: %lu sent, %lu answered, %lu retries, %lu timed out, round trip %0.1f ms (+/- %0.1f ms)\r\n",
+           in_flight->sent, in_flight->answered_count, in_flight->retries, in_flight->timeouts,
+           1000.0 * in_flight->srtt_s, 1000.0 * in_flight->rttvar_s);
+
+    if(device->set_queue.received > 0) {
+        printf("SET: %lu received, %lu rejected, %lu done, %lu failed, %0.3f ms p50, %0.3f ms p99, %0.3f ms max\r\n",
+               device->set_queue.received, device->set_queue.rejected, device->set_queue.completed, device->set_queue.failed,
+               HistogramPercentile(&device->set_latency, 50) / 1000.0, HistogramPercentile(&device->set_latency, 99) / 1000.0,
+               HistogramMax(&device->set_latency) / 1000.0);
+    }
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        const struct Histogram *latency = device->register_timing[i].latency;
+
+        if( (latency != NULL) && (HistogramCount(latency) > 0) ) {
+            printf("Latency: %s %llu responses, %0.3f ms p50, %0.3f ms p90, %0.3f ms p99, %0.3f ms max\r\n",
+                   vedirect_hex_lookup[i].name, (unsigned long long)HistogramCount(latency),
+                   HistogramPercentile(latency, 50) / 1000.0, HistogramPercentile(latency, 90) / 1000.0,
+                   HistogramPercentile(latency, 99) / 1000.0, HistogramMax(latency) / 1000.0);
+        }
+    }
+
+    printf("Latency: publish %llu values, %0.3f ms p50, %0.3f ms p99, %0.3f ms max\r\n",
+           (unsigned long long)HistogramCount(&device->publish_latency), HistogramPercentile(&device->publish_latency, 50) / 1000.0,
+           HistogramPercentile(&device->publish_latency, 99) / 1000.0, HistogramMax(&device->publish_latency) / 1000.0);
+
+    for (int i = 0; i < PERIODIC_REQUEST_COUNT; i++ ) {
+        const struct VEPeriodicRequest *request = &device->requests[i];
+
+        if(request->request_count > 0) {
+            printf("Schedule: %s due %lu times, %lu left out as sent async, %lu as fresh in TEXT, late by %0.3f ms mean, %0.3f ms max\r\n",
+                   request->name, request->request_count, request->async_skip_count, request->text_skip_count,
+                   1000.0 * request->total_late_s / request->request_count,
+                   1000.0 * request->max_late_s);
+        }
+    }
+}
+
+// Only called from the event loop thread, or once it has stopped, so the counters can be read without locking
+void PrintStatistics(void) {
+    printf("Log: %lu messages dropped\r\n", LogDropped());
+
+    printf("Publish queue: depth %u, max depth %u of %u, %lu queued, %lu dropped, %lu coalesced, %lu waited for room, %lu too large\r\n",
+           PublishQueueDepth(&publish_queue), publish_queue.max_depth, publish_queue.size, publish_queue.pushed,
+           publish_queue.dropped, publish_queue.coalesced, publish_queue.waited, publish_queue.too_large);
+
+    if(metrics_address != NULL) {
+        printf("Metrics: %lu scrapes, %lu shared, %lu refused, %lu timed out, %lu too large\r\n", metrics_server.stats.scrapes,
+               metrics_server.stats.shared, metrics_server.stats.refused, metrics_server.stats.timeouts, metrics_server.stats.too_large);
+    }
+
+    if(journal.fd >= 0) {
+        printf("Journal: %llu of %llu bytes used, %lu journaled, %lu too large, %lu sent, %lu delivered, %llu dropped\r\n",
+               (unsigned long long)JournalUsed(&journal), (unsigned long long)journal.capacity, journal_drain.journaled,
+               journal_drain.rejected, journal_drain.sent, journal_drain.delivered, (unsigned long long)journal.header->dropped);
+    }
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        PrintDeviceStatistics(&devices[i]);
+    }
+
+    fflush(NULL);
+}
+
+bool ScheduleEarlier(const struct VEDevice *device, unsigned int a, unsigned int b) {
+    return device->requests[device->schedule_heap[a]].next_due_s < device->requests[device->schedule_heap[b]].next_due_s;
+}
+
+void ScheduleSwap(struct VEDevice *device, unsigned int a, unsigned int b) {
+    unsigned int temp = device->schedule_heap[a];
+    device->schedule_heap[a] = device->schedule_heap[b];
+    device->schedule_heap[b] = temp;
+}
+
+void ScheduleSiftUp(struct VEDevice *device, unsigned int pos) {
+    while( (pos > 0) && ScheduleEarlier(device, pos, (pos - 1) / 2) ) {
+        ScheduleSwap(device, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+void ScheduleSiftDown(struct VEDevice *device, unsigned int pos) {
+    unsigned int child;
+
+    while( (child = (2 * pos) + 1) < device->schedule_count ) {
+        if( ((child + 1) < device->schedule_count) && ScheduleEarlier(device, child + 1, child) ) {
+            child++;
+        }
+
+        if( !ScheduleEarlier(device, child, pos) ) {
+            break;
+        }
+
+        ScheduleSwap(device, child, pos);
+        pos = child;
+    }
+}
+
+const struct PublishFilter *FindPublishFilter(const char *name) {
+    for (int i = 0; i < ( sizeof(publish_filter_list) / sizeof(struct PublishFilter) ); i++) {
+        if( !strcmp(publish_filter_list[i].name, name) ) {
+            return &publish_filter_list[i];
+        }
+    }
+
+    return &default_publish_filter;
+}
+
+const struct AggregateConfig *FindAggregateConfig(const char *name) {
+    for (int i = 0; i < AGGREGATE_CONFIG_COUNT; i++) {
+        if( !strcmp(aggregate_list[i].name, name) ) {
+            return &aggregate_list[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Gives an output its windows, taken from the device's array.  A window whose topic doesn't fit is left out, and
+// a register left with none is published as usual.  Returns how many it used
+unsigned int InitAggregates(struct VEDevice *device, struct RegisterOutput *output, const char *name, int decimals) {
+    const struct AggregateConfig *config = FindAggregateConfig(name);
+    struct Aggregate *aggregate;
+    int length;
+
+    if(config == NULL) {
+        return 0;
+    }
+
+    output->aggregates = &device->aggregates[device->aggregate_count];
+
+    for (int i = 0; (i < AGGREGATE_WINDOWS_MAX) && (config->window_s[i] > 0); i++) {
+        aggregate = &output->aggregates[output->aggregate_count];
+        length = snprintf(aggregate->topic, TOPIC_MAX, "%s/%gs", output->topic, config->window_s[i]);
+
+        if( (length < 0) || (length >= TOPIC_MAX) ) {
+            fprintf(stderr, "Aggregate topic for %s over %g s too long, window ignored\n", output->topic, config->window_s[i]);
+            continue;
+        }
+
+        aggregate->window_s = config->window_s[i];
+        aggregate->decimals = decimals;
+        output->aggregate_count++;
+    }
+
+    if(output->aggregate_count == 0) {
+        output->aggregates = NULL;
+    }
+
+    device->aggregate_count += output->aggregate_count;
+
+    return output->aggregate_count;
+}
+
+
+bool InitRegisterOutputs(struct VEDevice *device) {
+    device->hex_outputs = calloc(vedirect_hex_lookup_count, sizeof(struct RegisterOutput));
+    device->text_outputs = calloc(vedirect_text_lookup_count, sizeof(struct RegisterOutput));
+
+    // Enough for every window of a configured register, both as a hex and as a text register
+    device->aggregates = calloc(2 * AGGREGATE_CONFIG_COUNT * AGGREGATE_WINDOWS_MAX, sizeof(struct Aggregate));
+
+    if( (device->hex_outputs == NULL) || (device->text_outputs == NULL) || (device->aggregates == NULL) ) {
+        return false;
+    }
+
+    snprintf(device->stats_topic, TOPIC_MAX, "%s/$stats", device->topic_root);
+    snprintf(device->set_topic, TOPIC_MAX, "%s/set/+", device->topic_root);
+    snprintf(device->hex_snapshot.topic, TOPIC_MAX, "%s/snapshot/hex", device->topic_root);
+    snprintf(device->text_snapshot.topic, TOPIC_MAX, "%s/snapshot/text", device->topic_root);
+
+    for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+        device->hex_outputs[i].name = vedirect_hex_lookup[i].name;
+        snprintf(device->hex_outputs[i].topic, TOPIC_MAX, "%s/hex/%s", device->topic_root, vedirect_hex_lookup[i].name);
+        snprintf(device->hex_outputs[i].set_result_topic, TOPIC_MAX, "%s/set/%s/result", device->topic_root, vedirect_hex_lookup[i].name);
+        device->hex_outputs[i].string = ve_hex_type_info[vedirect_hex_lookup[i].type].is_string;
+        device->hex_outputs[i].decimals = MultiplierDecimals(vedirect_hex_lookup[i].multiplier);
+        device->hex_outputs[i].filter = FindPublishFilter(vedirect_hex_lookup[i].name);
+        device->hex_outputs[i].snapshot = &device->hex_snapshot;
+        InitAggregates(device, &device->hex_outputs[i], vedirect_hex_lookup[i].name, 2);
+    }
+
+    for (int i = 0; i < vedirect_text_lookup_count; i++) {
+        device->text_outputs[i].name = vedirect_text_lookup[i].name;
+        snprintf(device->text_outputs[i].topic, TOPIC_MAX, "%s/text/%s", device->topic_root, vedirect_text_lookup[i].name);
+        device->text_outputs[i].decimals = MultiplierDecimals(vedirect_text_lookup[i].multiplier);
+        device->text_outputs[i].publish = true;
+        device->text_outputs[i].filter = FindPublishFilter(vedirect_text_lookup[i].name);
+        device->text_outputs[i].snapshot = &device->text_snapshot;
+        InitAggregates(device, &device->text_outputs[i], vedirect_text_lookup[i].name, 3);
+    }
+
+    return true;
+}
+
+// Index into vedirect_text_lookup of the TEXT field holding the same value as a HEX register, -1 if none does
+int FindTextEquivalent(const char *hex_name) {
+    for (int i = 0; i < TEXT_EQUIVALENT_COUNT; i++) {
+        if( strcmp(text_equivalent_list[i].hex_name, hex_name) ) {
+            continue;
+        }
+
+        for (int j = 0; j < vedirect_text_lookup_count; j++) {
+            if( !strcmp(vedirect_text_lookup[j].name, text_equivalent_list[i].text_name) ) {
+                return j;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Resolve register addresses once and build the schedule.  Entries with unknown names are reported and left out.
+// Returns false if there is no memory for the latency histograms
+bool InitRequestSchedule(struct VEDevice *device) {
+    const struct VEDirectHexMsg *vedirect_msg;
+    struct RegisterTiming *timing;
+    double now = monotonic_timestamp();
+
+    memcpy(device->requests, periodic_request_list, sizeof(periodic_request_list));
+    device->schedule_count = 0;
+
+    for (int i = 0; i < PERIODIC_REQUEST_COUNT; i++ ) {
+        if( (vedirect_msg = ve_lookup_by_hex_name(device->requests[i].name)) != NULL ) {
+            device->requests[i].address = vedirect_msg->address;
+            device->requests[i].register_index = vedirect_msg - vedirect_hex_lookup;
+            device->requests[i].next_due_s = now;
+            device->requests[i].text_index = FindTextEquivalent(vedirect_msg->name);
+            device->hex_outputs[vedirect_msg - vedirect_hex_lookup].requested = true;
+
+            // One pass of the list fills a hex snapshot once every published register is in.  Aggregated
+            // registers never go into one
+            if( device->requests[i].publish && !device->hex_outputs[vedirect_msg - vedirect_hex_lookup].publish ) {
+                device->hex_outputs[vedirect_msg - vedirect_hex_lookup].publish = true;
+                device->hex_snapshot.fields += (device->hex_outputs[vedirect_msg - vedirect_hex_lookup].aggregates == NULL);
+            }
+
+            timing = &device->register_timing[vedirect_msg - vedirect_hex_lookup];
+            if( (timing->latency == NULL) && ((timing->latency = calloc(1, sizeof(struct Histogram))) == NULL) ) {
+                return false;
+            }
+
+            device->schedule_heap[device->schedule_count] = i;
+            device->schedule_count++;
+            ScheduleSiftUp(device, device->schedule_count - 1);
+        }
+        else {
+            fprintf(stderr, "Periodic request for unknown register \"%s\" ignored\n", device->requests[i].name);
+        }
+    }
+
+    return true;
+}
+
+// Publishes the TEXT value standing in for a periodic request on the HEX topic, formatted as the HEX value would
+// be.  Returns false, and the request is sent, unless the TEXT block brought a good value within the last period
+bool PublishTextEquivalent(struct VEDevice *device, const struct VEPeriodicRequest *request, double now) {
+    const struct VEDirectHexMsg *vedirect_msg = &vedirect_hex_lookup[request->register_index];
+    struct RegisterOutput *output = &device->hex_outputs[request->register_index];
+    struct RegisterReading reading;
+    char payload[PAYLOAD_MAX];
+    unsigned int payload_length;
+    double value;
+
+    if( (request->text_index < 0) || !RegisterStoreRead(&device->text_store, request->text_index, &reading) ||
+        (reading.quality != REGISTER_GOOD) || ((now - reading.time_s) >= request->request_period_s) ) {
+        return false;
+    }
+
+    // Rounded to the HEX register's resolution, so the store holds what was published
+    if(output->decimals >= 0) {
+        value = ScaledValue(llround(reading.value / vedirect_msg->multiplier), vedirect_msg->multiplier, output->decimals);
+        payload_length = FormatFixed(payload, llround(reading.value / vedirect_msg->multiplier), output->decimals, 2);
+    }
+    else {
+        value = reading.value;
+        payload_length = sprintf(payload, "%0.2f", reading.value);
+    }
+
+    // Read along with the TEXT block, and as old as that
+    RegisterStoreWrite(&device->hex_store, request->register_index, value, NULL, REGISTER_GOOD, reading.time_s);
+
+    // Not timed, the wait for the request to come due isn't publish latency
+    if(output->publish) {
+        PublishValue(device, output, payload, payload_length, true, value, 0);
+    }
+
+    return true;
+}
+
+// Queues every request that has come due and reschedules each one period later
+void ServiceSchedule(struct VEDevice *device, double now) {
+    struct VEPeriodicRequest *request;
+    double late_s;
+
+    while( (device->schedule_count > 0) && (device->requests[device->schedule_heap[0]].next_due_s <= now) ) {
+        request = &device->requests[device->schedule_heap[0]];
+
+        //printf("REQUEST %s [%0.3f]\r\n", request->name, (now - request->last_update_s) );
+        late_s = now - request->next_due_s;
+        request->request_count++;
+        request->total_late_s += late_s;
+        if(late_s > request->max_late_s) {
+            request->max_late_s = late_s;
+        }
+
+        request->last_update_s = now;
+
+        // Already arriving by itself, so leave the UART free for the rest
+        if( (device->register_timing[request->register_index].async_s > 0) &&
+            ((now - device->register_timing[request->register_index].async_s) < async_hold_s) ) {
+            request->async_skip_count++;
+        }
+        else if( PublishTextEquivalent(device, request, now) ) {
+            request->text_skip_count++;
+        }
+        else {
+            RequestQueuePush(&device->request_queue, request->address);
+        }
+
+        // Keep a fixed rate, but don't try to catch up on a backlog of missed periods
+        request->next_due_s += request->request_period_s;
+        if(request->next_due_s <= now) {
+            request->next_due_s = now + request->request_period_s;
+        }
+
+        ScheduleSiftDown(device, 0);
+    }
+}
+
+// Sets the device's timer for whichever comes first, the next periodic request, the deadline of the transmit side
+// or the close of an aggregate window
+void ArmDeviceTimer(struct VEDevice *device) {
+    struct itimerspec spec = {0};
+    double wake_s = 0; // Zero disarms the timer
+
+    if(device->schedule_count > 0) {
+        wake_s = device->requests[device->schedule_heap[0]].next_due_s;
+    }
+
+    if( (device->in_flight.state != TX_IDLE) && ((wake_s == 0) || (device->in_flight.deadline_s < wake_s)) ) {
+        wake_s = device->in_flight.deadline_s;
+    }
+
+    if( (device->aggregate_due_s > 0) && ((wake_s == 0) || (device->aggregate_due_s < wake_s)) ) {
+        wake_s = device->aggregate_due_s;
+    }
+
+    spec.it_value.tv_sec = (time_t)wake_s;
+    spec.it_value.tv_nsec = (long)( (wake_s - spec.it_value.tv_sec) * 1.0e9 );
+
+    if( timerfd_settime(device->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0 ) {
+        LOG(LOG_ERROR, "%s: Unable to set request timer: %s", device->path, strerror(errno));
+    }
+}
+
+// Run after anything happens on a device, moves its schedule and transmit side on and re-arms its timer
+void ServiceDevice(struct VEDevice *device) {
+    double now = monotonic_timestamp();
+
+    ServiceSchedule(device, now);
+    ServiceTransmit(device, now);
+    ServiceAggregates(device, now);
+    ArmDeviceTimer(device);
+}
+
+// Appends a device to those served.  Returns false if there is no memory for it
+bool AddDevice(const char *path, const char *topic_root) {
+    struct VEDevice *grown;
+
+    if( (grown = realloc(devices, (device_count + 1) * sizeof(struct VEDevice))) == NULL ) {
+        return false;
+    }
+
+    devices = grown;
+    memset(&devices[device_count], 0, sizeof(struct VEDevice));
+    devices[device_count].path = path;
+    devices[device_count].topic_root = topic_root;
+    TransportInit(&devices[device_count].transport, path);
+    devices[device_count].timer_fd = -1;
+    device_count++;
+
+    return true;
 }
 
-void BuildRequest(char *msg, uint16_t address) {
-    char temp[50];
-    sprintf(temp, "%c%0.2X%0.2X%0.2X", VE_CMD_GET, (uint8_t)(address & 0xFF), (uint8_t)(address >> 8), 0);
-    sprintf(msg, ":%s%0.2X\n", temp, CalculateChecksum(temp));
+// Takes "topic_root=path", or a plain path which gets the default topic root
+bool AddDeviceOption(char *option) {
+    char *separator = strchr(option, '=');
+
+    if(separator == NULL) {
+        return AddDevice(option, default_topic_root);
+    }
+
+    *separator = '\0';
+    return AddDevice(separator + 1, option);
 }
 
-void *ProcessUARTTransmitQueueThread(void *param) {
-    char message_buffer[50];
+bool InitDevice(struct VEDevice *device) {
+    if( (device->hex_register_stats = calloc(vedirect_hex_lookup_count, sizeof(struct HexFrameStatistics))) == NULL ) {
+        fprintf (stderr, "Unable to allocate register statistics\n");
+        return false;
+    }
 
-    while(running) {
-        while(request_count > 0) {
-            BuildRequest(message_buffer, request_list[request_count - 1]);
+    if( !InitRegisterOutputs(device) ) {
+        fprintf (stderr, "Unable to allocate register topics\n");
+        return false;
+    }
 
-            pthread_mutex_lock(&lock_request_list);
-            request_count--;
-            pthread_mutex_unlock(&lock_request_list);
+    if( !RegisterStoreInit(&device->hex_store, vedirect_hex_lookup_count) ||
+        !RegisterStoreInit(&device->text_store, vedirect_text_lookup_count) ) {
+        fprintf (stderr, "Unable to allocate register store\n");
+        return false;
+    }
 
-            serialPrintf(fd, "%s", message_buffer);
-            //printf("<<< <UART> %s\r\n", message_buffer);
-            usleep(min_request_period_us);
-        }
+    if( ((device->register_timing = calloc(vedirect_hex_lookup_count, sizeof(struct RegisterTiming))) == NULL) ||
+        !InitRequestSchedule(device) ) {
+        fprintf (stderr, "Unable to allocate request timing\n");
+        return false;
     }
+
+    pthread_mutex_init(&device->set_queue.lock, NULL);
+    device->stats_last_s = monotonic_timestamp();
+
+    return true;
 }
 
-void ParseTextMessage(char *msg_buf) {
-    struct VEDirectTextMsg vedirect_msg;
-    char *token;
-    const char sep[2] = "\t";
-    char reg_name[10];
-    char value_string[34];
-    long reg_value;
-    char mqtt_topic[50];
-    char mqtt_payload[50];
+// Watches the device's link for data, and for the connection being made while it is under way.  Every backend
+// opens non-blocking, so one stalled device can't hold up the others sharing the event loop
+bool WatchTransport(struct VEDevice *device, int operation) {
+    struct epoll_event event;
+
+    event.events = EPOLLIN | (device->transport.connecting ? EPOLLOUT : 0);
+    event.data.ptr = &device->uart_source;
 
-    //printf("ParseTextMessage(%s)\r\n", msg_buf); fflush(NULL);
+    return ( epoll_ctl(epoll_fd, operation, device->transport.fd, &event) == 0 );
+}
+
+// Opens the link and the request timer, and adds both to the event loop
+bool OpenDevice(struct VEDevice *device) {
+    struct epoll_event event;
 
-    token = strtok(msg_buf, sep);
-    if (token != NULL) {
-        strcpy(reg_name, token);
+    if( !TransportOpen(&device->transport) ) {
+        fprintf (stderr, "Unable to open %s device %s: %s\n", TransportName(&device->transport), device->path,
+                 ((errno == EINVAL) && !strcmp(TransportName(&device->transport), "file")) ?
+                     "Regular files can't be waited on, replay a capture with -r" : strerror(errno));
+        return false;
     }
 
-    token = strtok(NULL, sep);
-    if (token != NULL) {
-        strcpy(value_string, token);
-        reg_value = atoi(value_string);
+    if( (device->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ) {
+        fprintf (stderr, "Unable to create request timer for %s: %s\n", device->path, strerror(errno));
+        return false;
     }
 
-    //DEBUG//printf("%s = %d\r\n", reg_name, reg_value); fflush(NULL);
+    device->uart_source.type = EVENT_UART;
+    device->uart_source.device = device;
+    device->timer_source.type = EVENT_TIMER;
+    device->timer_source.device = device;
 
-    if( ve_lookup_by_text_name(&vedirect_msg, reg_name) ) {
-        switch(vedirect_msg.type) {
+    if( !WatchTransport(device, EPOLL_CTL_ADD) ) {
+        fprintf (stderr, "Unable to watch device %s: %s\n", device->path, strerror(errno));
+        return false;
+    }
 
-            case VE_TYPE_TXT_FLOAT:
-                //DEBUG//printf("--> Found %s = %0.3f\r\n", vedirect_msg.name, reg_value * vedirect_msg.multiplier); fflush(NULL);
+    event.events = EPOLLIN;
+    event.data.ptr = &device->timer_source;
+    if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device->timer_fd, &event) < 0 ) {
+        fprintf (stderr, "Unable to watch request timer for %s: %s\n", device->path, strerror(errno));
+        return false;
+    }
 
-                if( !strcmp(value_string, "---") ) {
-                    sprintf(mqtt_payload, ""); // TODO: This might not be the best way to indicate invalid data
-                }
-                else {
-                    sprintf(mqtt_payload, "%0.3f", reg_value * vedirect_msg.multiplier);
-                }
-                break;
+    return true;
+}
 
-            case VE_TYPE_TXT_INT:
-                //DEBUG//printf("--> Found %s = %0.3f\r\n", vedirect_msg.name, reg_value * vedirect_msg.multiplier); fflush(NULL);
+// Called from the statistics timer, which sets the pace of attempts
+void ReconnectDevice(struct VEDevice *device) {
+    if(device->transport.fd >= 0) {
+        return;
+    }
 
-                if( !strcmp(value_string, "---") ) {
-                    sprintf(mqtt_payload, ""); // TODO: This might not be the best way to indicate invalid data
-                }
-                else {
-                    sprintf(mqtt_payload, "%ld", reg_value);
-                }
-                break;
+    if( !TransportOpen(&device->transport) ) {
+        LOG(LOG_DEBUG, "%s: Unable to reopen: %s", device->path, strerror(errno));
+        return;
+    }
 
-            case VE_TYPE_TXT_BOOL:
-                //DEBUG//printf("--> Found %s = %s\r\n", vedirect_msg.name, value_string); fflush(NULL);
+    if( !WatchTransport(device, EPOLL_CTL_ADD) ) {
+        LOG(LOG_ERROR, "%s: Unable to watch device: %s", device->path, strerror(errno));
+        TransportClose(&device->transport);
+        return;
+    }
 
-                if( !strcmp(value_string, "ON") ) {
-                    sprintf(mqtt_payload, "1");
-                }
-                else if( !strcmp(value_string, "OFF") ) {
-                    sprintf(mqtt_payload, "0");
-                }
-                else {
-                    sprintf(mqtt_payload, ""); // TODO: This might not be the best way to indicate invalid data
-                }
+    if( !device->transport.connecting ) {
+        LOG((device->link_losses > 1) ? LOG_DEBUG : LOG_WARNING, "%s: Reopened the %s link", device->path,
+            TransportName(&device->transport));
+    }
+}
 
-                break;
-        }
+// A TCP connection started by OpenDevice() or ReconnectDevice() has been made, or has failed
+void FinishConnect(struct VEDevice *device) {
+    if( !TransportConnected(&device->transport) ) {
+        // Closing the descriptor took it out of the event loop
+        device->link_losses++;
+        LOG((device->link_losses == 1) ? LOG_ERROR : LOG_DEBUG, "%s: Unable to connect: %s, trying again every %u s",
+            device->path, strerror(errno), stats_period_s);
+        return;
+    }
 
-        sprintf(mqtt_topic, "%s/text/%s", bmv_topic_root, vedirect_msg.name);
+    // Only reading from here on
+    if( !WatchTransport(device, EPOLL_CTL_MOD) ) {
+        LoseDevice(device, strerror(errno));
+        return;
+    }
 
-        printf("<<< <MQTT> Publish %s = %s\r\n", mqtt_topic, mqtt_payload); fflush(NULL);
-        mosquitto_publish(mqtt, NULL, mqtt_topic, strlen(mqtt_payload), mqtt_payload, 0, false);
+    if(device->transport.stats.connects == 1) {
+        LOG(LOG_INFO, "%s: Connected", device->path);
     }
     else {
-        //DEBUG//printf("--> NOT FOUND %s\r\n", reg_name); fflush(NULL);
+        LOG((device->link_losses > 1) ? LOG_DEBUG : LOG_WARNING, "%s: Reopened the %s link", device->path,
+            TransportName(&device->transport));
     }
-
 }
 
-void ParseHexMessage(char *msg_buf) {
-    double now;
-    struct VEDirectHexMsg vedirect_msg;
-    unsigned int msg_len;
-    char c;
-    unsigned int address = 0;
-    uint8_t flags = 0;
-    char string_data[33];
-    double data = 0;
-    char mqtt_topic[50];
-    char mqtt_payload[50];
+// Every device's $stats goes out together from the event loop, where the counters are written
+bool OpenStatisticsTimer(void) {
+    static struct EventSource stats_source = { EVENT_STATS, NULL };
+    struct itimerspec spec = {0};
+    struct epoll_event event;
 
-    //printf("ParseHexMessage(%s)\r\n", msg_buf);
+    spec.it_value.tv_sec = stats_period_s;
+    spec.it_interval.tv_sec = stats_period_s;
 
-    now = timestamp(); // Calculate/display time between request being sent and receipt of message
-    msg_len = strlen(msg_buf);
+    if( ((stats_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) ||
+        (timerfd_settime(stats_timer_fd, 0, &spec, NULL) < 0) ) {
+        return false;
+    }
 
-    // Smallest valid message contains one command char plus four hex digts of address
-    if(msg_len >= 5) {
+    event.events = EPOLLIN;
+    event.data.ptr = &stats_source;
 
-        c = *msg_buf;
+    return ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_timer_fd, &event) == 0 );
+}
 
-        // TODO: Verify checksum
+// Waited on by the publisher thread, which owns the journal
+bool OpenJournalTimer(void) {
+    struct itimerspec spec = {0};
 
-        if(c == VE_RSP_GET) {
-            msg_buf++;
+    spec.it_value.tv_nsec = journal_drain_period_ms * 1000000L;
+    spec.it_interval.tv_nsec = journal_drain_period_ms * 1000000L;
 
-            address = ( asciiHexToInt(*(msg_buf + 0)) << 4 ) +
-                      ( asciiHexToInt(*(msg_buf + 1)) << 0 ) +
-                      ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                      ( asciiHexToInt(*(msg_buf + 3)) << 8 );
+    return ( ((journal_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0) &&
+             (timerfd_settime(journal_timer_fd, 0, &spec, NULL) == 0) );
+}
 
-            if( ve_lookup_by_hex_address(&vedirect_msg, address) ) {
+// Lets the MQTT thread wake the event loop when it queues a SET, see MessageCallback()
+bool OpenSetEvent(void) {
+    static struct EventSource set_source = { EVENT_SET, NULL };
+    struct epoll_event event;
 
-                //printf("Parsing data from %s [%0.4x], length = %d\r\n", vedirect_msg.name, address, msg_len);
+    if( (set_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        return false;
+    }
 
-                msg_buf += 4; // Advance to the start of flags
+    event.events = EPOLLIN;
+    event.data.ptr = &set_source;
 
-                if(msg_len >= 7) {
-                    flags = ( asciiHexToInt(*(msg_buf + 0)) << 4 ) +
-                            ( asciiHexToInt(*(msg_buf + 1)) << 0 );
+    return ( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, set_event_fd, &event) == 0 );
+}
 
-                    //printf("Flags: %d\r\n", flags);
+void CloseDevice(struct VEDevice *device) {
+    if(device->timer_fd >= 0) {
+        close(device->timer_fd);
+    }
 
-                    if(flags == 0) {
-                        msg_buf += 2; // Point to the start of data bytes
+    TransportClose(&device->transport);
 
-                        switch(vedirect_msg.type) {
-                            case VE_TYPE_NONE:
-                                return;
-                            break;
-
-                            case VE_TYPE_UN8:
-                                if(msg_len >= 9) {
-                                    data = (uint8_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 1)) << 0 ) );
-                                }
-
-                            break;
-
-                            case VE_TYPE_SN8:
-                                if(msg_len >= 9) {
-                                    data = (int8_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4 ) +
-                                                     ( asciiHexToInt(*(msg_buf + 1)) << 0 ) );
-                                }
-                            break;
-
-                            case VE_TYPE_UN16:
-                                if(msg_len >= 11) {
-                                    data = (uint16_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 1)) << 0  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 3)) << 8  ) );
-                                }
-
-                            break;
-
-                            case VE_TYPE_SN16:
-                                if(msg_len >= 11) {
-                                    data = (int16_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4  ) +
-                                                      ( asciiHexToInt(*(msg_buf + 1)) << 0  ) +
-                                                      ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 3)) << 8  ) );
-                                }
-                            break;
-
-                            case VE_TYPE_UN24:
-                                if(msg_len >= 13) {
-                                    data = (uint32_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 1)) << 0  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 3)) << 8  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 4)) << 20 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 5)) << 16 ) );
-                                }
-                            break;
-
-                            //case VE_TYPE_SN24:
-                            //break;
-
-                            case VE_TYPE_UN32:
-                                if(msg_len >= 15) {
-                                    data = (uint32_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 1)) << 0  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 3)) << 8  ) +
-                                                       ( asciiHexToInt(*(msg_buf + 4)) << 20 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 5)) << 16 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 6)) << 28 ) +
-                                                       ( asciiHexToInt(*(msg_buf + 7)) << 24 ) );
-                                }
-                            break;
-
-                            case VE_TYPE_SN32:
-                                if(msg_len >= 15) {
-                                    data = (int32_t)( ( asciiHexToInt(*(msg_buf + 0)) << 4  ) +
-                                                      ( asciiHexToInt(*(msg_buf + 1)) << 0  ) +
-                                                      ( asciiHexToInt(*(msg_buf + 2)) << 12 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 3)) << 8  ) +
-                                                      ( asciiHexToInt(*(msg_buf + 4)) << 20 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 5)) << 16 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 6)) << 28 ) +
-                                                      ( asciiHexToInt(*(msg_buf + 7)) << 24 ) );
-                                }
-                            break;
-
-                            case VE_TYPE_STR20:
-                            break;
-
-                            case VE_TYPE_STR32:
-                            break;
+    free(device->hex_register_stats);
 
-                        }
+    if(device->register_timing != NULL) {
+        for (int i = 0; i < vedirect_hex_lookup_count; i++) {
+            free(device->register_timing[i].latency);
+        }
+        free(device->register_timing);
+    }
+    free(device->hex_outputs);
+    free(device->text_outputs);
+    free(device->aggregates);
+    RegisterStoreFree(&device->hex_store);
+    RegisterStoreFree(&device->text_store);
+    pthread_mutex_destroy(&device->set_queue.lock);
+}
 
-                        data *= vedirect_msg.multiplier;
-                        //printf("Parsing data from %s [%0.4X] = %0.3f\r\n", vedirect_msg.name, address, data);
+// The one thread that serves every device.  UART data and the per-device timers are all waited on here,
+// so adding devices adds file descriptors rather than threads
+void *ProcessDevicesThread(void *param) {
+    struct epoll_event events[EVENT_BATCH_MAX];
+    struct EventSource *source;
+    uint64_t expirations;
+    int count;
+
+    // Start every schedule, the first requests are due straight away
+    for (unsigned int i = 0; i < device_count; i++) {
+        ServiceDevice(&devices[i]);
+    }
 
-                        // Find the entry in periodic request list to see whether it should be published
-                        for (int i = 0; i < ( sizeof(periodic_request_list) / sizeof(struct VEPeriodicRequest) ); i++ ) {
-                            if( !strcmp(periodic_request_list[i].name, vedirect_msg.name) ) {
-                                if( periodic_request_list[i].publish ) {
-                                    sprintf(mqtt_topic, "%s/hex/%s", bmv_topic_root, vedirect_msg.name);
-                                    sprintf(mqtt_payload, "%0.2f", data);
+    while(running) {
+        count = epoll_wait(epoll_fd, events, EVENT_BATCH_MAX, EVENT_WAIT_MS);
 
-                                    printf("<<< <MQTT> Publish %s = %s\r\n", mqtt_topic, mqtt_payload); fflush(NULL);
-                                    mosquitto_publish(mqtt, NULL, mqtt_topic, strlen(mqtt_payload), mqtt_payload, 0, false);
-                                }
-                            }
-                        }
+        for (int i = 0; i < count; i++) {
+            source = events[i].data.ptr;
 
+            if(source->type == EVENT_STATS) {
+                if( read(stats_timer_fd, &expirations, sizeof(expirations)) >= 0 ) {
+                    for (unsigned int j = 0; j < device_count; j++) {
+                        PublishDeviceStatistics(&devices[j]);
+                        ReconnectDevice(&devices[j]);
+                    }
+                }
+                continue;
+            }
+            else if(source->type == EVENT_SET) {
+                // Which device the SET was for doesn't matter, any that is free to send picks it up
+                if( read(set_event_fd, &expirations, sizeof(expirations)) >= 0 ) {
+                    for (unsigned int j = 0; j < device_count; j++) {
+                        AnswerRejectedSets(&devices[j]);
+                        ServiceDevice(&devices[j]);
                     }
                 }
+                continue;
+            }
+            else if(source->type == EVENT_TIMER) {
+                // Clears the expiry, how many there were doesn't matter
+                if( read(source->device->timer_fd, &expirations, sizeof(expirations)) < 0 ) {
+                    continue;
+                }
+            }
+            else if(source->device->transport.connecting) {
+                FinishConnect(source->device);
+                continue;
             }
+            else {
+                ReadDevice(source->device, (events[i].events & (EPOLLERR | EPOLLHUP)) != 0);
+            }
+
+            ServiceDevice(source->device);
+        }
+
+        if(dump_statistics) {
+            dump_statistics = 0;
+            PrintStatistics();
         }
     }
+
+    return NULL;
 }
 
-void *ProcessReceiveThread(void *param) {
-    static char message_buffer[50] = {0};
-    static enum ReceiveState receive_state = GET_START_CHAR;
-    char c;
+// Hands queued messages to the MQTT client and drains the journal, so neither a slow broker nor a slow disk
+// holds up reading the devices.  Once they are no longer read it empties the queue and stops
+void *PublisherThread(void *param) {
+    struct pollfd waits[3] = { { publish_queue.event_fd, POLLIN, 0 }, { large_queue.event_fd, POLLIN, 0 }, { journal_timer_fd, POLLIN, 0 } };
+    uint64_t expirations;
+    int count;
 
-    while(running) {
+    for (;;) {
+        DrainPublishQueue();
+
+        if(!publishing) {
+            break;
+        }
 
-        if(serialDataAvail(fd)) {
+        if( !PublishQueuePrepareWait(&publish_queue) || !PublishQueuePrepareWait(&large_queue) ) {
+            continue;
+        }
 
-            c = serialGetchar(fd);
+        count = poll(waits, (journal_timer_fd >= 0) ? 3 : 2, EVENT_WAIT_MS);
+        PublishQueueClearEvent(&publish_queue);
+        PublishQueueClearEvent(&large_queue);
 
-            //DEBUG
-            //if ( isprint(c) ) {
-            //    printf( "%c", c );
-            //}
-            //else {
-            //    printf( "<%0.2X>", (uint8_t)c );
-            //}
-            //
-            //fflush(NULL);
+        if( (count > 0) && (waits[2].revents & POLLIN) && (read(journal_timer_fd, &expirations, sizeof(expirations)) >= 0) ) {
+            DrainJournal();
+        }
+    }
 
-            switch(receive_state) {
+    return NULL;
+}
 
-                case GET_START_CHAR:
+// Serves scrapes until shutdown.  Never touches the devices beyond reading them, see RenderMetrics()
+void *MetricsThread(void *param) {
+    while(running) {
+        MetricsServerPoll(&metrics_server, EVENT_WAIT_MS);
+    }
 
-                    if( c  == ':' ) {
-                        //DEBUG//printf("<SOL>");
-                        strncpy(message_buffer, "", sizeof(message_buffer));
-                        receive_state = GET_HEX_DATA;
-                    }
-                    else if( c == '\n') {
-                        strncpy(message_buffer, "", sizeof(message_buffer));
-                        receive_state = GET_TEXT_DATA;
-                    }
-                break;
+    return NULL;
+}
 
-                case GET_HEX_DATA:
+double CpuSeconds(void) {
+    struct rusage usage;
 
-                    if( isprint(c) ) {
-                        // Valid data, save/buffer it for later
-                        //DEBUG//printf("%c", c);
-                        strncat(message_buffer, &c, 1);
-                    }
-                    else if( c == '\n' ) {
-                        //DEBUG//printf("<EOL>\r\n");
-                        ParseHexMessage(message_buffer);
-                        receive_state = GET_START_CHAR;
-                    }
-                    else if( c == ':' ) {
-                        // ERROR - expected ETX before STX
-                        //printf("<UART> ERROR: New packet began before previous packet finished\r\n");
-                        strncpy(message_buffer, "", sizeof(message_buffer));
-                    }
-                break;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec / 1.0e6) + usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec / 1.0e6);
+}
 
-                case GET_TEXT_DATA:
+// Decodes one capture line into the device's ring, just as read() would have filled it.  Returns false if malformed
+bool ReplayBatch(const char *line, double *offset_s, struct VEDevice **device) {
+    struct RxRingBuffer *ring;
+    unsigned int index;
+    unsigned int count = 0;
+    int consumed;
 
-                    if( c == '\r' ) {
-                        //DEBUG//printf("<EOL>\r\n");
-                        ParseTextMessage(message_buffer);
-                        receive_state = GET_START_CHAR;
-                    }
-                    else if( c == '\n' ) {
-                        //printf("<UART> ERROR: New packet began before previous packet finished\r\n");
-                        strncpy(message_buffer, "", sizeof(message_buffer));
-                    }
-                    else if( c == ':' ) {
-                        receive_state = GET_HEX_DATA;
-                        strncpy(message_buffer, "", sizeof(message_buffer));
-                    }
-                    else {
-                        strncat(message_buffer, &c, 1);
-                    }
-                break;
+    if( (sscanf(line, "%lf %u %n", offset_s, &index, &consumed) < 2) || (index >= device_count) ) {
+        return false;
+    }
 
-            }
-        }
+    *device = &devices[index];
+    ring = &devices[index].rx_ring;
+    line += consumed;
+
+    // The ring is always drained between batches, so a whole read fits
+    while( (count < RX_RING_SIZE) && isxdigit((unsigned char)line[0]) && isxdigit((unsigned char)line[1]) ) {
+        ring->data[(ring->head + count) & (RX_RING_SIZE - 1)] = (ve_hex_nibble[(uint8_t)line[0]] << 4) | ve_hex_nibble[(uint8_t)line[1]];
+        line += 2;
+        count++;
     }
+
+    RecordReadBatch(&(*device)->rx_stats, count);
+    ring->head += count;
+
+    return true;
 }
 
-void *ProcessVEDirectRequestThread(void *param) {
+// Runs in place of the event loop when replaying.  Feeds the capture through the same receive, parse and publish
+// path as live data, reports throughput and then stops the daemon
+void *ProcessReplayThread(void *param) {
+    static char line[CAPTURE_LINE_MAX];
+    struct VEDevice *device;
+    struct timespec wake;
+    double start_s;
+    double cpu_start_s;
+    double offset_s;
+    double pass_offset_s = 0;
+    double last_offset_s = 0;
+    double wake_s;
     double now;
-    char message_buffer[50] = {0};
-    struct VEDirectHexMsg vedirect_msg;
+    double elapsed_s;
+    double cpu_s;
+    unsigned long allocations_start = (&allocation_count != NULL) ? allocation_count : 0;
+    unsigned long records = 0;
+    unsigned long skipped = 0;
+    unsigned long frames = 0;
+    unsigned long published = 0;
+
+    start_s = monotonic_timestamp();
+    cpu_start_s = CpuSeconds();
+
+    for (unsigned int pass = 0; running && (pass < replay_repeat); pass++) {
+        rewind(replay_file);
+        pass_offset_s = last_offset_s;
+
+        while( running && (fgets(line, sizeof(line), replay_file) != NULL) ) {
+            if( (line[0] == '#') || (line[0] == '\n') ) {
+                continue;
+            }
 
-    while(running) {
-        // TODO: Replace the static structure with a dynamic one
-        for (int i = 0; i < ( sizeof(periodic_request_list) / sizeof(struct VEPeriodicRequest) ); i++ ) {
+            if( !ReplayBatch(line, &offset_s, &device) ) {
+                skipped++;
+                continue;
+            }
 
-            now = timestamp();
+            // Sleep in short steps so that a long gap in the capture doesn't hold up shutdown
+            while( !replay_fast && running && ((now = monotonic_timestamp()) < (start_s + pass_offset_s + offset_s)) ) {
+                wake_s = fmin(start_s + pass_offset_s + offset_s, now + (EVENT_WAIT_MS / 1000.0));
+                wake.tv_sec = (time_t)wake_s;
+                wake.tv_nsec = (long)( (wake_s - wake.tv_sec) * 1.0e9 );
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+            }
 
-            //printf("%0.6f> %s [%0.3f]\r\n", now, periodic_request_list[i].name, (now - periodic_request_list[i].last_update_s) );
-            if( (now - periodic_request_list[i].last_update_s) >= periodic_request_list[i].request_period_s ) {
+            device->rx_time_s = monotonic_timestamp();
+            DrainRxRing(device);
+            last_offset_s = pass_offset_s + offset_s;
+            records++;
 
-                //printf("REQUEST %s [%0.3f]\r\n", periodic_request_list[i].name, (now - periodic_request_list[i].last_update_s) );
-                periodic_request_list[i].last_update_s = now;
+            if(dump_statistics) {
+                dump_statistics = 0;
+                PrintStatistics();
+            }
+        }
+    }
 
-                if( ve_lookup_by_hex_name(&vedirect_msg, periodic_request_list[i].name) ) {
+    elapsed_s = monotonic_timestamp() - start_s;
+    cpu_s = CpuSeconds() - cpu_start_s;
 
-                    pthread_mutex_lock(&lock_request_list);
-                    if( request_count < (sizeof(request_list) - 1) ) {
-                        request_count++;
-                        request_list[request_count-1] = vedirect_msg.address;
-                    }
-                    pthread_mutex_unlock(&lock_request_list);
+    for (unsigned int i = 0; i < device_count; i++) {
+        frames += DeviceFrames(&devices[i]);
 
-                }
-                // TODO: else name is invalid and should be removed or user signalled
-            }
+        for (int j = 0; j < vedirect_hex_lookup_count; j++) {
+            published += devices[i].hex_outputs[j].publish_count;
+        }
+        for (int j = 0; j < vedirect_text_lookup_count; j++) {
+            published += devices[i].text_outputs[j].publish_count;
         }
+
+        published += devices[i].hex_snapshot.publish_count + devices[i].text_snapshot.publish_count;
+    }
+
+    printf("Replay: %lu reads (%lu malformed), %lu frames, %lu published in %0.3f s\r\n", records, skipped, frames, published, elapsed_s);
+    printf("Replay: %0.0f frames/s, %0.3f us CPU/frame\r\n",
+           elapsed_s > 0 ? (frames / elapsed_s) : 0.0, frames ? (1.0e6 * cpu_s / frames) : 0.0);
+
+    if(&allocation_count != NULL) {
+        printf("Replay: %0.3f allocations/frame\r\n", frames ? ( (double)(allocation_count - allocations_start) / frames ) : 0.0);
     }
+
+    fflush(NULL);
+    running = 0;
+
+    return NULL;
 }
 
 void SignalHandler(int signum)
@@ -488,20 +3350,239 @@ void SignalHandler(int signum)
     running = 0;
 }
 
-int main ()
+void StatisticsSignalHandler(int signum)
+{
+    dump_statistics = 1;
+}
+
+// The benchmarks and the fuzzer include this file with VEDIRECT_NO_MAIN defined, to drive the parsing directly
+#ifndef VEDIRECT_NO_MAIN
+void Usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-a] [-v] [-w] [-b broker] [-o format] [-q policy] [-m [host:]port] [-j journal [-J size]] [-c capture | -r capture [-f] [-n count]] [-d [topic_root=]device]...\n", program);
+    fprintf(stderr, "  -a  Publish every value received, even if unchanged\n");
+    fprintf(stderr, "  -b  MQTT broker host (default %s)\n", mqtt_host);
+    fprintf(stderr, "  -c  Capture everything received from the devices to a file\n");
+    fprintf(stderr, "  -d  Serial device to serve, may be repeated (default %s=%s)\n", default_topic_root, default_device_path);
+    fprintf(stderr, "  -f  Replay as fast as possible rather than at the captured pace\n");
+    fprintf(stderr, "  -j  Keep messages in this file while the broker can't be reached, and send them once it is back\n");
+    fprintf(stderr, "  -J  Journal size in MB (default %u)\n", journal_size_mb);
+    fprintf(stderr, "  -m  Serve OpenMetrics for Prometheus on http://host:port/metrics (host defaults to 127.0.0.1)\n");
+    fprintf(stderr, "  -n  Number of times to replay the capture\n");
+    fprintf(stderr, "  -o  Output format: topics, one topic per value (default), or json or cbor, one snapshot per TEXT block\n");
+    fprintf(stderr, "      and per pass of the request list on <topic_root>/snapshot/text and <topic_root>/snapshot/hex\n");
+    fprintf(stderr, "  -q  When the publish queue is full: drop, the oldest message (default), or coalesce, replace the waiting\n");
+    fprintf(stderr, "      message for the same topic\n");
+    fprintf(stderr, "  -r  Replay a capture in place of the devices, then exit.  Devices are taken in the order given with -d\n");
+    fprintf(stderr, "  -v  Verbose, log every published value\n");
+    fprintf(stderr, "  -w  Allow SETs over MQTT that wipe the device's settings or history (restore_defaults, clear_history)\n");
+}
+
+int main (int argc, char *argv[])
 {
     int status;
+    int option;
     char client_id[30];
     char message_buffer[50] = {0};
+    const char *capture_path = NULL;
+    const char *replay_path = NULL;
+    const char *journal_path = NULL;
+    double journal_synced_s;
+    unsigned int metrics_body_max;
+
+    while( (option = getopt(argc, argv, "ab:c:d:fj:J:m:n:o:q:r:vw")) != -1 ) {
+        switch(option) {
+            case 'a':
+                publish_all = true;
+            break;
+
+            case 'b':
+                mqtt_host = optarg;
+            break;
+
+            case 'c':
+                capture_path = optarg;
+            break;
+
+            case 'd':
+                if( !AddDeviceOption(optarg) ) {
+                    fprintf (stderr, "Unable to allocate device\n");
+                    return 1;
+                }
+            break;
+
+            case 'f':
+                replay_fast = true;
+            break;
+
+            case 'j':
+                journal_path = optarg;
+            break;
+
+            case 'J':
+                journal_size_mb = strtoul(optarg, NULL, 10);
+            break;
+
+            case 'm':
+                metrics_address = optarg;
+            break;
+
+            case 'n':
+                replay_repeat = strtoul(optarg, NULL, 10);
+            break;
+
+            case 'o':
+                if( !strcmp(optarg, "json") ) {
+                    snapshot_output = true;
+                    snapshot_format = SNAPSHOT_JSON;
+                }
+                else if( !strcmp(optarg, "cbor") ) {
+                    snapshot_output = true;
+                    snapshot_format = SNAPSHOT_CBOR;
+                }
+                else if( strcmp(optarg, "topics") ) {
+                    Usage(argv[0]);
+                    return 1;
+                }
+            break;
+
+            case 'q':
+                if( !strcmp(optarg, "drop") ) {
+                    publish_overflow = PUBLISH_DROP_OLDEST;
+                }
+                else if( !strcmp(optarg, "coalesce") ) {
+                    publish_overflow = PUBLISH_COALESCE;
+                }
+                else {
+                    Usage(argv[0]);
+                    return 1;
+                }
+            break;
+
+            case 'r':
+                replay_path = optarg;
+            break;
+
+            case 'v':
+                log_level = LOG_DEBUG;
+            break;
+
+            case 'w':
+                destructive_sets = true;
+            break;
+
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if( ((capture_path != NULL) || (journal_path != NULL)) && (replay_path != NULL) ) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    if( (device_count == 0) && !AddDevice(default_device_path, default_topic_root) ) {
+        fprintf (stderr, "Unable to allocate device\n");
+        return 1;
+    }
+
+    // Devices publish side by side, so each needs a topic root of its own
+    for (unsigned int i = 0; i < device_count; i++) {
+        if( (devices[i].path[0] == '\0') || (devices[i].topic_root[0] == '\0') ) {
+            Usage(argv[0]);
+            return 1;
+        }
+
+        for (unsigned int j = 0; j < i; j++) {
+            if( !strcmp(devices[i].topic_root, devices[j].topic_root) ) {
+                fprintf (stderr, "Topic root \"%s\" is used by more than one device\n", devices[i].topic_root);
+                return 1;
+            }
+        }
+    }
 
     signal(SIGINT, SignalHandler);
     signal(SIGHUP, SignalHandler);
     signal(SIGTERM, SignalHandler);
+    signal(SIGUSR1, StatisticsSignalHandler);
+
+    ve_lookup_init();
+
+    // SETUP UARTS, unless they are being replayed from a capture
+    if( (epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ) {
+        fprintf (stderr, "Unable to create event loop: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        if( !InitDevice(&devices[i]) || ((replay_path == NULL) && !OpenDevice(&devices[i])) ) {
+            return 1;
+        }
+    }
+
+    if( (replay_path == NULL) && !OpenStatisticsTimer() ) {
+        fprintf (stderr, "Unable to create statistics timer: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if( (replay_path == NULL) && !OpenSetEvent() ) {
+        fprintf (stderr, "Unable to create SET event: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if(journal_path != NULL) {
+        if( !JournalOpen(&journal, journal_path, (uint64_t)journal_size_mb << 20) ) {
+            fprintf (stderr, "Unable to open journal %s: %s\n", journal_path, strerror(errno));
+            return 1;
+        }
+
+        if( !OpenJournalTimer() ) {
+            fprintf (stderr, "Unable to create journal timer: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    // A replay has no device to fall behind, so it waits for room rather than lose messages
+    if( !PublishQueueInit(&publish_queue, PUBLISH_QUEUE_BYTES, snapshot_output ? SNAPSHOT_MAX : PUBLISH_PAYLOAD_MAX,
+                          (replay_path != NULL) ? PUBLISH_WAIT : publish_overflow) ) {
+        fprintf (stderr, "Unable to create publish queue: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if( !PublishQueueInit(&large_queue, LARGE_QUEUE_BYTES, STATS_PAYLOAD_MAX, PUBLISH_COALESCE) ) {
+        fprintf (stderr, "Unable to create publish queue: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if(metrics_address != NULL) {
+        if( (metrics_body_max = MetricsBodySize()) == 0 ) {
+            fprintf (stderr, "Unable to size metrics buffer\n");
+            return 1;
+        }
+
+        if( !MetricsServerOpen(&metrics_server, metrics_address, metrics_body_max, RenderMetrics, NULL) ) {
+            fprintf (stderr, "Unable to serve metrics on %s: %s\n", metrics_address, strerror(errno));
+            return 1;
+        }
+    }
+
+    if( (replay_path != NULL) && ((replay_file = fopen(replay_path, "r")) == NULL) ) {
+        fprintf (stderr, "Unable to open capture %s: %s\n", replay_path, strerror(errno));
+        return 1;
+    }
 
-    // SETUP UART
-    if ((fd = serialOpen ("/dev/ttyS0", 19200)) < 0) {
-            fprintf (stderr, "Unable to open serial device: %s\n", strerror(errno));
+    if(capture_path != NULL) {
+        if( (capture_file = fopen(capture_path, "w")) == NULL ) {
+            fprintf (stderr, "Unable to create capture %s: %s\n", capture_path, strerror(errno));
             return 1;
+        }
+
+        fprintf(capture_file, "# VE.Direct capture: seconds, device, bytes read in hex\n");
+        for (unsigned int i = 0; i < device_count; i++) {
+            fprintf(capture_file, "# device %u %s=%s\n", i, devices[i].topic_root, devices[i].path);
+        }
+
+        capture_start_s = monotonic_timestamp();
     }
 
     // SETUP MQTT
@@ -509,33 +3590,46 @@ int main ()
     snprintf(client_id, sizeof(client_id)-1, "offgrid-daemon-%d", getpid());
 
     if( (mqtt = mosquitto_new(client_id, true, NULL)) != NULL ) { // TODO: Replace NULL with pointer to data structure 
-        //mosquitto_connect_callback_set(mqtt, connect_callback);
-        //mosquitto_message_callback_set(mqtt, message_callback);
-
-        if( (mosquitto_connect(mqtt, mqtt_host, mqtt_port, 15)) == MOSQ_ERR_SUCCESS ) {
-            //mosquitto_subscribe(mqtt, NULL, "og/#", 0);
-            mosquitto_loop_start(mqtt);
-        }
-        else {
-                    fprintf (stderr, "Unable to connect with MQTT broker (%s:%s): %s\n", mqtt_host, mqtt_port, strerror(errno));
+        mosquitto_connect_callback_set(mqtt, ConnectCallback);
+        mosquitto_disconnect_callback_set(mqtt, DisconnectCallback);
+        mosquitto_publish_callback_set(mqtt, PublishCallback);
+        mosquitto_message_callback_set(mqtt, MessageCallback);
+
+        // The network thread reconnects by itself, whether the first attempt worked or not
+        mosquitto_reconnect_delay_set(mqtt, 1, 30, true);
+
+        // Subscriptions are made by ConnectCallback()
+        if( (status = mosquitto_connect(mqtt, mqtt_host, mqtt_port, 15)) != MOSQ_ERR_SUCCESS ) {
+            fprintf (stderr, "Unable to connect with MQTT broker (%s:%u), will keep trying: %s\n", mqtt_host, mqtt_port,
+                     (status == MOSQ_ERR_ERRNO) ? strerror(errno) : mosquitto_strerror(status));
         }
+
+        mosquitto_loop_start(mqtt);
     }
     else {
-                fprintf (stderr, "Unable to create MQTT client: %s\n", strerror(errno));
+        fprintf (stderr, "Unable to create MQTT client: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if( !LogStart() ) {
+        fprintf (stderr, "Unable to start logging thread\n");
+        return 1;
+    }
+
+    if( (errno = pthread_create(&publisher_thread, NULL, PublisherThread, NULL)) != 0 ) {
+        fprintf (stderr, "Unable to start publisher thread: %s\n", strerror(errno));
         return 1;
     }
 
-    if(pthread_mutex_init(&lock_request_list, NULL) != 0) {
-        fprintf (stderr, "Mutex initialization failed\n");
+    if( (metrics_address != NULL) && ((errno = pthread_create(&metrics_thread, NULL, MetricsThread, NULL)) != 0) ) {
+        fprintf (stderr, "Unable to start metrics thread: %s\n", strerror(errno));
         return 1;
     }
 
     // TODO: Add error checking for thread creation
-    pthread_create(&process_rx_thread, NULL, ProcessReceiveThread, NULL);
-    pthread_create(&process_rq_thread, NULL, ProcessVEDirectRequestThread, NULL);
-    pthread_create(&process_tx_thread, NULL, ProcessUARTTransmitQueueThread, NULL);
+    pthread_create(&process_devices_thread, NULL, (replay_file != NULL) ? ProcessReplayThread : ProcessDevicesThread, NULL);
 
-    serialFlush(fd);
+    journal_synced_s = monotonic_timestamp();
 
     while(running) {
 
@@ -562,27 +3656,67 @@ int main ()
 
         usleep(min_request_period_us);
 */
-        if(running && status) {
-            mosquitto_reconnect(mqtt);
+        if( (journal.fd >= 0) && ((monotonic_timestamp() - journal_synced_s) >= journal_sync_s) ) {
+            JournalSync(&journal);
+            journal_synced_s = monotonic_timestamp();
         }
 
         sleep(1);
         sd_notify(0, "WATCHDOG=1");
     }
 
-    printf("Waiting for threads to terminate...\r\n");
-    fflush(NULL);
+    LOG(LOG_INFO, "Waiting for threads to terminate...");
+
+    pthread_join(process_devices_thread, NULL);
 
-    pthread_join(process_rx_thread, NULL);
-    pthread_join(process_rq_thread, NULL);
-    pthread_join(process_tx_thread, NULL);
+    if(metrics_address != NULL) {
+        pthread_join(metrics_thread, NULL);
+    }
 
-    pthread_mutex_destroy(&lock_request_list);
+    // Nothing more will be queued, let the publisher send what is left
+    publishing = 0;
+    pthread_join(publisher_thread, NULL);
 
-    printf("...Threads terminated\r\n");
-    fflush(NULL);
+    LOG(LOG_INFO, "...Threads terminated");
+    LogStop();
+
+    PrintStatistics();
+
+    for (unsigned int i = 0; i < device_count; i++) {
+        CloseDevice(&devices[i]);
+    }
+
+    free(devices);
+    close(epoll_fd);
+
+    if(stats_timer_fd >= 0) {
+        close(stats_timer_fd);
+    }
+
+    if(capture_file != NULL) {
+        fclose(capture_file);
+    }
+
+    if(replay_file != NULL) {
+        fclose(replay_file);
+    }
+
+    if(journal_timer_fd >= 0) {
+        close(journal_timer_fd);
+    }
+
+    if(set_event_fd >= 0) {
+        close(set_event_fd);
+    }
 
     mosquitto_loop_stop(mqtt, true);
+    JournalClose(&journal);
+    PublishQueueFree(&publish_queue);
+    PublishQueueFree(&large_queue);
+
+    if(metrics_address != NULL) {
+        MetricsServerClose(&metrics_server);
+    }
 
     mosquitto_destroy(mqtt);
     mosquitto_lib_cleanup();
@@ -592,5 +3726,4 @@ int main ()
     return (EXIT_SUCCESS);
 
 }
-
-
+#endif